@@ -248,12 +248,7 @@ int main (int argc, char **argv)
 
     // Wait until scan is complete.
     printf ("Waiting for scan to complete...\n");
-    int status;
-    do {
-        status=pb_read_status();
-        printf ("status=0x%.2x (experiment in progress)\n", status);
-        pb_sleep_ms(400);
-    } while (status != 0x03); // 0x03 is STOPPED and RESET, this means the scan and pulse program are complete
+    pb_wait_idle (-1, NULL);
 
     // Find out if overflows occurred in the ADC while capturing data
     pb_overflow(0, &of);
@@ -81,10 +81,7 @@ int main(void)
    
    printf("Waiting for the data acquisition to complete.\n");
             
-   while(pb_read_status() != BOARD_STATUS_IDLE) //Wait for the board to complete execution.
-   {
-      pb_sleep_ms(100);
-   }
+   pb_wait_idle(-1, NULL); //Wait for the board to complete execution.
    
    pb_get_data_direct(NUMBER_POINTS,data);
    
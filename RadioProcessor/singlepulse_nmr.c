@@ -63,10 +63,7 @@ int main(int argc, char* argv[])
         if(myScan->verbose) 
             printf("Waiting for the data acquisition to complete.\n");
             
-        while(pb_read_status() != BOARD_STATUS_IDLE) //Wait for the board to complete execution.
-        {
-            pb_sleep_ms(100);
-        }
+        pb_wait_idle(-1, NULL); //Wait for the board to complete execution.
             
     	if(myScan->enable_rx)
 		{
@@ -0,0 +1,156 @@
+/* buildertest.cpp
+ *
+ * This program builds the same pulse program through the pb_inst* functions and
+ * through the builders of spinapi.hpp, checks that the IMWs are the same, and
+ * compares how long each takes per instruction.
+ *
+ * This code is used for our own internal debugging procedures. It is of no use to customers.
+ *
+ * Build it against the library sources, choosing the layout of the board with
+ * -DLAYOUT (Usb128 by default), e.g.
+ *   g++ -std=c++14 -O2 -DLAYOUT=Pci80 -o buildertest buildertest.cpp <spinapi objects>
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "spinapi.hpp"
+
+extern "C"
+{
+#include "prog.h"
+}
+
+#ifndef LAYOUT
+#define LAYOUT Usb128
+#endif
+
+#define CLOCK 100.0		// MHz
+#define NUM_INSTS 1000
+#define NUM_RUNS 100
+
+typedef spinapi::fixed::LAYOUT Layout;
+
+static double
+ns_per_inst (std::chrono::steady_clock::duration d)
+{
+  return std::chrono::duration < double, std::nano > (d).count ()
+    / ((double) NUM_INSTS * NUM_RUNS);
+}
+
+// The program of both paths: a loop over pulses of all flags, which ends
+// by branching back to the start
+static void
+c_program ()
+{
+  pb_inst_pbonly (0x0, LOOP, NUM_INSTS, 100.0);
+  for (int i = 1; i < NUM_INSTS - 2; i++)
+    {
+      pb_inst_pbonly (i & 0xFFFFFF, CONTINUE, 0, 50.0 + 10.0 * i);
+    }
+  pb_inst_pbonly (0x0, END_LOOP, 0, 100.0);
+  pb_inst_pbonly (0x0, BRANCH, 0, 100.0);
+}
+
+static void
+cpp_program (spinapi::Program < Layout > &prog)
+{
+  using spinapi::Op;
+  using spinapi::PulseInst;
+
+  int loop = prog.add (PulseInst ().op (Op::Loop, NUM_INSTS).length (100.0 * ns));
+  for (int i = 1; i < NUM_INSTS - 2; i++)
+    {
+      prog.add (PulseInst ().flags (i & 0xFFFFFF).length (50.0 + 10.0 * i));
+    }
+  prog.add (PulseInst ().op (Op::EndLoop, loop).length (100.0 * ns));
+  prog.add (PulseInst ().op (Op::Branch, 0).length (100.0 * ns));
+}
+
+int
+main ()
+{
+  try
+  {
+    spinapi::Board board (0, CLOCK);
+    spinapi::Program < Layout > prog (CLOCK, true, NUM_INSTS);
+    std::vector < char >c_imws ((size_t) NUM_INSTS * Layout::imw_bytes);
+
+    pb_bypass_FF_fix (1);
+
+    std::chrono::steady_clock::duration c_time (0);
+    for (int run = 0; run < NUM_RUNS; run++)
+      {
+	pb_start_programming (PULSE_PROGRAM);
+	auto start = std::chrono::steady_clock::now ();
+	c_program ();
+	c_time += std::chrono::steady_clock::now () - start;
+	if (run == 0)
+	  {
+	    memcpy (c_imws.data (), prog_data (0), c_imws.size ());
+	  }
+	pb_stop_programming ();
+      }
+    auto t1 = std::chrono::steady_clock::now ();
+    for (int run = 0; run < NUM_RUNS; run++)
+      {
+	prog.clear ();
+	cpp_program (prog);
+      }
+    auto t2 = std::chrono::steady_clock::now ();
+
+    if (prog.num_insts () != NUM_INSTS
+	|| memcmp (c_imws.data (), prog.imws (), c_imws.size ()) != 0)
+      {
+	printf ("%s: IMWs of the two paths differ\n", Layout::name ());
+	return -1;
+      }
+
+    board.write (prog);
+    if (memcmp (c_imws.data (), prog_data (0), c_imws.size ()) != 0)
+      {
+	printf ("%s: IMWs written by Board::write differ\n", Layout::name ());
+	return -1;
+      }
+
+    printf ("%s: %d instructions, identical IMWs\n", Layout::name (),
+	    NUM_INSTS);
+    printf ("pb_inst_pbonly:    %8.1f ns per instruction\n",
+	    ns_per_inst (c_time));
+    printf ("Program::add:      %8.1f ns per instruction\n",
+	    ns_per_inst (t2 - t1));
+  }
+  catch (const std::exception & e)
+  {
+    printf ("Error: %s\n", e.what ());
+    return -1;
+  }
+
+  return 0;
+}
@@ -33,6 +33,7 @@
 #include "util.h"
 #include "if.h"
 #include "usb.h"
+#include "encode.h"
 
 extern char *spinerr;
 
@@ -811,5 +812,8 @@ get_caps (BOARD_INFO * board, int dev_id)
 
     }				// end of switch (dev_id)
 
+  // Now that the firmware is known, decide how instructions are encoded
+  select_encoder (board);
+
   return 0;
 }
@@ -37,6 +37,43 @@
 #define DDS_PROG_OLDPB   0
 #define DDS_PROG_EXTREG  1
 
+// Largest instruction memory word produced by any of the encoders, in bytes
+#define IMW_MAX_BYTES 32
+
+// An instruction encoder knows how a particular firmware lays out the
+// instruction memory word (IMW) of its PulseBlaster core. get_caps() picks
+// one for each board, so the pulse program functions never need to test the
+// firmware id themselves. The encoders are implemented in encode.c.
+typedef struct
+{
+  const char *name;
+  int num_IMW_bytes;	/** bytes making up one instruction (the BPW written by pb_start_programming() on PCI boards) */
+
+  /** Write the IMW for one instruction into imw (at least IMW_MAX_BYTES
+      long, int aligned). Returns the number of bytes written, or a negative
+      number if the instruction can not be encoded (and sets spinerr). */
+  int (*serialize) (const int *pflags, int inst, int inst_data,
+		    unsigned int delay, unsigned char *imw);
+
+  /** Same as serialize, for the 32 bit words of the PulseBlaster 4C
+      designs. NULL if the board is not one of those. */
+  int (*serialize_4C) (int flag, int inst, unsigned int delay,
+		       unsigned char *imw);
+
+  /** Rearrange the output flag bits to match the firmware */
+  void (*pack_flags) (int *pflags);
+
+  /** Build the flag words of a DDS-II style instruction. NULL if the board
+      does not support pb_inst_dds2(). */
+  void (*pack_dds2) (int *flag_word, int flags,
+		     int freq0, int phase0, int amp0, int dds_en0,
+		     int phase_reset0, int shape_period0,
+		     int freq1, int phase1, int amp1, int dds_en1,
+		     int phase_reset1, int shape_period1);
+
+  int radio_via_dds2;	/** nonzero if pb_inst_radio() must be translated to pb_inst_dds2() */
+} IMW_ENCODER;
+
 // Note: this structure should not be made available to the user, since
 // otherwise we could not guarantee binary compatibility
 typedef struct
@@ -57,6 +94,10 @@ typedef struct
   //bugfixes
   int has_FF_fix;	/** PB Core "1FF" issue status (equal to 1 if the board has the fix) */
 
+  // instruction encoding, chosen by get_caps()
+  const IMW_ENCODER *encoder;	/** how pulse instructions are laid out for this firmware */
+  unsigned int (*fix_delay) (unsigned int delay);	/** applies the "1FF" fix if has_FF_fix is not set */
+
   // pusle program limits
   int num_instructions;	      /** number of pulse instructions the design can hold **/
   int num_IMW_bytes;          /** number of bytes making up the internal memory word **/
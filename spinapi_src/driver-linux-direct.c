@@ -219,6 +219,27 @@ os_outp (int card_num, unsigned int address, char data)
   return 0;
 }
 
+/**
+ * Write a block of bytes to the same address of the given card. This is
+ * used to stream data into the PulseBlaster core, and is done with a single
+ * "rep outsb" instead of one outb_p() per byte.
+ * \return -1 on error
+ */
+int
+os_outp_block (int card_num, unsigned int address, const char *data, int len)
+{
+  if (card_num >= num_cards || card_num < 0)
+    {
+      spinerr = "Card number out of range";
+      debug ("os_outp_block: %s\n", spinerr);
+      return -1;
+    }
+
+  outsb (base_addr_array[card_num] + address, data, len);
+
+  return 0;
+}
+
 /**
  * Read a byte of data from the given card, at the given address
  * \return value from IO address
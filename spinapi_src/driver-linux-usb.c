@@ -231,3 +231,42 @@ int os_usb_read(int dev_num, int pipe, void *data, int size)
 
     return  0;
 }
+
+/**
+ * Transfer data to or from the USB device. libusb-0.1 can only do this
+ * synchronously, so the transfer has completed when this returns.
+ * \param pipe Endpoint to transfer data to or from. Reads are made from
+ * endpoints with bit 7 set.
+ * \param data Buffer holding the data to be written, or to hold the data that
+ * will be read
+ * \param size Size in bytes of the buffer
+ * \returns 0 on success, or a negative number on failure
+ */
+int os_usb_submit(int dev_num, int pipe, void *data, int size)
+{
+    if (pipe & 0x80)
+        return os_usb_read(dev_num, pipe, data, size);
+
+    return os_usb_write(dev_num, pipe, data, size);
+}
+
+/**
+ * Wait for the transfers started with os_usb_submit() to complete. They
+ * always have with libusb-0.1.
+ * \param pipe Endpoint to wait for, or 0 to wait for all of them
+ * \returns 0 on success, or a negative number on failure
+ */
+int os_usb_wait(int dev_num, int pipe)
+{
+    return 0;
+}
+
+/**
+ * Largest number of bytes worth handing to os_usb_write() or os_usb_read() in
+ * one call. libusb-0.1 accepts any size, but splits bulk transfers into
+ * pieces of 16 kB itself.
+ */
+int os_usb_max_xfer_size(int dev_num)
+{
+    return 16384;
+}
@@ -0,0 +1,514 @@
+/* driver-linux-usb1.c
+ *
+ * This file implements the low-level usb interface functions on Linux using
+ * libusb-1.0. Transfers are submitted asynchronously, so that several of them
+ * can be on the wire at once, see os_usb_submit().
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libusb-1.0/libusb.h>
+
+#include "driver-usb.h"
+#include "usb.h"
+#include "util.h"
+
+#define VENDOR_ID 0x0403
+#define MAX_IO_WAIT_TIME 500	// Max time a single transfer may take, in milliseconds
+#define MAX_USB 128
+#define MAX_TRANSFERS 64	// Max number of transfers in flight on one device
+#define MAX_XFER_SIZE 65536	// Max size of a single transfer, in bytes
+
+// The endpoints the boards provide, in the order their queues are kept
+#define NUM_PIPES 3
+static const int pipes[NUM_PIPES] = { EP1OUT, EP2OUT, EP6IN };
+
+extern char *spinerr;
+
+// An open device, and the transfers which are on the wire for it
+typedef struct
+{
+  libusb_device_handle *handle;
+  int in_flight[NUM_PIPES];	/** number of transfers submitted to each endpoint which have not completed */
+  int failed[NUM_PIPES];	/** nonzero if a transfer to the endpoint failed since it was last waited for */
+  struct libusb_transfer *free_transfers[MAX_TRANSFERS];
+  int num_free;			/** number of transfers in free_transfers */
+  int num_allocated;		/** number of transfers allocated for this device */
+} USB_DEVICE;
+
+static libusb_context *context = NULL;
+static libusb_device *found[MAX_USB];	/** SpinCore devices found by the last os_usb_count_devices() */
+static int num_found = -1;		/** number of devices in found, or -1 before the bus was scanned */
+static USB_DEVICE devices[MAX_USB];
+
+/**
+ * \internal
+ * \return The index of the queue of an endpoint, or -1 if the boards do not
+ * have it
+ */
+static int
+pipe_index (int pipe)
+{
+  int i;
+
+  for (i = 0; i < NUM_PIPES; i++)
+    {
+      if (pipes[i] == pipe)
+	return i;
+    }
+
+  return -1;
+}
+
+/**
+ * \internal
+ * Called by libusb from within libusb_handle_events() when a transfer has
+ * completed, failed or timed out.
+ */
+static void LIBUSB_CALL
+transfer_done (struct libusb_transfer *transfer)
+{
+  USB_DEVICE *dev = (USB_DEVICE *) transfer->user_data;
+  int index = pipe_index (transfer->endpoint);
+
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+      debug ("transfer_done: transfer to endpoint 0x%X failed (status %d)\n",
+	     transfer->endpoint, transfer->status);
+      dev->failed[index] = 1;
+    }
+
+  dev->in_flight[index]--;
+  dev->free_transfers[dev->num_free++] = transfer;
+}
+
+/**
+ * \internal
+ * \return Nonzero while the transfers handle_events() waits for are busy
+ */
+static int
+busy (USB_DEVICE * dev, int index)
+{
+  int i;
+
+  if (index < 0)
+    {
+      return dev->num_free == 0 && dev->num_allocated == MAX_TRANSFERS;
+    }
+
+  if (index < NUM_PIPES)
+    {
+      return dev->in_flight[index];
+    }
+
+  for (i = 0; i < NUM_PIPES; i++)
+    {
+      if (dev->in_flight[i])
+	return 1;
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Handle completed transfers until none of the given endpoint are in flight
+ * any more.
+ *
+ * \param index Queue to wait for, NUM_PIPES for all of them, or -1 to wait
+ * until a transfer can be reused
+ * \return 0 on success, or a negative number if libusb failed
+ */
+static int
+handle_events (USB_DEVICE * dev, int index)
+{
+  while (busy (dev, index))
+    {
+      if (libusb_handle_events (context) < 0)
+	{
+	  spinerr = "USB event handling failed.";
+	  debug ("handle_events: %s\n", spinerr);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Make sure libusb is initialized.
+ *
+ * \return 0 on success, or a negative number on failure
+ */
+static int
+open_context (void)
+{
+  if (context)
+    {
+      return 0;
+    }
+
+  if (libusb_init (&context) < 0)
+    {
+      context = NULL;
+      spinerr = "Could not initialize libusb.";
+      debug ("open_context: %s\n", spinerr);
+      return -1;
+    }
+
+  return 0;
+}
+
+/**
+ * Count SpinCore devices on the USB bus. The devices found are remembered, so
+ * that os_usb_init() does not have to scan the bus again.
+ */
+int
+os_usb_count_devices (int vendor_id)
+{
+  struct libusb_device_descriptor descriptor;
+  libusb_device **list;
+  ssize_t num_devices;
+  ssize_t i;
+
+  debug ("os_usb_count_devices called\n");
+
+  if (open_context () < 0)
+    {
+      return 0;
+    }
+
+  for (i = 0; i < num_found; i++)
+    {
+      libusb_unref_device (found[i]);
+    }
+  num_found = 0;
+
+  num_devices = libusb_get_device_list (context, &list);
+  if (num_devices < 0)
+    {
+      debug ("os_usb_count_devices: can't get device list\n");
+      return 0;
+    }
+
+  for (i = 0; i < num_devices && num_found < MAX_USB; i++)
+    {
+      if (libusb_get_device_descriptor (list[i], &descriptor) == 0
+	  && descriptor.idVendor == VENDOR_ID)
+	{
+	  found[num_found++] = libusb_ref_device (list[i]);
+	}
+    }
+
+  libusb_free_device_list (list, 1);
+
+  return num_found;
+}
+
+/**
+ * Unique USB device identifier is idVendor << 16 | idProduct
+ *
+ * \returns A negative number is returned on error and spinerr is set to a
+ * description of the error. The product id of the device is returned on
+ * success.
+ */
+int
+os_usb_init (int dev_num)
+{
+  struct libusb_device_descriptor descriptor;
+  USB_DEVICE *dev;
+
+  debug ("os_usb_init called\n");
+
+  if (num_found < 0)
+    {
+      os_usb_count_devices (VENDOR_ID);
+    }
+
+  if (dev_num < 0 || dev_num >= num_found)
+    {
+      debug ("os_usb_init: device not found.\n");
+      spinerr = "Device not found.";
+      return -1;
+    }
+
+  dev = &devices[dev_num];
+  if (libusb_get_device_descriptor (found[dev_num], &descriptor) < 0)
+    {
+      spinerr = "Could not read device descriptor.";
+      debug ("os_usb_init: %s\n", spinerr);
+      return -1;
+    }
+
+  if (!dev->handle && libusb_open (found[dev_num], &dev->handle) < 0)
+    {
+      dev->handle = NULL;
+      spinerr = "Handle failed.";
+      debug ("os_usb_init: handle not set.\n");
+      return -1;
+    }
+
+  /* Only interface the boards provide. */
+  if (libusb_claim_interface (dev->handle, 0) < 0)
+    {
+      debug ("os_usb_init: could not claim interface.\n");
+      spinerr = "Could not claim interface.";
+      return -1;
+    }
+
+  return descriptor.idProduct;
+}
+
+int
+os_usb_close ()
+{
+  USB_DEVICE *dev;
+  int i;
+
+  debug ("os_usb_close called\n");
+
+  for (i = 0; i < MAX_USB; i++)
+    {
+      dev = &devices[i];
+      if (!dev->handle)
+	continue;
+
+      debug ("os_usb_close: closing device %d\n", i);
+
+      handle_events (dev, NUM_PIPES);
+      while (dev->num_free > 0)
+	{
+	  libusb_free_transfer (dev->free_transfers[--dev->num_free]);
+	}
+      dev->num_allocated = 0;
+
+      if (libusb_release_interface (dev->handle, 0) < 0)
+	return -2;
+      libusb_close (dev->handle);
+      dev->handle = NULL;
+    }
+
+  // Nothing is open any more, so the devices found and libusb itself are
+  // let go of as well. The bus is scanned again by the next os_usb_init().
+  for (i = 0; i < num_found; i++)
+    {
+      libusb_unref_device (found[i]);
+    }
+  num_found = -1;
+
+  if (context)
+    {
+      libusb_exit (context);
+      context = NULL;
+    }
+
+  return 0;
+}
+
+int
+os_usb_reset_pipes (int dev_num)
+{
+  USB_DEVICE *dev = &devices[dev_num];
+  int i;
+
+  debug ("os_usb_reset_pipes called\n");
+
+  if (handle_events (dev, NUM_PIPES) < 0)
+    return -1;
+
+  for (i = 0; i < NUM_PIPES; i++)
+    {
+      dev->failed[i] = 0;
+      if (libusb_clear_halt (dev->handle, pipes[i]) < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+/**
+ * Queue a transfer to or from the USB device, and return without waiting for
+ * it. Transfers to the same endpoint are carried out in the order they were
+ * queued, but transfers to different endpoints can overtake each other, so
+ * the caller must use os_usb_wait() where that matters. os_usb_write() and
+ * os_usb_read() wait for everything queued before them.
+ *
+ * \param pipe Endpoint to transfer data to or from. Reads are made from
+ * endpoints with bit 7 set.
+ * \param data Buffer holding the data to be written, or to hold the data that
+ * will be read. It must not be touched until os_usb_wait() has returned.
+ * \param size Size in bytes of the buffer
+ * \returns 0 on success, or a negative number on failure
+ */
+int
+os_usb_submit (int dev_num, int pipe, void *data, int size)
+{
+  USB_DEVICE *dev = &devices[dev_num];
+  struct libusb_transfer *transfer;
+  int index = pipe_index (pipe);
+
+  debug ("os_usb_submit(dev_num = %d, pipe = 0x%X, data, size = %d)\n",
+	 dev_num, pipe, size);
+
+  if (!dev->handle || index < 0)
+    {
+      spinerr = "Device not initialized";
+      debug ("os_usb_submit: %s\n", spinerr);
+      return -1;
+    }
+
+  // Reuse a transfer which has completed, and only allocate more while
+  // there are fewer than MAX_TRANSFERS of them
+  if (dev->num_free == 0 && dev->num_allocated == MAX_TRANSFERS)
+    {
+      if (handle_events (dev, -1) < 0)
+	return -1;
+    }
+
+  if (dev->num_free > 0)
+    {
+      transfer = dev->free_transfers[--dev->num_free];
+    }
+  else
+    {
+      transfer = libusb_alloc_transfer (0);
+      if (!transfer)
+	{
+	  spinerr = "Could not allocate USB transfer.";
+	  debug ("os_usb_submit: %s\n", spinerr);
+	  return -1;
+	}
+      dev->num_allocated++;
+    }
+
+  libusb_fill_bulk_transfer (transfer, dev->handle, (unsigned char) pipe,
+			     (unsigned char *) data, size, transfer_done, dev,
+			     MAX_IO_WAIT_TIME);
+
+  if (libusb_submit_transfer (transfer) < 0)
+    {
+      dev->free_transfers[dev->num_free++] = transfer;
+      spinerr = (pipe & 0x80) ? "Read error." : "write error.";
+      debug ("os_usb_submit: %s\n", spinerr);
+      return -1;
+    }
+
+  dev->in_flight[index]++;
+
+  return 0;
+}
+
+/**
+ * Wait until the transfers queued with os_usb_submit() have completed.
+ *
+ * \param pipe Endpoint to wait for, or 0 to wait for all of them
+ * \returns 0 on success, or a negative number if any of the transfers failed
+ */
+int
+os_usb_wait (int dev_num, int pipe)
+{
+  USB_DEVICE *dev = &devices[dev_num];
+  int index = pipe ? pipe_index (pipe) : NUM_PIPES;
+  int failed = 0;
+  int i;
+
+  if (!dev->handle || index < 0)
+    {
+      spinerr = "Device not initialized";
+      debug ("os_usb_wait: %s\n", spinerr);
+      return -1;
+    }
+
+  if (handle_events (dev, index) < 0)
+    {
+      return -1;
+    }
+
+  for (i = 0; i < NUM_PIPES; i++)
+    {
+      if ((index == NUM_PIPES || index == i) && dev->failed[i])
+	{
+	  spinerr = (pipes[i] & 0x80) ? "Read error." : "write error.";
+	  debug ("os_usb_wait: %s (endpoint 0x%X)\n", spinerr, pipes[i]);
+	  dev->failed[i] = 0;
+	  failed = 1;
+	}
+    }
+
+  return failed ? -1 : 0;
+}
+
+/**
+ * Write data to the USB device
+ * \param pipe endpoint to write data too
+ * \param data buffer holding data to be written
+ * \param size Size in bytes of the buffer
+ * \returns 0 on success, or a negative number on failure
+ */
+int
+os_usb_write (int dev_num, int pipe, void *data, int size)
+{
+  debug ("os_usb_write(dev_num = %d, pipe = 0x%X, data, size = %d)\n",
+	 dev_num, pipe, size);
+
+  if (os_usb_wait (dev_num, 0) < 0 || os_usb_submit (dev_num, pipe, data, size) < 0)
+    return -1;
+
+  return os_usb_wait (dev_num, pipe);
+}
+
+/**
+ * Read data from the USB device.
+ * \param pipe Endpoint to read data from
+ * \param data Buffer to hold the data that will be read
+ * \param size Size in bytes of data to read
+ * \returns 0 on success, or a negative number on failure
+ */
+int
+os_usb_read (int dev_num, int pipe, void *data, int size)
+{
+  debug ("os_usb_read(dev_num = %d, pipe = 0x%X, data, size = %d)\n",
+	 dev_num, pipe, size);
+
+  if (os_usb_wait (dev_num, 0) < 0 || os_usb_submit (dev_num, pipe, data, size) < 0)
+    return -1;
+
+  return os_usb_wait (dev_num, pipe);
+}
+
+/**
+ * Largest number of bytes that can be handed to os_usb_write(),
+ * os_usb_read() or os_usb_submit() in one call. libusb splits larger
+ * transfers into packets itself, so this only bounds how long one transfer
+ * may take against MAX_IO_WAIT_TIME.
+ */
+int
+os_usb_max_xfer_size (int dev_num)
+{
+  return MAX_XFER_SIZE;
+}
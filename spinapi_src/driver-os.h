@@ -37,6 +37,11 @@ int os_init (int card_num);
 int os_close (int card_num);
 
 int os_outp (int card_num, unsigned int address, char data);
+#ifndef WINDOWS
+// Not in the precompiled Windows driver, see outp_stream_flush()
+int os_outp_block (int card_num, unsigned int address, const char *data,
+		   int len);
+#endif
 char os_inp (int card_num, unsigned int address);
 
 int os_outw (int card_num, unsigned int addresss, unsigned int data);
@@ -107,6 +107,19 @@ os_outp (int card_num, unsigned int address, char data)
   return 0;
 }
 
+/**
+ * Write len bytes of data to the given card, all at the same address. This
+ * should be done as fast as the os allows (for example with a string i/o
+ * instruction) since it is used to stream data into the PulseBlaster core.
+ * \return -1 on error
+ */
+
+int
+os_outp_block (int card_num, unsigned int address, const char *data, int len)
+{
+  return 0;
+}
+
 /**
  * Read a byte of data from the given card, at the given address
  * \return value from IO address
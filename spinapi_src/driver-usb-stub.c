@@ -88,3 +88,42 @@ os_usb_read (int dev_num, int pipe, void *data, int size)
 {
   return 0;
 }
+
+/**
+ * Start a transfer to or from the USB device, without waiting for it to
+ * complete. Transfers to the same endpoint must be carried out in order.
+ * Drivers which can not do this may simply make the transfer here.
+ * \param pipe Endpoint to transfer data to or from. Reads are made from
+ * endpoints with bit 7 set.
+ * \param data Buffer holding the data to be written, or to hold the data that
+ * will be read. It is not touched by the caller until os_usb_wait() returns.
+ * \param size Size in bytes of the buffer
+ * \returns 0 on success, or a negative number on failure
+ */
+int
+os_usb_submit (int dev_num, int pipe, void *data, int size)
+{
+  return 0;
+}
+
+/**
+ * Wait for the transfers started with os_usb_submit() to complete.
+ * \param pipe Endpoint to wait for, or 0 to wait for all of them
+ * \returns 0 on success, or a negative number if any of the transfers failed
+ */
+int
+os_usb_wait (int dev_num, int pipe)
+{
+  return 0;
+}
+
+/**
+ * Largest number of bytes that can be handed to os_usb_write(),
+ * os_usb_read() or os_usb_submit() in one call.
+ * \returns A multiple of the 512 byte packet size
+ */
+int
+os_usb_max_xfer_size (int dev_num)
+{
+  return 512;
+}
@@ -460,6 +460,47 @@ os_usb_read (int dev_num, int pipe, void *data, int size)
 
 }
 
+/**
+ * Transfer data to or from the USB device. The transfer has completed when
+ * this returns.
+ * \param pipe Endpoint to transfer data to or from. Reads are made from
+ * endpoints with bit 7 set.
+ * \param data Buffer holding the data to be written, or to hold the data that
+ * will be read
+ * \param size Size in bytes of the buffer
+ * \returns 0 on success, or a negative number on failure
+ */
+int
+os_usb_submit (int dev_num, int pipe, void *data, int size)
+{
+  if (pipe & 0x80)
+    return os_usb_read (dev_num, pipe, data, size);
+
+  return os_usb_write (dev_num, pipe, data, size);
+}
+
+/**
+ * Wait for the transfers started with os_usb_submit() to complete. They
+ * always have with this driver.
+ * \param pipe Endpoint to wait for, or 0 to wait for all of them
+ * \returns 0 on success, or a negative number on failure
+ */
+int
+os_usb_wait (int dev_num, int pipe)
+{
+  return 0;
+}
+
+/**
+ * Largest number of bytes that can be handed to os_usb_write() or
+ * os_usb_read() in one call.
+ */
+int
+os_usb_max_xfer_size (int dev_num)
+{
+  return MAX_XFER_SIZE;
+}
+
 ///
 /// The following functions a wrappers for each of the IOCTL functions that the Cypress
 /// driver provides
@@ -35,6 +35,9 @@ int os_usb_init (int dev_num);
 int os_usb_close ();
 int os_usb_write (int dev_num, int pipe, void *data, int size);
 int os_usb_read (int dev_num, int pipe, void *data, int size);
+int os_usb_submit (int dev_num, int pipe, void *data, int size);
+int os_usb_wait (int dev_num, int pipe);
+int os_usb_max_xfer_size (int dev_num);
 int os_usb_reset_pipes (int dev_num);
 
 #endif /*DRIVER_USB_H_ */
@@ -0,0 +1,403 @@
+/* encode.c
+ * This module turns pulse program instructions into the instruction memory
+ * words (IMWs) understood by the different PulseBlaster core designs. The
+ * encoder for a board is chosen once by get_caps(), based on the firmware id.
+ * To support a new IMW layout, add an encoder here and select it in
+ * select_encoder().
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spinapi.h"
+#include "util.h"
+#include "caps.h"
+#include "encode.h"
+
+/**
+ * \internal
+ * Check the opcode and data fields of an instruction for the PCI layouts.
+ *
+ * \return -1 on failure (and spinerr is set), 0 on success
+ */
+static int
+check_opcode (int inst, int inst_data)
+{
+  if (inst > 8)
+    {
+      spinerr = "Invalid opcode";
+      debug ("%s\n", spinerr);
+      return -1;
+    }
+  if (inst_data != (inst_data & 0x0FFFFF))
+    {
+      spinerr = "Instruction is limited to 20 bits";
+      debug ("%s\n", spinerr);
+      return -1;
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Write the opcode (3 bytes) and delay (4 bytes) fields, most significant
+ * byte first. These are the same for all PCI layouts.
+ */
+static void
+put_opcode_delay (unsigned char *imw, int inst, int inst_data,
+		  unsigned int delay)
+{
+  unsigned int opcode = (inst) | (inst_data << 4);
+
+  imw[0] = (opcode >> 16) & 0xFF;
+  imw[1] = (opcode >> 8) & 0xFF;
+  imw[2] = opcode & 0xFF;
+
+  imw[3] = (delay >> 24) & 0xFF;
+  imw[4] = (delay >> 16) & 0xFF;
+  imw[5] = (delay >> 8) & 0xFF;
+  imw[6] = delay & 0xFF;
+}
+
+// 80 bit IMW: 24 flag bits, 24 opcode bits, 32 delay bits
+static int
+serialize_pci10 (const int *pflags, int inst, int inst_data,
+		 unsigned int delay, unsigned char *imw)
+{
+  int flags = pflags[0];
+
+  if (flags != (flags & 0x0FFFFFF))
+    {
+      spinerr = "Flag word is limited to 24 bits";
+      debug ("%s\n", spinerr);
+      return -1;
+    }
+  if (check_opcode (inst, inst_data) != 0)
+    {
+      return -1;
+    }
+
+  imw[0] = (flags >> 16) & 0xFF;
+  imw[1] = (flags >> 8) & 0xFF;
+  imw[2] = flags & 0xFF;
+  put_opcode_delay (imw + 3, inst, inst_data, delay);
+
+  return 10;
+}
+
+// 88 bit IMW (RadioProcessor 10-19 and 12-16): 32 flag bits
+static int
+serialize_pci11 (const int *pflags, int inst, int inst_data,
+		 unsigned int delay, unsigned char *imw)
+{
+  unsigned int flags = pflags[0];
+
+  if (check_opcode (inst, inst_data) != 0)
+    {
+      return -1;
+    }
+
+  imw[0] = (flags >> 24) & 0xFF;
+  imw[1] = (flags >> 16) & 0xFF;
+  imw[2] = (flags >> 8) & 0xFF;
+  imw[3] = flags & 0xFF;
+  put_opcode_delay (imw + 4, inst, inst_data, delay);
+
+  return 11;
+}
+
+// 64 bit IMW (PulseBlasterESR 9-8): 8 flag bits
+static int
+serialize_pci8 (const int *pflags, int inst, int inst_data,
+		unsigned int delay, unsigned char *imw)
+{
+  int flags = pflags[0];
+
+  if (flags != (flags & 0x0FFFFFF))
+    {
+      spinerr = "Flag word is limited to 24 bits";
+      debug ("%s\n", spinerr);
+      return -1;
+    }
+  if (check_opcode (inst, inst_data) != 0)
+    {
+      return -1;
+    }
+
+  imw[0] = flags & 0xFF;
+  put_opcode_delay (imw + 1, inst, inst_data, delay);
+
+  return 8;
+}
+
+// 32 bit IMW of the PulseBlaster 4C designs (11-5, 11-6 and 11-7):
+//  |  31  |   30    | 29 .. 0 |
+//  | Flag | Op-Code |  Delay  |
+static int
+serialize_4C (int flag, int inst, unsigned int delay, unsigned char *imw)
+{
+  if (delay > PB4C_MAX_DELAY || delay < 2)
+    {
+      spinerr = "Instruction delay will not work with your board";
+      debug ("%s\n", spinerr);
+      return -91;
+    }
+
+  imw[0] = ((flag & 0x1) << 7) | ((inst & 0x1) << 6) | ((delay >> 24) & 0x3F);
+  imw[1] = (delay >> 16) & 0xFF;
+  imw[2] = (delay >> 8) & 0xFF;
+  imw[3] = delay & 0xFF;
+
+  return 4;
+}
+
+/**
+ * \internal
+ * IMW of the boards using usb_method 2. The instruction is made up of 32 bit
+ * words which are written to the board as is, least significant word first.
+ */
+static int
+serialize_usb (const int *pflags, int inst, int inst_data, unsigned int delay,
+	       int *instruction, int nwords)
+{
+  int i;
+
+  instruction[0] = delay;
+  instruction[1] = (0xF & inst) | ((0xFFFFF & inst_data) << 4) | ((0xFF & pflags[0]) << 24);
+  instruction[2] = ((0xFFFFFF & (pflags[0] >> 8)) << 0) | ((pflags[1] & 0xFF) << 24);
+  instruction[3] = ((0xFFFFFF & (pflags[1] >> 8)) << 0) | ((pflags[2] & 0xFF) << 24);
+
+  for (i = 4; i < nwords; i++)
+    {
+      instruction[i] = 0;
+    }
+
+  debug ("IMW: 0x%X %X %X %X.\n", instruction[3], instruction[2],
+	 instruction[1], instruction[0]);
+
+  return nwords * sizeof (int);
+}
+
+static int
+serialize_usb4 (const int *pflags, int inst, int inst_data,
+		unsigned int delay, unsigned char *imw)
+{
+  return serialize_usb (pflags, inst, inst_data, delay, (int *) imw, 4);
+}
+
+// DDS-II 14-3 has a 256 bit IMW
+static int
+serialize_usb8 (const int *pflags, int inst, int inst_data,
+		unsigned int delay, unsigned char *imw)
+{
+  return serialize_usb (pflags, inst, inst_data, delay, (int *) imw, 8);
+}
+
+static void
+pack_flags_none (int *pflags)
+{
+}
+
+// SP16 Designs 15-1, 15-2, and 15-3 have Flag0 and Flag1 reversed in Firmware
+static void
+pack_flags_sp16 (int *pflags)
+{
+  pflags[0] = (pflags[0] & 0xFFFFFFFC) + ((pflags[0] & 0x01) << 1) + ((pflags[0] & 0x02) >> 1);
+  pflags[1] = 0;
+}
+
+// DDS-II 14-1 and 14-2
+static void
+pack_dds2_e01 (int *flag_word, int flags,
+	       int freq0, int phase0, int amp0, int dds_en0,
+	       int phase_reset0, int shape_period0,
+	       int freq1, int phase1, int amp1, int dds_en1,
+	       int phase_reset1, int shape_period1)
+{
+  flag_word[0] = flag_word[1] = flag_word[2] = 0;
+
+  flag_word[0] |= (flags & 0xFFF) << 0;
+  flag_word[0] |= (dds_en0 & 0x1) << 12;
+  flag_word[0] |= (dds_en1 & 0x1) << 13;
+  flag_word[0] |= (phase_reset0 & 0x1) << 14;
+  flag_word[0] |= (phase_reset1 & 0x1) << 15;
+  flag_word[0] |= (freq0 & 0xF) << 16;
+  flag_word[0] |= (freq1 & 0xF) << 20;
+  flag_word[0] |= (phase0 & 0x7) << 24;
+  flag_word[0] |= (phase1 & 0x7) << 27;
+  flag_word[0] |= (amp0 & 0x3) << 30;
+
+  flag_word[1] |= (amp1 & 0x3) << 0;
+  flag_word[1] |= (shape_period0 & 0x7) << 2;
+  flag_word[1] |= (shape_period1 & 0x7) << 5;
+}
+
+// PulseBlasterDDS-I-300 USB 12-19. This board has a single DDS channel.
+static void
+pack_dds2_0C13 (int *flag_word, int flags,
+		int freq0, int phase0, int amp0, int dds_en0,
+		int phase_reset0, int shape_period0,
+		int freq1, int phase1, int amp1, int dds_en1,
+		int phase_reset1, int shape_period1)
+{
+  flag_word[0] = flag_word[1] = flag_word[2] = 0;
+
+  flag_word[0] |= (flags & 0xF) << 0;        // 4 Flag Bits
+  flag_word[0] |= (dds_en0 & 0x1) << 4;      // DDS Tx Enable
+  flag_word[0] |= (phase_reset0 & 0x1) << 5; // Phase Reset
+  flag_word[0] |= (freq0 & 0x3FF) << 6;      // 10 Frequency Select Bits (1024 Freq. Registers)
+  flag_word[0] |= (phase0 & 0x7F) << 16;     // 7 Phase Select Bits (128 Phase Registers)
+  flag_word[0] |= (amp0 & 0x1FF) << 23;      // lower 9 of 10 Amp. Select Bits
+
+  flag_word[1] |= (amp0 & 0x200) >> 9;       // upper 1 of 10 Amp. Select Bits.
+  flag_word[1] |= (shape_period0 & 0x7) << 1; // 3 Shape Period Select Bits
+}
+
+// DDS-II 14-3
+static void
+pack_dds2_0E03 (int *flag_word, int flags,
+		int freq0, int phase0, int amp0, int dds_en0,
+		int phase_reset0, int shape_period0,
+		int freq1, int phase1, int amp1, int dds_en1,
+		int phase_reset1, int shape_period1)
+{
+  flag_word[0] = flag_word[1] = flag_word[2] = 0;
+
+  flag_word[0] |= (flags & 0xF) << 0;           // 4 Flag Bits
+  flag_word[0] |= (dds_en0 & 0x1) << 4;         // DDS1 Tx Enable
+  flag_word[0] |= (dds_en1 & 0x1) << 5;         // DDS2 Tx Enable
+  flag_word[0] |= (phase_reset0 & 0x1) << 6;    // DDS1 Phase Reset
+  flag_word[0] |= (phase_reset1 & 0x1) << 7;    // DDS2 Phase Reset
+  flag_word[0] |= (freq0 & 0x3FF) << 8;         // DDS1 Frequency Select Bits (1024 Freq. Registers)
+  flag_word[0] |= (freq1 & 0x3FF) << 18;        // DDS2 Frequency Select Bits (1024 Freq. Registers)
+  flag_word[0] |= (phase0 & 0xF) << 28;         // Lower 4 DDS1 Phase Select Bits (128 Phase Registers)
+
+  flag_word[1] |= (phase0 & 0x70) >> 4;         // Upper 3 DDS1 Phase Select Bits
+  flag_word[1] |= (phase1 & 0x7F) << 3;         // DDS2 Phase Select Bits (128 Phase Registers)
+  flag_word[1] |= (amp0 & 0x3FF) << 10;         // DDS1 Amplitude Select Bits (1024 Amp. Registers)
+  flag_word[1] |= (amp1 & 0x3FF) << 20;         // DDS2 Amplitude Select Bits (1024 Amp. Registers)
+  flag_word[1] |= (shape_period0 & 0x3) << 30;  // Lower 2 DDS1 Shape Period Select Bits
+
+  flag_word[2] |= (shape_period0 & 0x4) >> 2;   // Upper DDS1 Shape Period Select Bit
+  flag_word[2] |= (shape_period1 & 0x7) << 1;   // DDS2 Shape Period Select Bits
+}
+
+//                              name       bytes  serialize         serialize_4C  pack_flags       pack_dds2       radio_via_dds2
+static const IMW_ENCODER enc_pci10 =      { "PCI 80 bit",  10, serialize_pci10, NULL,         pack_flags_none, NULL,           0 };
+static const IMW_ENCODER enc_pci10_sp16 = { "SP16 80 bit", 10, serialize_pci10, NULL,         pack_flags_sp16, NULL,           0 };
+static const IMW_ENCODER enc_pci11 =      { "PCI 88 bit",  11, serialize_pci11, NULL,         pack_flags_none, NULL,           0 };
+static const IMW_ENCODER enc_pci8 =       { "PCI 64 bit",   8, serialize_pci8,  NULL,         pack_flags_none, NULL,           0 };
+static const IMW_ENCODER enc_pci_4C =     { "PCI 4C",       4, serialize_pci10, serialize_4C, pack_flags_none, NULL,           0 };
+static const IMW_ENCODER enc_usb4 =       { "USB 128 bit", 16, serialize_usb4,  NULL,         pack_flags_none, NULL,           0 };
+static const IMW_ENCODER enc_usb4_e01 =   { "DDS-II",      16, serialize_usb4,  NULL,         pack_flags_none, pack_dds2_e01,  0 };
+static const IMW_ENCODER enc_usb4_0C13 =  { "DDS-I",       16, serialize_usb4,  NULL,         pack_flags_none, pack_dds2_0C13, 1 };
+static const IMW_ENCODER enc_usb8_0E03 =  { "DDS-II 14-3", 32, serialize_usb8,  NULL,         pack_flags_none, pack_dds2_0E03, 0 };
+
+/**
+ * \internal
+ * Delay fixup for boards without the PB Core counter fix.
+ *
+ * An extra clock cycle must be subtracted from all instructions that result in
+ * a value ending in 0xFF being sent to the core counter (with the exception of
+ * 0x0FF). Boards which have been fixed (and which have readable firmware IDs)
+ * do not require this and use fix_delay_none() instead.
+ *
+ * For boards which have been fixed but do not have firmware registers, there
+ * is no way for spinapi to know whether or not the fault has been corrected.
+ * Therefore, on all generic PulseBlaster boards and also on the older PBESR
+ * boards (boards using AMCC_DEVID and PBESR_PRO_DEVID) the 'FF' fix will be
+ * applied by default. It can be turned off with pb_bypass_FF_fix().
+ */
+static unsigned int
+fix_delay_ff (unsigned int delay)
+{
+  if (((delay & 0xFF) == 0xFF) && (delay > 0xFF))
+    {
+      delay--;
+      debug ("__ONE CLOCK CYCLE SUBTRACTED__\n");
+    }
+
+  return delay;
+}
+
+static unsigned int
+fix_delay_none (unsigned int delay)
+{
+  return delay;
+}
+
+/**
+ * \internal
+ * Choose the delay fixup for the board from its has_FF_fix setting. This
+ * must be called again whenever has_FF_fix is changed.
+ */
+void
+select_delay_fix (BOARD_INFO * board)
+{
+  board->fix_delay = board->has_FF_fix == 1 ? fix_delay_none : fix_delay_ff;
+}
+
+/**
+ * \internal
+ * Choose the instruction encoder for the board. This is called by get_caps()
+ * once the firmware id and usb method are known.
+ */
+void
+select_encoder (BOARD_INFO * board)
+{
+  int id = board->firmware_id;
+
+  if (board->usb_method == 2)
+    {
+      if (id == 0x0E03)
+	board->encoder = &enc_usb8_0E03;
+      else if (id == 0x0C13)
+	board->encoder = &enc_usb4_0C13;
+      else if (id == 0x0E01 || id == 0x0E02)
+	board->encoder = &enc_usb4_e01;
+      else
+	board->encoder = &enc_usb4;
+    }
+  else
+    {
+      if (id == 0x0a13 || id == 0x0C10)
+	board->encoder = &enc_pci11;
+      else if (id == 0x0908)
+	board->encoder = &enc_pci8;
+      else if (id == 0x1105 || id == 0x1106 || id == 0x1107)
+	board->encoder = &enc_pci_4C;
+      else if (id > 0xF0 && id <= 0xF3)
+	board->encoder = &enc_pci10_sp16;
+      else
+	board->encoder = &enc_pci10;
+    }
+
+  select_delay_fix (board);
+
+  debug ("using %s instruction encoder", board->encoder->name);
+}
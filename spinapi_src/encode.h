@@ -0,0 +1,41 @@
+/* encode.h
+ * Instruction memory word encoders for the different PulseBlaster core
+ * firmware designs.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _ENCODE_H
+#define _ENCODE_H
+
+#include "caps.h"
+
+// Largest delay field of the PulseBlaster 4C designs (30 bits)
+#define PB4C_MAX_DELAY 0x3FFFFFFF
+
+void select_encoder (BOARD_INFO * board);
+void select_delay_fix (BOARD_INFO * board);
+
+#endif /* #ifndef _ENCODE_H */
@@ -38,6 +38,7 @@
 #include "util.h"
 #include "fid.h"
 #include "usb.h"
+#include "image.h"
 #include "fftw/fftw.h"
 
 extern char *noerr;
@@ -49,8 +50,11 @@ extern double pow232;
 extern int cur_dds;
 extern double last_rounded_value;
 extern int num_instructions;
+extern int write_inst_cycles (int *pflags, int inst, int inst_data,
+			      __int64 cycles, int from_pbonly);
 
 static int set_shape_period (double period, int addr);
+static int reg_shadow_index (unsigned int address);
 
 //Declare global variables used for AWG
 static double shape_list[7]; //stores the length (in nanoseconds) for each use of shape.
@@ -88,6 +92,61 @@ static int fir_default2[] = {
   -2211, -2141, -1865, -1484, -1110, -846, 8122
 };
 
+// Extended registers which only the host ever changes. Reads of these are
+// served from a copy kept for each board, so that setting a single bit does
+// not cost a round trip to the board. REG_ADC_CONTROL is not in this list,
+// since reading it returns the offset found by the ADC.
+static const unsigned int shadow_regs[] = {
+  REG_CONTROL,
+  REG_DAC_CONTROL,
+  REG_CIC_CONTROL,
+  REG_FIR_CONTROL,
+  REG_SHAPE_CONTROL,
+  REG_CIC_CONTROL2
+};
+
+#define NUM_SHADOW_REGS ((int) (sizeof (shadow_regs) / sizeof (shadow_regs[0])))
+
+typedef struct
+{
+  unsigned int value[NUM_SHADOW_REGS];	/** last value written to each register */
+  unsigned int valid;		/** bit i is set if value[i] matches the board */
+} REG_SHADOW;
+
+static REG_SHADOW reg_shadow[MAX_NUM_BOARDS];
+
+/**
+ * \internal
+ * Return the index of address in shadow_regs[], or -1 if the register is not
+ * shadowed.
+ */
+static int
+reg_shadow_index (unsigned int address)
+{
+  int i;
+
+  for (i = 0; i < NUM_SHADOW_REGS; i++)
+    {
+      if (shadow_regs[i] == address)
+	{
+	  return i;
+	}
+    }
+
+  return -1;
+}
+
+/**
+ * \internal
+ * Forget the shadowed register values of the given board. The next read of
+ * each register goes to the board again.
+ */
+void
+reg_shadow_invalidate (int board_num)
+{
+  reg_shadow[board_num].valid = 0;
+}
+
  /**
  * \internal
  * Write a 32 bit word to the extended register given by address.
@@ -96,6 +155,14 @@ static int fir_default2[] = {
 void
 reg_write (unsigned int address, unsigned int data)
 {
+  int i = reg_shadow_index (address);
+
+  if (i >= 0)
+    {
+      reg_shadow[cur_board].value[i] = data;
+      reg_shadow[cur_board].valid |= 1 << i;
+    }
+
   if (board[cur_board].is_usb)
     {
       usb_write_reg (address, data);
@@ -117,6 +184,12 @@ unsigned int
 reg_read (unsigned int address)
 {
   unsigned int ret;
+  int i = reg_shadow_index (address);
+
+  if (i >= 0 && (reg_shadow[cur_board].valid & (1 << i)))
+    {
+      return reg_shadow[cur_board].value[i];
+    }
 
   if (board[cur_board].is_usb)
     {
@@ -129,6 +202,13 @@ reg_read (unsigned int address)
       ret = pb_inw (EXT_DATA);
       pb_outw (EXT_ADDRESS, 0);
     }
+
+  if (i >= 0)
+    {
+      reg_shadow[cur_board].value[i] = ret;
+      reg_shadow[cur_board].valid |= 1 << i;
+    }
+
   return ret;
 }
 
@@ -610,8 +690,16 @@ pb_inst_radio (int freq, int cos_phase, int sin_phase, int tx_phase,
 {
   spinerr = noerr;
   int flag_word = 0;
+
+  if (image_recording ())
+    {
+      int fields[8] = { freq, cos_phase, sin_phase, tx_phase, tx_enable,
+	phase_reset, trigger_scan, flags
+      };
+      return image_record (IMAGE_RADIO, fields, inst, inst_data, length);
+    }
   
-  if(board[cur_board].firmware_id == 0x0C13) 
+  if(board[cur_board].encoder != NULL && board[cur_board].encoder->radio_via_dds2) 
   {
 	return pb_inst_dds2(freq, tx_phase, 0, tx_enable, phase_reset,0,0,0,0,0, flags, inst, inst_data, length);
   }
@@ -690,7 +778,15 @@ pb_inst_radio_shape (int freq, int cos_phase, int sin_phase, int tx_phase,
 		     int use_shape, int amp, int flags, int inst,
 		     int inst_data, double length)
 {		 
-  if(board[cur_board].firmware_id == 0x0C13)
+  if (image_recording ())
+    {
+      int fields[10] = { freq, cos_phase, sin_phase, tx_phase, tx_enable,
+	phase_reset, trigger_scan, use_shape, amp, flags
+      };
+      return image_record (IMAGE_RADIO_SHAPE, fields, inst, inst_data, length);
+    }
+
+  if(board[cur_board].encoder != NULL && board[cur_board].encoder->radio_via_dds2)
   {
      return pb_inst_dds2_shape(freq, tx_phase, amp, use_shape, tx_enable, phase_reset,0,0,0,0,0,0, flags, inst, inst_data, length);
   }
@@ -923,6 +1019,13 @@ pb_inst_radio_shape_cyclops (int freq, int cos_phase, int sin_phase, int tx_phas
 			 int flags, int inst, int inst_data, double length)
 {
   spinerr = noerr;
+
+  if (image_recording ())
+    {
+      spinerr = "Cyclops instructions can not be part of a pulse program image";
+      debug ("%s", spinerr);
+      return -1;
+    }
   unsigned int flag_word = 0;
 
   int shape_period = -1;
@@ -1058,8 +1161,15 @@ pb_inst_dds2_shape (int freq0, int phase0, int amp0, int use_shape0, int dds_en0
 	      int freq1, int phase1, int amp1, int use_shape1, int dds_en1, int phase_reset1,
 	      int flags, int inst, int inst_data, double length)
 {
+  if (image_recording ())
+    {
+      int fields[13] = { freq0, phase0, amp0, use_shape0, dds_en0, phase_reset0,
+	freq1, phase1, amp1, use_shape1, dds_en1, phase_reset1, flags
+      };
+      return image_record (IMAGE_DDS2_SHAPE, fields, inst, inst_data, length);
+    }
 
-  if (board[cur_board].firmware_id != 0xe01 && board[cur_board].firmware_id != 0xe02 && board[cur_board].firmware_id != 0x0E03 && board[cur_board].firmware_id != 0x0C13)
+  if (board[cur_board].encoder == NULL || board[cur_board].encoder->pack_dds2 == NULL)
   {
       debug
 	("Your current board does not support this function. Please check your manual.");
@@ -1114,7 +1224,7 @@ pb_inst_dds2_shape (int freq0, int phase0, int amp0, int use_shape0, int dds_en0
   debug ("inst=%d, inst_data=%d,length=%f", inst, inst_data,length);
 
 
-  int delay;
+  __int64 cycles;
   double pb_clock, clock_period;
 
   spinerr = noerr;
@@ -1122,9 +1232,9 @@ pb_inst_dds2_shape (int freq0, int phase0, int amp0, int use_shape0, int dds_en0
   pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
   clock_period = 1.0 / pb_clock;
 
-  delay = (int) rint ((length * pb_clock) - 3.0);	//(Assumes clock in GHz and length in ns)
+  cycles = (__int64) rint ((length * pb_clock) - 3.0) + 3;	//(Assumes clock in GHz and length in ns)
 
-  if (delay < 2)
+  if (cycles < 5)
     {
       spinerr = "Instruction delay is too small to work with your board";
       debug ("%s", spinerr);
@@ -1237,58 +1347,11 @@ pb_inst_dds2_shape (int freq0, int phase0, int amp0, int use_shape0, int dds_en0
 	  
   int flag_word[3];
 
-  flag_word[0] = flag_word[1] = flag_word[2] = 0;
+  board[cur_board].encoder->pack_dds2 (flag_word, flags,
+				       freq0, phase0, amp0, dds_en0, phase_reset0, shape_period,
+				       freq1, phase1, amp1, dds_en1, phase_reset1, shape_period1);
 
-  if(board[cur_board].firmware_id == 0x0C13)
-  {
-	  flag_word[0] |= (flags & 0xF) << 0;        // 4 Flag Bits
-	  flag_word[0] |= (dds_en0 & 0x1) << 4;      // DDS Tx Enable
-	  flag_word[0] |= (phase_reset0 & 0x1) << 5; // Phase Reset
-	  flag_word[0] |= (freq0 & 0x3FF) << 6;      // 10 Frequency Select Bits (1024 Freq. Registers)
-	  flag_word[0] |= (phase0 & 0x7F) << 16;     // 7 Phase Select Bits (128 Phase Registers)
-	  flag_word[0] |= (amp0 & 0x1FF) << 23;      // lower 9 of 10 Amp. Select Bits
-	  
-	  flag_word[1] |= (amp0 & 0x200) >> 9;       // upper 1 of 10 Amp. Select Bits.
-	  flag_word[1] |= (shape_period & 0x7) << 1; // 3 Shape Period Select Bits
-  }
-  else if(board[cur_board].firmware_id == 0x0E03)
-  {
-    flag_word[0] |= (flags & 0xF) << 0;           // 4 Flag Bits
-    flag_word[0] |= (dds_en0 & 0x1) << 4;         // DDS1 Tx Enable
-    flag_word[0] |= (dds_en1 & 0x1) << 5;         // DDS2 Tx Enable
-    flag_word[0] |= (phase_reset0 & 0x1) << 6;    // DDS1 Phase Reset
-    flag_word[0] |= (phase_reset1 & 0x1) << 7;    // DDS2 Phase Reset
-    flag_word[0] |= (freq0 & 0x3FF) << 8;         // DDS1 Frequency Select Bits (1024 Freq. Registers)
-    flag_word[0] |= (freq1 & 0x3FF) << 18;        // DDS2 Frequency Select Bits (1024 Freq. Registers)
-    flag_word[0] |= (phase0 & 0xF) << 28;         // Lower 4 DDS1 Phase Select Bits (128 Phase Registers)
-
-    flag_word[1] |= (phase0 & 0x70) >> 4;         // Upper 3 DDS1 Phase Select Bits
-	flag_word[1] |= (phase1 & 0x7F) << 3;         // DDS2 Phase Select Bits (128 Phase Registers)
-    flag_word[1] |= (amp0 & 0x3FF) << 10;         // DDS1 Amplitude Select Bits (1024 Amp. Registers)
-    flag_word[1] |= (amp1 & 0x3FF) << 20;         // DDS2 Amplitude Select Bits (1024 Amp. Registers)
-    flag_word[1] |= (shape_period & 0x3) << 30;   // Lower 2 DDS1 Shape Period Select Bits
-	
-	flag_word[2] |= (shape_period & 0x4) >> 2;    // Upper DDS1 Shape Period Select Bit
-    flag_word[2] |= (shape_period1 & 0x7) << 1;   // DDS2 Shape Period Select Bits
-  }
-  else
-  {
-    flag_word[0] |= (flags & 0xFFF) << 0;
-    flag_word[0] |= (dds_en0 & 0x1) << 12;
-    flag_word[0] |= (dds_en1 & 0x1) << 13;
-    flag_word[0] |= (phase_reset0 & 0x1) << 14;
-    flag_word[0] |= (phase_reset1 & 0x1) << 15;
-    flag_word[0] |= (freq0 & 0xF) << 16;
-    flag_word[0] |= (freq1 & 0xF) << 20;
-    flag_word[0] |= (phase0 & 0x7) << 24;
-    flag_word[0] |= (phase1 & 0x7) << 27;
-    flag_word[0] |= (amp0 & 0x3) << 30;
-
-    flag_word[1] |= (amp1 & 0x3) << 0;
-    flag_word[1] |= (shape_period & 0x7) << 2;
-    flag_word[1] |= (shape_period1 & 0x7) << 5;
-  }
-	return pb_inst_direct(flag_word, inst, inst_data, delay);
+	return write_inst_cycles (flag_word, inst, inst_data, cycles, 0);
 }
 
 SPINCORE_API int
@@ -1323,32 +1386,14 @@ pb_get_data (int num_points, int *real_data, int *imag_data)
       
       pb_set_radio_control (0x02);	// turn on the PCI_READ bit
 
-      char *read_buf;
-      read_buf = malloc (num_points * 8);
-      if (!read_buf)
+      if (usb_read_points (0, num_points, real_data, imag_data) < 0)
 	{
-	  spinerr = "Internal error: can't allocate read buffer";
+	  pb_unset_radio_control (0x02);
+	  spinerr = "Error reading data from the board";
 	  debug ("%s", spinerr);
 	  return -1;
 	}
 
-      usb_read_ram (BANK_DATARAM, 0, num_points * 8, read_buf);
-    
-    for (i = 0; i < num_points * 8; i += 8)
-	{
-	  real_data[i / 8] = (0x0FF & read_buf[i]);
-	  real_data[i / 8] |= (0x0FF & read_buf[i + 1]) << 8;
-	  real_data[i / 8] |= (0x0FF & read_buf[i + 2]) << 16;
-	  real_data[i / 8] |= (0x0FF & read_buf[i + 3]) << 24;
-
-	  imag_data[i / 8] = (0x0FF & read_buf[i + 4]);
-	  imag_data[i / 8] |= (0x0FF & read_buf[i + 5]) << 8;
-	  imag_data[i / 8] |= (0x0FF & read_buf[i + 6]) << 16;
-	  imag_data[i / 8] |= (0x0FF & read_buf[i + 7]) << 24;
-	}
-
-      free (read_buf);
-
       pb_unset_radio_control (0x02);	// turn off the PCI_READ bit
 
       return 0;
@@ -1837,7 +1882,6 @@ SPINCORE_API int
 pb_setup_cic (int dec_amount, int shift_amount, int m, int stages)
 {
   unsigned int word;
-  unsigned int ret;
 
   spinerr = noerr;
 
@@ -1891,8 +1935,6 @@ pb_setup_cic (int dec_amount, int shift_amount, int m, int stages)
      reg_write (REG_CIC_CONTROL2, word);
   }
 
-  ret = reg_read (REG_CIC_CONTROL);
-
   return 0;
 
 }
@@ -2159,6 +2201,16 @@ pb_set_radio_hw (int adc_control, int dac_control)
   return 0;
 }
 
+SPINCORE_API int
+pb_resync_registers (void)
+{
+  spinerr = noerr;
+
+  reg_shadow_invalidate (cur_board);
+
+  return 0;
+}
+
 SPINCORE_API int
 pb_set_radio_control (unsigned int control)
 {
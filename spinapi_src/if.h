@@ -100,6 +100,7 @@ int dds_phase_extreg (int cur_board, int phase_bank, int addr,
 
 void reg_write (unsigned int address, unsigned int data);
 unsigned int reg_read (unsigned int address);
+void reg_shadow_invalidate (int board_num);
 int ram_write (unsigned int bank, unsigned int start_addr, unsigned int len, char *data);
 
 
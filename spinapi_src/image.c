@@ -0,0 +1,905 @@
+/* image.c
+ * This module stores pulse programs as the calls to the pb_inst* functions
+ * that made them, rather than as encoded IMWs, so that a program can be built
+ * once and loaded onto any board. The instructions are recorded between
+ * pb_start_programming(PULSE_IMAGE) and pb_stop_programming(), saved to a file,
+ * and replayed on the current board by pb_load_image(). The IMWs of each board
+ * type are cached in a file next to the image, so that they only need to be
+ * encoded once.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spinapi.h"
+#include "util.h"
+#include "caps.h"
+#include "prog.h"
+#include "image.h"
+
+// File format versions, changed whenever the layout changes
+#define IMAGE_MAGIC "PBIM"
+#define IMAGE_VERSION 1
+#define CACHE_MAGIC "PBIC"
+#define CACHE_VERSION 2
+
+// Initial number of instructions an image has room for. The array doubles in
+// size whenever it fills up.
+#define IMAGE_INITIAL_INSTS 256
+
+// 32 bit FNV-1a hash parameters
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+// Number of fields of each kind of image instruction
+static const int num_fields[IMAGE_NUM_KINDS] = { 2, 8, 10, 11, 13 };
+
+// The image being recorded
+static IMAGE recorded;
+static int recording = 0;
+
+// A growing byte buffer that a file is built in, or a file being read
+typedef struct
+{
+  unsigned char *data;
+  int length;		/** number of bytes written, or size of the file */
+  int max_length;	/** allocated size */
+  int pos;		/** read position */
+  int error;		/** nonzero if a write failed or a read ran past the end */
+} BYTES;
+
+/**
+ * \internal
+ * Append bytes to a buffer
+ */
+static void
+put_bytes (BYTES * b, const void *data, int length)
+{
+  if (b->error)
+    {
+      return;
+    }
+
+  if (b->length + length > b->max_length)
+    {
+      int new_max = b->max_length ? b->max_length : 4096;
+      unsigned char *new_data;
+
+      while (b->length + length > new_max)
+	{
+	  new_max *= 2;
+	}
+
+      new_data = (unsigned char *) realloc (b->data, new_max);
+      if (!new_data)
+	{
+	  b->error = 1;
+	  return;
+	}
+      b->data = new_data;
+      b->max_length = new_max;
+    }
+
+  memcpy (b->data + b->length, data, length);
+  b->length += length;
+}
+
+/**
+ * \internal
+ * Append an integer to a buffer, least significant byte first, so that files
+ * can be read on any host.
+ */
+static void
+put_int (BYTES * b, unsigned int value, int length)
+{
+  unsigned char bytes[4];
+  int i;
+
+  for (i = 0; i < length; i++)
+    {
+      bytes[i] = (unsigned char) (value >> (8 * i));
+    }
+  put_bytes (b, bytes, length);
+}
+
+/**
+ * \internal
+ * Append a double to a buffer, as its IEEE 754 bit pattern
+ */
+static void
+put_double (BYTES * b, double value)
+{
+  unsigned __int64 bits;
+
+  memcpy (&bits, &value, sizeof (bits));
+  put_int (b, (unsigned int) bits, 4);
+  put_int (b, (unsigned int) (bits >> 32), 4);
+}
+
+/**
+ * \internal
+ * Take bytes from a buffer
+ */
+static void
+get_bytes (BYTES * b, void *data, int length)
+{
+  if (b->error || b->pos + length > b->length)
+    {
+      b->error = 1;
+      memset (data, 0, length);
+      return;
+    }
+
+  memcpy (data, b->data + b->pos, length);
+  b->pos += length;
+}
+
+/**
+ * \internal
+ * Take an integer written by put_int() from a buffer
+ */
+static unsigned int
+get_int (BYTES * b, int length)
+{
+  unsigned char bytes[4];
+  unsigned int value = 0;
+  int i;
+
+  get_bytes (b, bytes, length);
+  for (i = 0; i < length; i++)
+    {
+      value |= (unsigned int) bytes[i] << (8 * i);
+    }
+
+  return value;
+}
+
+/**
+ * \internal
+ * Take a double written by put_double() from a buffer
+ */
+static double
+get_double (BYTES * b)
+{
+  unsigned __int64 bits;
+  double value;
+
+  bits = get_int (b, 4);
+  bits |= (unsigned __int64) get_int (b, 4) << 32;
+  memcpy (&value, &bits, sizeof (value));
+
+  return value;
+}
+
+/**
+ * \internal
+ * \return The 32 bit FNV-1a hash of some bytes
+ */
+static unsigned int
+hash_bytes (const void *data, int length)
+{
+  const unsigned char *bytes = (const unsigned char *) data;
+  unsigned int hash = FNV_OFFSET_BASIS;
+  int i;
+
+  for (i = 0; i < length; i++)
+    {
+      hash ^= bytes[i];
+      hash *= FNV_PRIME;
+    }
+
+  return hash;
+}
+
+/**
+ * \internal
+ * Read a whole file into a buffer
+ *
+ * \return -1 if the file can not be read, 0 on success
+ */
+static int
+read_file (const char *filename, BYTES * b)
+{
+  FILE *f;
+  long length;
+
+  memset (b, 0, sizeof (BYTES));
+
+  f = fopen (filename, "rb");
+  if (!f)
+    {
+      return -1;
+    }
+
+  if (fseek (f, 0, SEEK_END) != 0 || (length = ftell (f)) < 0
+      || fseek (f, 0, SEEK_SET) != 0)
+    {
+      fclose (f);
+      return -1;
+    }
+
+  b->data = (unsigned char *) malloc (length > 0 ? length : 1);
+  if (!b->data || fread (b->data, 1, length, f) != (size_t) length)
+    {
+      free (b->data);
+      b->data = NULL;
+      fclose (f);
+      return -1;
+    }
+
+  fclose (f);
+  b->length = (int) length;
+  b->max_length = (int) length;
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Write a buffer to a file, replacing it
+ *
+ * \return -1 if the file can not be written, 0 on success
+ */
+static int
+write_file (const char *filename, const BYTES * b)
+{
+  FILE *f;
+  int return_value = 0;
+
+  f = fopen (filename, "wb");
+  if (!f)
+    {
+      return -1;
+    }
+
+  if (fwrite (b->data, 1, b->length, f) != (size_t) b->length)
+    {
+      return_value = -1;
+    }
+  if (fclose (f) != 0)
+    {
+      return_value = -1;
+    }
+
+  return return_value;
+}
+
+/**
+ * \internal
+ * Append an instruction to an image
+ *
+ * \return The image address of the instruction, or -1 if there is no memory
+ * for it
+ */
+static int
+image_append (IMAGE * image, const IMAGE_INST * inst)
+{
+  if (image->num_insts == image->max_insts)
+    {
+      int new_max = image->max_insts ? 2 * image->max_insts : IMAGE_INITIAL_INSTS;
+      IMAGE_INST *new_insts =
+	(IMAGE_INST *) realloc (image->insts, new_max * sizeof (IMAGE_INST));
+
+      if (!new_insts)
+	{
+	  spinerr = "Internal error: can't allocate program image";
+	  debug ("%s (%d instructions)\n", spinerr, new_max);
+	  return -1;
+	}
+
+      image->insts = new_insts;
+      image->max_insts = new_max;
+    }
+
+  image->insts[image->num_insts] = *inst;
+
+  return image->num_insts++;
+}
+
+/**
+ * \internal
+ * Start recording an image. The pb_inst* functions add their instructions to
+ * it, instead of encoding them for the board, until image_end() is called.
+ */
+void
+image_begin (void)
+{
+  recorded.num_insts = 0;
+  recording = 1;
+}
+
+/**
+ * \internal
+ * \return Nonzero if the pb_inst* functions are recording an image
+ */
+int
+image_recording (void)
+{
+  return recording;
+}
+
+/**
+ * \internal
+ * Stop recording an image. It is kept until the next one is recorded.
+ */
+void
+image_end (void)
+{
+  recording = 0;
+}
+
+/**
+ * \internal
+ * Add an instruction to the image being recorded. Nothing is checked until it
+ * is loaded onto a board.
+ *
+ * \param kind Which pb_inst* function the instruction was given to
+ * \param fields The other arguments of that function, see IMAGE_PBONLY etc.
+ * \return The image address of the instruction, which is what the pb_inst*
+ * function returns. A negative number is returned on failure, and spinerr is
+ * set to a description of the error.
+ */
+int
+image_record (int kind, const int *fields, int inst, int inst_data,
+	      double length)
+{
+  IMAGE_INST rec;
+
+  memset (&rec, 0, sizeof (rec));
+  rec.kind = kind;
+  rec.inst = inst;
+  rec.inst_data = inst_data;
+  rec.length = length;
+  memcpy (rec.fields, fields, num_fields[kind] * sizeof (int));
+
+  return image_append (&recorded, &rec);
+}
+
+/**
+ * \internal
+ * Write the last recorded image to a file. Every instruction takes 15 bytes,
+ * plus 4 bytes for each of its fields.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+int
+image_save (const char *filename)
+{
+  BYTES b;
+  int i, j;
+  int return_value;
+
+  if (recorded.num_insts == 0)
+    {
+      spinerr = "No pulse program image has been recorded";
+      return -1;
+    }
+
+  memset (&b, 0, sizeof (b));
+  put_bytes (&b, IMAGE_MAGIC, 4);
+  put_int (&b, IMAGE_VERSION, 4);
+  put_int (&b, recorded.num_insts, 4);
+
+  for (i = 0; i < recorded.num_insts; i++)
+    {
+      const IMAGE_INST *inst = &recorded.insts[i];
+
+      put_int (&b, inst->kind, 1);
+      put_int (&b, inst->inst, 1);
+      put_int (&b, num_fields[inst->kind], 1);
+      put_int (&b, inst->inst_data, 4);
+      put_double (&b, inst->length);
+      for (j = 0; j < num_fields[inst->kind]; j++)
+	{
+	  put_int (&b, inst->fields[j], 4);
+	}
+    }
+
+  if (b.error)
+    {
+      spinerr = "Internal error: can't allocate program image";
+      return_value = -1;
+    }
+  else if (write_file (filename, &b) != 0)
+    {
+      spinerr = "Can't write pulse program image file";
+      return_value = -1;
+    }
+  else
+    {
+      return_value = 0;
+    }
+
+  free (b.data);
+  return return_value;
+}
+
+/**
+ * \internal
+ * Read an image written by image_save()
+ *
+ * \return The image, which must be freed with image_free(), or NULL on
+ * failure (and spinerr is set)
+ */
+IMAGE *
+image_open (const char *filename)
+{
+  IMAGE *image;
+  IMAGE_INST rec;
+  BYTES b;
+  char magic[4];
+  int num_insts;
+  int i, j, n;
+
+  if (read_file (filename, &b) != 0)
+    {
+      spinerr = "Can't read pulse program image file";
+      return NULL;
+    }
+
+  image = (IMAGE *) calloc (1, sizeof (IMAGE));
+  if (!image)
+    {
+      spinerr = "Internal error: can't allocate program image";
+      free (b.data);
+      return NULL;
+    }
+  image->hash = hash_bytes (b.data, b.length);
+
+  get_bytes (&b, magic, 4);
+  if (memcmp (magic, IMAGE_MAGIC, 4) != 0 || get_int (&b, 4) != IMAGE_VERSION)
+    {
+      spinerr = "File is not a pulse program image of this version";
+      free (b.data);
+      image_free (image);
+      return NULL;
+    }
+
+  num_insts = (int) get_int (&b, 4);
+  for (i = 0; i < num_insts && !b.error; i++)
+    {
+      memset (&rec, 0, sizeof (rec));
+      rec.kind = get_int (&b, 1);
+      rec.inst = get_int (&b, 1);
+      n = get_int (&b, 1);
+      if (rec.kind >= IMAGE_NUM_KINDS || n != num_fields[rec.kind])
+	{
+	  b.error = 1;
+	  break;
+	}
+      rec.inst_data = (int) get_int (&b, 4);
+      rec.length = get_double (&b);
+      for (j = 0; j < n; j++)
+	{
+	  rec.fields[j] = (int) get_int (&b, 4);
+	}
+
+      if (!b.error && image_append (image, &rec) < 0)
+	{
+	  free (b.data);
+	  image_free (image);
+	  return NULL;
+	}
+    }
+
+  free (b.data);
+
+  if (b.error || image->num_insts == 0)
+    {
+      spinerr = "Pulse program image file is damaged";
+      image_free (image);
+      return NULL;
+    }
+
+  return image;
+}
+
+/**
+ * \internal
+ * Free an image returned by image_open()
+ */
+void
+image_free (IMAGE * image)
+{
+  if (image)
+    {
+      free (image->insts);
+      free (image);
+    }
+}
+
+/**
+ * \internal
+ * \return Nonzero if an instruction is a jump into the subroutine library (see
+ * pb_set_library_size())
+ */
+static int
+image_calls_library (const IMAGE_INST * inst)
+{
+  return (inst->inst == BRANCH || inst->inst == JSR)
+    && (inst->inst_data & PB_LIBRARY_BIT);
+}
+
+/**
+ * \internal
+ * Encode an image for the current board, by giving its instructions to the
+ * pb_inst* functions they were recorded from. The addresses of all
+ * instructions are worked out first with pb_get_inst_cost(), so that jumps
+ * can go forward as well as back, even when instructions are split up.
+ *
+ * \param first Address of the first instruction of the image in the program
+ * \return The number of instructions written on success. A negative number is returned on failure, and
+ * spinerr is set to a description of the error.
+ */
+int
+image_encode (const IMAGE * image, int first)
+{
+  int *addr;
+  int return_value = 0;
+  int i;
+
+  addr = (int *) malloc ((image->num_insts + 1) * sizeof (int));
+  if (!addr)
+    {
+      spinerr = "Internal error: can't allocate program image";
+      return -1;
+    }
+
+  addr[0] = first;
+  for (i = 0; i < image->num_insts && return_value >= 0; i++)
+    {
+      const IMAGE_INST *inst = &image->insts[i];
+
+      return_value = pb_get_inst_cost (inst->inst, inst->inst_data, inst->length);
+      addr[i + 1] = addr[i] + return_value;
+    }
+
+  for (i = 0; i < image->num_insts && return_value >= 0; i++)
+    {
+      const IMAGE_INST *inst = &image->insts[i];
+      const int *f = inst->fields;
+      int inst_data = inst->inst_data;
+
+      // Jumps into the subroutine library are resolved when they are written
+      if ((inst->inst == BRANCH || inst->inst == JSR || inst->inst == END_LOOP)
+	  && !image_calls_library (inst))
+	{
+	  if (inst_data < 0 || inst_data >= image->num_insts)
+	    {
+	      spinerr = "Jump target is outside of the pulse program image";
+	      return_value = -1;
+	      break;
+	    }
+	  inst_data = addr[inst_data];
+	}
+
+      switch (inst->kind)
+	{
+	case IMAGE_PBONLY:
+	  return_value = pb_inst_pbonly64 ((unsigned int) f[0] | ((__int64) f[1] << 32),
+					   inst->inst, inst_data, inst->length);
+	  break;
+	case IMAGE_RADIO:
+	  return_value = pb_inst_radio (f[0], f[1], f[2], f[3], f[4], f[5], f[6],
+					f[7], inst->inst, inst_data, inst->length);
+	  break;
+	case IMAGE_RADIO_SHAPE:
+	  return_value = pb_inst_radio_shape (f[0], f[1], f[2], f[3], f[4], f[5],
+					      f[6], f[7], f[8], f[9], inst->inst,
+					      inst_data, inst->length);
+	  break;
+	case IMAGE_DDS2:
+	  return_value = pb_inst_dds2 (f[0], f[1], f[2], f[3], f[4], f[5], f[6],
+				       f[7], f[8], f[9], f[10], inst->inst,
+				       inst_data, inst->length);
+	  break;
+	case IMAGE_DDS2_SHAPE:
+	  return_value = pb_inst_dds2_shape (f[0], f[1], f[2], f[3], f[4], f[5],
+					     f[6], f[7], f[8], f[9], f[10], f[11],
+					     f[12], inst->inst, inst_data,
+					     inst->length);
+	  break;
+	}
+
+      // Functions the board does not support return 0 without writing anything
+      if (return_value >= 0 && return_value != addr[i])
+	{
+	  spinerr = "Pulse program image can not be encoded for this board";
+	  return_value = -1;
+	}
+    }
+
+  if (return_value < 0)
+    {
+      debug ("image_encode: %s (instruction %d)\n", spinerr, i);
+    }
+
+  if (return_value >= 0)
+    {
+      return_value = addr[image->num_insts] - first;
+    }
+
+  free (addr);
+  return return_value;
+}
+
+/**
+ * \internal
+ * \return Nonzero if the IMWs of an image can be cached. Instructions which
+ * use a DDS shape program the shape period registers as they are encoded, so
+ * they must always be encoded again. Jumps into the subroutine library are
+ * not moved with the rest of the program, so they are encoded again, too.
+ */
+int
+image_cacheable (const IMAGE * image)
+{
+  int i;
+
+  for (i = 0; i < image->num_insts; i++)
+    {
+      const IMAGE_INST *inst = &image->insts[i];
+
+      if ((inst->kind == IMAGE_RADIO_SHAPE && inst->fields[7])
+	  || (inst->kind == IMAGE_DDS2_SHAPE && (inst->fields[3] || inst->fields[9]))
+	  || image_calls_library (inst))
+	{
+	  return 0;
+	}
+    }
+
+  return 1;
+}
+
+/**
+ * \internal
+ * Fill in what the IMWs of an image depend on for a board
+ */
+void
+image_make_key (const BOARD_INFO * info, IMAGE_KEY * key)
+{
+  memset (key, 0, sizeof (IMAGE_KEY));
+  strncpy (key->encoder, info->encoder ? info->encoder->name : "",
+	   sizeof (key->encoder) - 1);
+  key->firmware_id = info->firmware_id;
+  key->custom_design = info->custom_design;
+  key->has_FF_fix = info->has_FF_fix;
+  key->pb_clock = info->clock * info->pb_clock_mult;
+}
+
+/**
+ * \internal
+ * Add a key to a buffer
+ */
+static void
+put_key (BYTES * b, const IMAGE_KEY * key)
+{
+  put_bytes (b, key->encoder, sizeof (key->encoder));
+  put_int (b, key->firmware_id, 4);
+  put_int (b, key->custom_design, 4);
+  put_int (b, key->has_FF_fix, 4);
+  put_double (b, key->pb_clock);
+}
+
+/**
+ * \internal
+ * \return The name of the cache file of an image for one kind of board, which
+ * must be freed, or NULL
+ */
+static char *
+cache_filename (const char *filename, const IMAGE_KEY * key)
+{
+  BYTES b;
+  char *name;
+
+  memset (&b, 0, sizeof (b));
+  put_key (&b, key);
+  if (b.error)
+    {
+      return NULL;
+    }
+
+  name = (char *) malloc (strlen (filename) + 16);
+  if (name)
+    {
+      sprintf (name, "%s.%08x", filename, hash_bytes (b.data, b.length));
+    }
+
+  free (b.data);
+  return name;
+}
+
+/**
+ * \internal
+ * Read the cached IMWs of an image for a board. They are only used if they
+ * were made from exactly this image, for the same kind of board.
+ *
+ * \param filename Name of the image file
+ * \param position Set to the address (including the program bank) the first
+ * instruction was encoded at
+ * \param insts Set to the records of the instructions, which must be freed.
+ * Their offsets are into imws.
+ * \param imws Set to the IMWs, which must be freed
+ * \return The number of instructions, or -1 if there is no usable cache
+ */
+int
+image_cache_read (const char *filename, const IMAGE * image,
+		  const IMAGE_KEY * key, int *position, PROG_INST ** insts,
+		  unsigned char **imws)
+{
+  BYTES b;
+  BYTES k;
+  char magic[4];
+  char *name;
+  int num_insts;
+  int num_bytes;
+  int offset = 0;
+  int i;
+
+  name = cache_filename (filename, key);
+  if (!name)
+    {
+      return -1;
+    }
+  i = read_file (name, &b);
+  free (name);
+  if (i != 0)
+    {
+      return -1;
+    }
+
+  memset (&k, 0, sizeof (k));
+  put_key (&k, key);
+
+  get_bytes (&b, magic, 4);
+  if (memcmp (magic, CACHE_MAGIC, 4) != 0 || get_int (&b, 4) != CACHE_VERSION
+      || get_int (&b, 4) != image->hash || k.error
+      || b.pos + k.length > b.length
+      || memcmp (b.data + b.pos, k.data, k.length) != 0)
+    {
+      free (k.data);
+      free (b.data);
+      return -1;
+    }
+  b.pos += k.length;
+  free (k.data);
+
+  *position = (int) get_int (&b, 4);
+  num_insts = (int) get_int (&b, 4);
+  num_bytes = (int) get_int (&b, 4);
+
+  *insts = (PROG_INST *) malloc ((num_insts > 0 ? num_insts : 1) * sizeof (PROG_INST));
+  *imws = (unsigned char *) malloc (num_bytes > 0 ? num_bytes : 1);
+  if (b.error || num_insts < 0 || num_bytes < 0 || !*insts || !*imws)
+    {
+      free (*insts);
+      free (*imws);
+      free (b.data);
+      return -1;
+    }
+
+  for (i = 0; i < num_insts; i++)
+    {
+      PROG_INST *p = &(*insts)[i];
+
+      p->flags[0] = (int) get_int (&b, 4);
+      p->flags[1] = (int) get_int (&b, 4);
+      p->flags[2] = (int) get_int (&b, 4);
+      p->inst = get_int (&b, 1);
+      p->inst_data = (int) get_int (&b, 4);
+      p->delay = get_int (&b, 4);
+      p->raw_delay = get_int (&b, 4);
+      p->from_pbonly = get_int (&b, 1);
+      p->split = get_int (&b, 1);
+      p->num_bytes = get_int (&b, 1);
+      p->offset = offset;
+      offset += p->num_bytes;
+    }
+
+  get_bytes (&b, *imws, num_bytes);
+  if (b.error || offset != num_bytes || b.pos != b.length)
+    {
+      free (*insts);
+      free (*imws);
+      free (b.data);
+      return -1;
+    }
+
+  free (b.data);
+  return num_insts;
+}
+
+/**
+ * \internal
+ * Write the IMWs an image was encoded to for a board, to be read by
+ * image_cache_read() the next time it is loaded onto that kind of board.
+ *
+ * \param position Address (including the program bank) of the first instruction
+ * \param insts The records of the instructions. Their offsets are into imws.
+ * \return -1 if the cache can not be written, 0 on success
+ */
+int
+image_cache_write (const char *filename, const IMAGE * image,
+		   const IMAGE_KEY * key, int position,
+		   const PROG_INST * insts, int num_insts,
+		   const unsigned char *imws)
+{
+  BYTES b;
+  char *name;
+  int num_bytes = 0;
+  int return_value = -1;
+  int i;
+
+  memset (&b, 0, sizeof (b));
+  put_bytes (&b, CACHE_MAGIC, 4);
+  put_int (&b, CACHE_VERSION, 4);
+  put_int (&b, image->hash, 4);
+  put_key (&b, key);
+  put_int (&b, position, 4);
+  put_int (&b, num_insts, 4);
+
+  for (i = 0; i < num_insts; i++)
+    {
+      num_bytes += insts[i].num_bytes;
+    }
+  put_int (&b, num_bytes, 4);
+
+  for (i = 0; i < num_insts; i++)
+    {
+      const PROG_INST *p = &insts[i];
+
+      put_int (&b, p->flags[0], 4);
+      put_int (&b, p->flags[1], 4);
+      put_int (&b, p->flags[2], 4);
+      put_int (&b, p->inst, 1);
+      put_int (&b, p->inst_data, 4);
+      put_int (&b, p->delay, 4);
+      put_int (&b, p->raw_delay, 4);
+      put_int (&b, p->from_pbonly, 1);
+      put_int (&b, p->split, 1);
+      put_int (&b, p->num_bytes, 1);
+    }
+
+  for (i = 0; i < num_insts; i++)
+    {
+      put_bytes (&b, imws + insts[i].offset, insts[i].num_bytes);
+    }
+
+  name = cache_filename (filename, key);
+  if (name && !b.error)
+    {
+      return_value = write_file (name, &b);
+    }
+
+  debug ("image_cache_write: %s (%d instructions) %s\n", name ? name : "",
+	 num_insts, return_value == 0 ? "written" : "failed");
+
+  free (name);
+  free (b.data);
+  return return_value;
+}
@@ -0,0 +1,94 @@
+/* image.h
+ * Firmware independent pulse program images.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include "caps.h"
+#include "prog.h"
+
+// Which pb_inst* function an image instruction is replayed with
+#define IMAGE_PBONLY 0		/** pb_inst_pbonly64(), fields: flags (low word), flags (high word) */
+#define IMAGE_RADIO 1		/** pb_inst_radio(), fields: freq, cos_phase, sin_phase, tx_phase, tx_enable, phase_reset, trigger_scan, flags */
+#define IMAGE_RADIO_SHAPE 2	/** pb_inst_radio_shape(), fields: freq, cos_phase, sin_phase, tx_phase, tx_enable, phase_reset, trigger_scan, use_shape, amp, flags */
+#define IMAGE_DDS2 3		/** pb_inst_dds2(), fields: freq0, phase0, amp0, dds_en0, phase_reset0, freq1, phase1, amp1, dds_en1, phase_reset1, flags */
+#define IMAGE_DDS2_SHAPE 4	/** pb_inst_dds2_shape(), fields: freq0, phase0, amp0, use_shape0, dds_en0, phase_reset0, freq1, phase1, amp1, use_shape1, dds_en1, phase_reset1, flags */
+#define IMAGE_NUM_KINDS 5
+
+// Largest number of fields of any kind of image instruction
+#define IMAGE_MAX_FIELDS 13
+
+// An instruction as it was given to a pb_inst* function, before anything
+// about the board is known
+typedef struct
+{
+  int kind;		/** IMAGE_PBONLY, IMAGE_RADIO, ... */
+  int inst;		/** opcode */
+  int inst_data;	/** instruction data, as given to the pb_inst* function. Jump targets are image addresses. */
+  double length;	/** length of the instruction, in ns */
+  int fields[IMAGE_MAX_FIELDS];	/** the other arguments of the pb_inst* function, in order */
+} IMAGE_INST;
+
+typedef struct
+{
+  IMAGE_INST *insts;	/** the instructions */
+  int num_insts;	/** number of instructions */
+  int max_insts;	/** allocated size of insts */
+  unsigned int hash;	/** hash of the image file */
+} IMAGE;
+
+// Everything about a board which changes how an image is encoded
+typedef struct
+{
+  char encoder[32];	/** name of the IMW encoder */
+  int firmware_id;
+  int custom_design;
+  int has_FF_fix;
+  double pb_clock;	/** clock frequency of the PulseBlaster core, in GHz */
+} IMAGE_KEY;
+
+void image_begin (void);
+int image_recording (void);
+void image_end (void);
+int image_record (int kind, const int *fields, int inst, int inst_data,
+		  double length);
+int image_save (const char *filename);
+IMAGE *image_open (const char *filename);
+void image_free (IMAGE * image);
+int image_encode (const IMAGE * image, int first);
+int image_cacheable (const IMAGE * image);
+void image_make_key (const BOARD_INFO * info, IMAGE_KEY * key);
+int image_cache_read (const char *filename, const IMAGE * image,
+		      const IMAGE_KEY * key, int *position,
+		      PROG_INST ** insts, unsigned char **imws);
+int image_cache_write (const char *filename, const IMAGE * image,
+		       const IMAGE_KEY * key, int position,
+		       const PROG_INST * insts, int num_insts,
+		       const unsigned char *imws);
+
+#endif /* #ifndef _IMAGE_H */
@@ -0,0 +1,972 @@
+/* optimize.c
+ * This module rewrites a buffered pulse program into an equivalent one with
+ * fewer instructions, before it is written to the board. Runs of CONTINUE
+ * instructions which output the same state are merged into one, and
+ * instructions which behave like a CONTINUE are turned into one first.
+ * Repeated blocks of instructions can also be rolled up into LOOP/END_LOOP
+ * constructs, or moved into subroutines called with JSR. The mapping from the
+ * addresses returned by the pb_inst* functions to the addresses of the
+ * optimized program is kept, so that branches can be resolved again and
+ * instructions can be patched later.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spinapi.h"
+#include "util.h"
+#include "caps.h"
+#include "prog.h"
+#include "optimize.h"
+
+// Number of clock cycles an instruction takes on top of its delay field
+#define INST_OVERHEAD_CYCLES 3
+
+// Number of levels the PulseBlaster core can nest loops
+#define OPT_MAX_LOOP_DEPTH 8
+
+// Largest repeat count of a LOOP, limited by the 20 bit instruction data
+#define OPT_MAX_REPEATS 0x100000
+
+// Longest block of instructions that is rolled into a loop, and longest one
+// that is moved into a subroutine. Longer repeats are rare and expensive to
+// search for.
+#define OPT_MAX_LOOP_BLOCK 256
+#define OPT_MAX_SUB_BLOCK 64
+
+// Rolling loops is repeated to find nested loops, up to this many times
+#define OPT_MAX_PASSES OPT_MAX_LOOP_DEPTH
+
+typedef struct
+{
+  PROG_INST rec;	/** the instruction. For jumps within the program, inst_data is not used */
+  int target;		/** index of the instruction jumped to, or -1 */
+} OPT_INST;
+
+typedef struct
+{
+  int valid;		/** nonzero if the map describes the last optimized program */
+  int *map;		/** optimized address of each original instruction */
+  int *count;		/** number of original instructions merged into each optimized one */
+  int num_orig;		/** number of original instructions */
+  int num_opt;		/** number of instructions of the optimized program */
+  int max_orig;		/** allocated size of map and count */
+} OPT_MAP;
+
+typedef struct
+{
+  unsigned int hash;	/** hash of the instructions of the block */
+  int pos;		/** index of the instruction before the block */
+} OPT_WINDOW;
+
+static OPT_MAP opt_map[MAX_NUM_BOARDS];
+
+/**
+ * \internal
+ * \return Nonzero if inst jumps to the address in its instruction data.
+ */
+static int
+is_jump (int inst)
+{
+  return inst == BRANCH || inst == JSR || inst == END_LOOP;
+}
+
+/**
+ * \internal
+ * Make sure the address map of the given board can hold n instructions.
+ *
+ * \return -1 on failure (and spinerr is set), 0 on success
+ */
+static int
+opt_map_reserve (OPT_MAP * m, int n)
+{
+  int *new_map;
+  int *new_count;
+
+  if (n <= m->max_orig)
+    {
+      return 0;
+    }
+
+  new_map = (int *) realloc (m->map, n * sizeof (int));
+  if (new_map)
+    {
+      m->map = new_map;
+    }
+  new_count = (int *) realloc (m->count, n * sizeof (int));
+  if (new_count)
+    {
+      m->count = new_count;
+    }
+
+  if (!new_map || !new_count)
+    {
+      spinerr = "Internal error: can't allocate optimizer address map";
+      debug ("%s (%d instructions)", spinerr, n);
+      return -1;
+    }
+
+  m->max_orig = n;
+  return 0;
+}
+
+/**
+ * \internal
+ * Point the jumps of the instructions written by a pass to the new addresses
+ * of their targets.
+ */
+static void
+remap_targets (OPT_INST * out, int k, const int *pass_map)
+{
+  int i;
+
+  for (i = 0; i < k; i++)
+    {
+      if (out[i].target >= 0)
+	{
+	  out[i].target = pass_map[out[i].target];
+	}
+    }
+}
+
+/**
+ * \internal
+ * Find, for every instruction, the lowest and highest address of the jumps to
+ * it. src_max is -1 for instructions which are not jumped to.
+ */
+static void
+find_sources (const OPT_INST * in, int n, int *src_min, int *src_max)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      src_min[i] = n;
+      src_max[i] = -1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      int t = in[i].target;
+
+      if (t >= 0)
+	{
+	  if (i < src_min[t])
+	    src_min[t] = i;
+	  if (i > src_max[t])
+	    src_max[t] = i;
+	}
+    }
+}
+
+/**
+ * \internal
+ * Replace instructions which behave exactly like a CONTINUE by one: a BRANCH
+ * to the next instruction, and a LOOP which runs only once together with its
+ * END_LOOP.
+ */
+static void
+simplify (OPT_INST * insts, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      int t = insts[i].target;
+
+      if ((insts[i].rec.inst == END_LOOP && t >= 0
+	   && insts[t].rec.inst == LOOP && insts[t].rec.inst_data == 0)
+	  || (insts[i].rec.inst == BRANCH && t == i + 1))
+	{
+	  insts[i].rec.inst = CONTINUE;
+	  insts[i].rec.inst_data = 0;
+	  insts[i].target = -1;
+	}
+    }
+
+  // A LOOP only turns into a CONTINUE once its END_LOOPs no longer refer to it
+  for (i = 0; i < n; i++)
+    {
+      if (insts[i].rec.inst == LOOP && insts[i].rec.inst_data == 0)
+	{
+	  insts[i].rec.inst = CONTINUE;
+	}
+    }
+}
+
+/**
+ * \internal
+ * \return Nonzero if instruction b can be merged into the CONTINUE a which
+ * comes right before it, because it outputs the same state.
+ */
+static int
+can_merge (const PROG_INST * a, const PROG_INST * b)
+{
+  return a->inst == CONTINUE && b->inst == CONTINUE
+    && a->from_pbonly == b->from_pbonly
+    && memcmp (a->flags, b->flags, sizeof (a->flags)) == 0
+    && a->raw_delay <= 0xFFFFFFFFu - INST_OVERHEAD_CYCLES - b->raw_delay;
+}
+
+/**
+ * \internal
+ * Merge runs of CONTINUE instructions which output the same state. Instructions
+ * which are jumped to are never merged into the one before them.
+ *
+ * \return The number of instructions written to out
+ */
+static int
+pass_merge (const OPT_INST * in, int n, OPT_INST * out, int *pass_map,
+	    int *src_min, int *src_max)
+{
+  int i, k;
+
+  find_sources (in, n, src_min, src_max);
+
+  k = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (k > 0 && src_max[i] < 0 && can_merge (&out[k - 1].rec, &in[i].rec))
+	{
+	  out[k - 1].rec.raw_delay += in[i].rec.raw_delay + INST_OVERHEAD_CYCLES;
+	}
+      else
+	{
+	  out[k++] = in[i];
+	}
+      pass_map[i] = k - 1;
+    }
+
+  remap_targets (out, k, pass_map);
+  return k;
+}
+
+/**
+ * \internal
+ * \return Nonzero if two instructions which do not jump anywhere are the same.
+ */
+static int
+same_inst (const PROG_INST * ra, const PROG_INST * rb)
+{
+  return ra->inst == rb->inst && ra->inst_data == rb->inst_data
+    && ra->raw_delay == rb->raw_delay && ra->from_pbonly == rb->from_pbonly
+    && memcmp (ra->flags, rb->flags, sizeof (ra->flags)) == 0;
+}
+
+/**
+ * \internal
+ * \return Nonzero if instruction a of the block starting at i does exactly
+ * the same as instruction b of the block starting at c. Jumps within the
+ * blocks must go to the same place relative to the start of their block,
+ * other jumps to the same address.
+ */
+static int
+same_in_block (const OPT_INST * in, int a, int b, int i, int c, int m)
+{
+  int ta = in[a].target;
+  int tb = in[b].target;
+  int inside_a = ta >= i && ta < i + m;
+  int inside_b = tb >= c && tb < c + m;
+
+  if (ta < 0 || tb < 0)
+    {
+      return ta == tb && same_inst (&in[a].rec, &in[b].rec);
+    }
+
+  if (in[a].rec.inst != in[b].rec.inst || inside_a != inside_b
+      || (inside_a && ta - i != tb - c) || (!inside_a && ta != tb))
+    {
+      return 0;
+    }
+
+  // The instruction data holds the jump target, which is compared above
+  return in[a].rec.raw_delay == in[b].rec.raw_delay
+    && in[a].rec.from_pbonly == in[b].rec.from_pbonly
+    && memcmp (in[a].rec.flags, in[b].rec.flags, sizeof (in[a].rec.flags)) == 0;
+}
+
+/**
+ * \internal
+ * \return Nonzero if the m instructions starting at i can become the body of
+ * a loop: the first and last of them can be turned into the LOOP and END_LOOP,
+ * nothing jumps into the block from outside except to its first instruction,
+ * nothing in the block jumps or returns out of it, and the loops in the block
+ * can be nested one level deeper.
+ */
+static int
+roll_block_ok (const OPT_INST * in, int i, int m, const int *depth,
+	       const int *src_min, const int *src_max)
+{
+  int j;
+
+  if (in[i].rec.inst != CONTINUE || in[i + m - 1].rec.inst != CONTINUE)
+    {
+      return 0;
+    }
+
+  // The LOOP may be jumped to from outside, which restarts the loop
+  if (src_max[i] >= i && src_min[i] < i + m)
+    {
+      return 0;
+    }
+
+  for (j = i; j < i + m; j++)
+    {
+      int inst = in[j].rec.inst;
+      int t = in[j].target;
+
+      if (depth[j] + 1 > OPT_MAX_LOOP_DEPTH || inst == RTS || inst == RTI)
+	{
+	  return 0;
+	}
+      if ((inst == BRANCH || inst == END_LOOP) && (t < i || t >= i + m))
+	{
+	  return 0;
+	}
+      if (j > i && src_max[j] >= 0 && (src_min[j] < i || src_max[j] >= i + m))
+	{
+	  return 0;
+	}
+    }
+
+  return 1;
+}
+
+/**
+ * \internal
+ * \return Nonzero if the m instructions starting at c repeat the block
+ * starting at i, and are only jumped to from within themselves.
+ */
+static int
+roll_copy_ok (const OPT_INST * in, int i, int c, int m, const int *src_min,
+	      const int *src_max)
+{
+  int q;
+
+  for (q = 0; q < m; q++)
+    {
+      int j = c + q;
+
+      if (!same_in_block (in, i + q, j, i, c, m))
+	{
+	  return 0;
+	}
+      if (src_max[j] >= 0 && (src_min[j] < c || src_max[j] >= c + m))
+	{
+	  return 0;
+	}
+    }
+
+  return 1;
+}
+
+/**
+ * \internal
+ * Roll blocks of instructions which are repeated back to back into a loop.
+ * The first instruction of the block becomes the LOOP and the last one the
+ * END_LOOP, so the loop costs no extra instructions.
+ *
+ * \return The number of instructions written to out
+ */
+static int
+pass_roll_loops (const OPT_INST * in, int n, OPT_INST * out, int *pass_map,
+		 int *depth, int *src_min, int *src_max)
+{
+  int i, j, k, m, r, q;
+
+  find_sources (in, n, src_min, src_max);
+
+  // Nesting depth of every instruction, from the loops around it
+  memset (depth, 0, n * sizeof (int));
+  for (i = 0; i < n; i++)
+    {
+      if (in[i].rec.inst == END_LOOP && in[i].target >= 0 && in[i].target <= i)
+	{
+	  for (j = in[i].target; j <= i; j++)
+	    {
+	      depth[j]++;
+	    }
+	}
+    }
+
+  k = 0;
+  i = 0;
+  while (i < n)
+    {
+      int best_m = 0;
+      int best_r = 1;
+
+      for (m = 2; m <= OPT_MAX_LOOP_BLOCK && i + 2 * m <= n; m++)
+	{
+	  if (!same_in_block (in, i, i + m, i, i + m, m)
+	      || !roll_block_ok (in, i, m, depth, src_min, src_max))
+	    {
+	      continue;
+	    }
+
+	  r = 1;
+	  while (i + (r + 1) * m <= n && r < OPT_MAX_REPEATS
+		 && roll_copy_ok (in, i, i + r * m, m, src_min, src_max))
+	    {
+	      r++;
+	    }
+
+	  if (m * (r - 1) > best_m * (best_r - 1))
+	    {
+	      best_m = m;
+	      best_r = r;
+	    }
+	}
+
+      if (best_r < 2)
+	{
+	  pass_map[i] = k;
+	  out[k++] = in[i];
+	  i++;
+	  continue;
+	}
+
+      for (q = 0; q < best_m; q++)
+	{
+	  pass_map[i + q] = k;
+	  out[k++] = in[i + q];
+	}
+      for (j = i + best_m; j < i + best_m * best_r; j++)
+	{
+	  pass_map[j] = pass_map[i + (j - i) % best_m];
+	}
+
+      out[k - best_m].rec.inst = LOOP;
+      out[k - best_m].rec.inst_data = best_r - 1;
+      out[k - 1].rec.inst = END_LOOP;
+      out[k - 1].target = i;
+
+      i += best_m * best_r;
+    }
+
+  remap_targets (out, k, pass_map);
+  return k;
+}
+
+/**
+ * \internal
+ * Hash of the parts of an instruction which must match for it to be shared.
+ */
+static unsigned int
+inst_hash (const PROG_INST * r)
+{
+  unsigned int h = 2166136261u;
+  unsigned int words[6];
+  int i;
+
+  words[0] = r->inst;
+  words[1] = r->inst_data;
+  words[2] = r->raw_delay;
+  words[3] = r->flags[0];
+  words[4] = r->flags[1];
+  words[5] = r->flags[2] ^ (r->from_pbonly << 31);
+
+  for (i = 0; i < 6; i++)
+    {
+      h = (h ^ words[i]) * 16777619u;
+    }
+
+  return h;
+}
+
+static int
+compare_windows (const void *a, const void *b)
+{
+  const OPT_WINDOW *wa = (const OPT_WINDOW *) a;
+  const OPT_WINDOW *wb = (const OPT_WINDOW *) b;
+
+  if (wa->hash != wb->hash)
+    return wa->hash < wb->hash ? -1 : 1;
+
+  return wa->pos - wb->pos;
+}
+
+/**
+ * \internal
+ * Move blocks of CONTINUE instructions which appear more than once, but not
+ * back to back, into subroutines placed after the end of the program. The
+ * instruction before each copy becomes the JSR, and the last instruction of
+ * the subroutine the RTS, so every copy but one is saved.
+ *
+ * This is only done for programs which do not use subroutines themselves, so
+ * that the subroutine nesting depth does not change, and which end in a STOP
+ * or BRANCH, so that the subroutines are never reached by falling through.
+ *
+ * \return The number of instructions written to out, -2 if nothing was moved,
+ * or -1 if memory could not be allocated
+ */
+static int
+pass_subroutines (const OPT_INST * in, int n, OPT_INST * out, int *pass_map,
+		  int *src_min, int *src_max)
+{
+  OPT_WINDOW *windows = NULL;
+  unsigned int *prefix = NULL;
+  unsigned int *power = NULL;
+  int *run = NULL;
+  int *site_len = NULL;
+  int *site_sub = NULL;
+  int *sub_pos = NULL;
+  int *sub_len = NULL;
+  int *sub_start = NULL;
+  int *chosen = NULL;
+  char *claimed = NULL;
+  int num_subs = 0;
+  int num_removed = 0;
+  int i, j, k, m, q, w, num_windows;
+
+  if (n < 3 || (in[n - 1].rec.inst != STOP && in[n - 1].rec.inst != BRANCH))
+    {
+      return -2;
+    }
+  for (i = 0; i < n; i++)
+    {
+      if (in[i].rec.inst == JSR || in[i].rec.inst == RTS || in[i].rec.inst == RTI)
+	{
+	  return -2;
+	}
+    }
+
+  windows = (OPT_WINDOW *) malloc (n * sizeof (OPT_WINDOW));
+  prefix = (unsigned int *) malloc ((n + 1) * sizeof (unsigned int));
+  power = (unsigned int *) malloc ((OPT_MAX_SUB_BLOCK + 1) * sizeof (unsigned int));
+  run = (int *) malloc ((n + 1) * sizeof (int));
+  site_len = (int *) calloc (n, sizeof (int));
+  site_sub = (int *) malloc (n * sizeof (int));
+  sub_pos = (int *) malloc (n * sizeof (int));
+  sub_len = (int *) malloc (n * sizeof (int));
+  sub_start = (int *) malloc (n * sizeof (int));
+  chosen = (int *) malloc (n * sizeof (int));
+  claimed = (char *) calloc (n, 1);
+  if (!windows || !prefix || !power || !run || !site_len || !site_sub
+      || !sub_pos || !sub_len || !sub_start || !chosen || !claimed)
+    {
+      k = -1;
+      goto done;
+    }
+
+  find_sources (in, n, src_min, src_max);
+
+  // Polynomial hash of every block, from prefix sums of the instruction hashes
+  prefix[0] = 0;
+  for (i = 0; i < n; i++)
+    {
+      prefix[i + 1] = prefix[i] * 31u + inst_hash (&in[i].rec);
+    }
+  power[0] = 1;
+  for (m = 1; m <= OPT_MAX_SUB_BLOCK; m++)
+    {
+      power[m] = power[m - 1] * 31u;
+    }
+
+  // run[i] is the number of instructions from i on which can be moved
+  run[n] = 0;
+  for (i = n - 1; i >= 0; i--)
+    {
+      run[i] = (in[i].rec.inst == CONTINUE && src_max[i] < 0) ? run[i + 1] + 1 : 0;
+    }
+
+  // Longer blocks first, since they save the most per copy
+  for (m = OPT_MAX_SUB_BLOCK; m >= 2; m--)
+    {
+      num_windows = 0;
+      for (i = 0; i + m < n; i++)
+	{
+	  if (in[i].rec.inst == CONTINUE && run[i + 1] >= m && !claimed[i])
+	    {
+	      windows[num_windows].hash = prefix[i + 1 + m] - prefix[i + 1] * power[m];
+	      windows[num_windows].pos = i;
+	      num_windows++;
+	    }
+	}
+
+      qsort (windows, num_windows, sizeof (OPT_WINDOW), compare_windows);
+
+      for (w = 0; w < num_windows; w = j)
+	{
+	  int num_chosen = 0;
+	  int last_end = -1;
+
+	  for (j = w; j < num_windows && windows[j].hash == windows[w].hash; j++)
+	    {
+	      int pos = windows[j].pos;
+
+	      if (pos <= last_end)
+		{
+		  continue;
+		}
+	      for (q = 0; q <= m && !claimed[pos + q]; q++)
+		;
+	      if (q <= m)
+		{
+		  continue;
+		}
+	      if (num_chosen > 0)
+		{
+		  int first = chosen[0];
+
+		  for (q = 1; q <= m && same_inst (&in[first + q].rec,
+						   &in[pos + q].rec); q++)
+		    ;
+		  if (q <= m)
+		    {
+		      continue;
+		    }
+		}
+
+	      chosen[num_chosen++] = pos;
+	      last_end = pos + m;
+	    }
+
+	  if (num_chosen < 2)
+	    {
+	      continue;
+	    }
+
+	  for (q = 0; q < num_chosen; q++)
+	    {
+	      int pos = chosen[q];
+	      int c;
+
+	      for (c = pos; c <= pos + m; c++)
+		{
+		  claimed[c] = 1;
+		}
+	      site_len[pos] = m;
+	      site_sub[pos] = num_subs;
+	      num_removed += m;
+	    }
+	  sub_pos[num_subs] = chosen[0];
+	  sub_len[num_subs] = m;
+	  num_subs++;
+	}
+    }
+
+  if (num_subs == 0)
+    {
+      k = -2;
+      goto done;
+    }
+
+  sub_start[0] = n - num_removed;
+  for (q = 1; q < num_subs; q++)
+    {
+      sub_start[q] = sub_start[q - 1] + sub_len[q - 1];
+    }
+
+  // The program with a JSR in place of every copy, then the subroutines
+  k = 0;
+  for (i = 0; i < n; i++)
+    {
+      pass_map[i] = k;
+      out[k++] = in[i];
+
+      if (site_len[i])
+	{
+	  for (q = 1; q <= site_len[i]; q++)
+	    {
+	      pass_map[i + q] = sub_start[site_sub[i]] + q - 1;
+	    }
+	  i += site_len[i];
+	}
+    }
+
+  remap_targets (out, k, pass_map);
+
+  for (i = 0; i < n; i++)
+    {
+      if (site_len[i])
+	{
+	  out[pass_map[i]].rec.inst = JSR;
+	  out[pass_map[i]].target = sub_start[site_sub[i]];
+	}
+    }
+
+  for (q = 0; q < num_subs; q++)
+    {
+      for (i = 1; i <= sub_len[q]; i++)
+	{
+	  out[k++] = in[sub_pos[q] + i];
+	}
+      out[k - 1].rec.inst = RTS;
+      out[k - 1].rec.inst_data = 0;
+    }
+
+done:
+  free (windows);
+  free (prefix);
+  free (power);
+  free (run);
+  free (site_len);
+  free (site_sub);
+  free (sub_pos);
+  free (sub_len);
+  free (sub_start);
+  free (chosen);
+  free (claimed);
+
+  return k;
+}
+
+/**
+ * \internal
+ * Optimize the program buffered for the given board, and encode it again.
+ * Only programs which consist entirely of instructions written by the pb_inst*
+ * functions are optimized, anything else is left alone.
+ *
+ * \param info The board the program is for
+ * \param base Address of the first instruction of the program on the board.
+ * Jump targets in the instruction data are relative to this.
+ * \param level Which optimizations to apply (OPTIMIZE_* flags)
+ * \param num_insts Number of instructions of the program. Set to the number
+ * of instructions of the optimized program.
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+int
+optimize_program (int board_num, const BOARD_INFO * info, int base,
+		  int level, int *num_insts)
+{
+  OPT_MAP *m = &opt_map[board_num];
+  int n = prog_num_insts (board_num);
+  OPT_INST *a = NULL;
+  OPT_INST *b = NULL;
+  OPT_INST *swap;
+  int *pass_map = NULL;
+  int *depth = NULL;
+  int *src_min = NULL;
+  int *src_max = NULL;
+  PROG_INST *last;
+  int instruction[IMW_MAX_BYTES / sizeof (int)];
+  int return_value = -1;
+  int num_bytes;
+  int i, k, pass;
+
+  optimize_forget (board_num, *num_insts);
+
+  last = prog_get_inst (board_num, n - 1);
+  if (last == NULL || last->offset + last->num_bytes != prog_pending (board_num))
+    {
+      debug ("optimize_program: nothing to optimize\n");
+      return 0;
+    }
+
+  a = (OPT_INST *) malloc (n * sizeof (OPT_INST));
+  b = (OPT_INST *) malloc (n * sizeof (OPT_INST));
+  pass_map = (int *) malloc (n * sizeof (int));
+  depth = (int *) malloc (n * sizeof (int));
+  src_min = (int *) malloc (n * sizeof (int));
+  src_max = (int *) malloc (n * sizeof (int));
+  if (!a || !b || !pass_map || !depth || !src_min || !src_max
+      || opt_map_reserve (m, n) != 0)
+    {
+      spinerr = "Internal error: can't allocate optimizer buffer";
+      debug ("%s (%d instructions)", spinerr, n);
+      goto done;
+    }
+
+  // Work with jump targets relative to the start of the program
+  for (i = 0; i < n; i++)
+    {
+      a[i].rec = *prog_get_inst (board_num, i);
+      a[i].target = -1;
+      if (is_jump (a[i].rec.inst) && a[i].rec.inst_data - base >= 0
+	  && a[i].rec.inst_data - base < n)
+	{
+	  a[i].target = a[i].rec.inst_data - base;
+	}
+      m->map[i] = i;
+    }
+  k = n;
+
+  if (level & OPTIMIZE_PEEPHOLE)
+    {
+      simplify (a, k);
+      k = pass_merge (a, k, b, pass_map, src_min, src_max);
+      for (i = 0; i < n; i++)
+	m->map[i] = pass_map[m->map[i]];
+      swap = a, a = b, b = swap;
+    }
+
+  if (level & OPTIMIZE_ROLL_LOOPS)
+    {
+      for (pass = 0; pass < OPT_MAX_PASSES; pass++)
+	{
+	  int rolled = pass_roll_loops (a, k, b, pass_map, depth, src_min, src_max);
+
+	  if (rolled == k)
+	    break;
+
+	  k = rolled;
+	  for (i = 0; i < n; i++)
+	    m->map[i] = pass_map[m->map[i]];
+	  swap = a, a = b, b = swap;
+	}
+
+      i = pass_subroutines (a, k, b, pass_map, src_min, src_max);
+      if (i == -1)
+	{
+	  spinerr = "Internal error: can't allocate optimizer buffer";
+	  debug ("%s (%d instructions)", spinerr, n);
+	  goto done;
+	}
+      if (i >= 0)
+	{
+	  k = i;
+	  for (i = 0; i < n; i++)
+	    m->map[i] = pass_map[m->map[i]];
+	  swap = a, a = b, b = swap;
+	}
+    }
+
+  debug ("optimize_program: %d instructions reduced to %d\n", n, k);
+
+  // Encode the optimized program, with its jumps pointing to the new addresses
+  prog_reset (board_num);
+  for (i = 0; i < k; i++)
+    {
+      PROG_INST *inst = &a[i].rec;
+
+      if (a[i].target >= 0)
+	{
+	  inst->inst_data = a[i].target + base;
+	}
+
+      inst->delay = inst->from_pbonly ? info->fix_delay (inst->raw_delay) : inst->raw_delay;
+
+      num_bytes = info->encoder->serialize (inst->flags, inst->inst,
+					    inst->inst_data, inst->delay,
+					    (unsigned char *) instruction);
+      if (num_bytes < 0 || prog_append (board_num, instruction, num_bytes, inst) != 0)
+	{
+	  prog_reset (board_num);
+	  goto done;
+	}
+    }
+
+  memset (m->count, 0, k * sizeof (int));
+  for (i = 0; i < n; i++)
+    {
+      m->count[m->map[i]]++;
+    }
+
+  m->valid = 1;
+  m->num_orig = n;
+  m->num_opt = k;
+  *num_insts = k;
+  return_value = 0;
+
+done:
+  free (a);
+  free (b);
+  free (pass_map);
+  free (depth);
+  free (src_min);
+  free (src_max);
+
+  return return_value;
+}
+
+/**
+ * \internal
+ * Forget the address map of the given board, because a program was written
+ * without optimization.
+ *
+ * \param num_insts Number of instructions of that program
+ */
+void
+optimize_forget (int board_num, int num_insts)
+{
+  opt_map[board_num].valid = 0;
+  opt_map[board_num].num_orig = num_insts;
+  opt_map[board_num].num_opt = num_insts;
+}
+
+/**
+ * \internal
+ * Translate an address returned by a pb_inst* function into the address of
+ * the instruction in the optimized program. Without optimization the address
+ * is returned unchanged.
+ *
+ * \param merged If not NULL, set to nonzero if other instructions were merged
+ * with this one
+ * \return The optimized address, or -1 if addr is not part of the program
+ */
+int
+optimize_lookup (int board_num, int addr, int *merged)
+{
+  OPT_MAP *m = &opt_map[board_num];
+
+  if (merged)
+    {
+      *merged = 0;
+    }
+
+  if (!m->valid)
+    {
+      return addr;
+    }
+
+  if (addr < 0 || addr >= m->num_orig)
+    {
+      return -1;
+    }
+
+  if (merged)
+    {
+      *merged = m->count[m->map[addr]] > 1;
+    }
+
+  return m->map[addr];
+}
+
+/**
+ * \internal
+ * Get the size of the last program, before and after it was optimized.
+ */
+void
+optimize_size (int board_num, int *original, int *optimized)
+{
+  *original = opt_map[board_num].num_orig;
+  *optimized = opt_map[board_num].num_opt;
+}
+
+/**
+ * \internal
+ * Release the memory used by the address map of the given board.
+ */
+void
+optimize_free (int board_num)
+{
+  free (opt_map[board_num].map);
+  free (opt_map[board_num].count);
+  memset (&opt_map[board_num], 0, sizeof (OPT_MAP));
+}
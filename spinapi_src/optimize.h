@@ -0,0 +1,41 @@
+/* optimize.h
+ * Optimization of buffered pulse programs before they are written to the board.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _OPTIMIZE_H
+#define _OPTIMIZE_H
+
+#include "caps.h"
+
+int optimize_program (int board_num, const BOARD_INFO * info, int base,
+		      int level, int *num_insts);
+void optimize_forget (int board_num, int num_insts);
+int optimize_lookup (int board_num, int addr, int *merged);
+void optimize_size (int board_num, int *original, int *optimized);
+void optimize_free (int board_num);
+
+#endif /* #ifndef _OPTIMIZE_H */
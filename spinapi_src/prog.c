@@ -0,0 +1,572 @@
+/* prog.c
+ * This module buffers the encoded pulse program on the host, so that it can be
+ * sent to the board with as few transfers as possible once programming is
+ * finished. It also remembers a hash of the program last written to each
+ * board, so that an unchanged program does not have to be sent again.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spinapi.h"
+#include "util.h"
+#include "usb.h"
+#include "prog.h"
+
+// Initial size (in bytes) of a program buffer. The buffer doubles in size
+// whenever it fills up.
+#define PROG_INITIAL_BYTES 4096
+
+// When only parts of a program are rewritten, unchanged runs of fewer IMWs
+// than this between two changed ones are rewritten anyway. Repositioning the
+// address register costs about as much as sending this many words.
+#define PROG_DIFF_MIN_GAP 4
+
+// 32 bit FNV-1a hash parameters
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+typedef struct
+{
+  char *data;		/** encoded IMWs, in the order they are written to the board */
+  int num_bytes;	/** number of valid bytes in the buffer */
+  int max_bytes;	/** allocated size of the buffer */
+  unsigned int hash;	/** hash of the valid bytes in the buffer */
+  int hash_stale;	/** nonzero if hash needs to be recomputed */
+
+  PROG_INST *insts;	/** the instructions making up the buffered program */
+  int num_insts;	/** number of valid entries in insts */
+  int max_insts;	/** allocated size of insts */
+
+  int loaded_valid;	/** nonzero if the fields below describe the program on the board */
+  char *loaded;		/** copy of the program last written to the board */
+  int loaded_bytes;	/** size of the program last written to the board */
+  int loaded_max;	/** allocated size of loaded */
+  unsigned int loaded_hash;	/** hash of the program last written to the board */
+  PROG_INST *loaded_insts;	/** the instructions of the program last written to the board */
+  int loaded_num_insts;	/** number of valid entries in loaded_insts */
+  int loaded_max_insts;	/** allocated size of loaded_insts */
+} PROG_BUFFER;
+
+static PROG_BUFFER prog_buf[MAX_NUM_BOARDS];
+
+/**
+ * \internal
+ * Discard any buffered instructions for the given board. This is called when
+ * the board starts programming a new pulse program.
+ */
+void
+prog_reset (int board_num)
+{
+  prog_buf[board_num].num_bytes = 0;
+  prog_buf[board_num].num_insts = 0;
+  prog_buf[board_num].hash = FNV_OFFSET_BASIS;
+  prog_buf[board_num].hash_stale = 0;
+}
+
+/**
+ * \internal
+ * Recompute the hash of the buffered program, after parts of it have been
+ * replaced.
+ */
+static void
+prog_update_hash (PROG_BUFFER * p)
+{
+  int i;
+
+  if (!p->hash_stale)
+    {
+      return;
+    }
+
+  p->hash = FNV_OFFSET_BASIS;
+  for (i = 0; i < p->num_bytes; i++)
+    {
+      p->hash = (p->hash ^ (unsigned char) p->data[i]) * FNV_PRIME;
+    }
+  p->hash_stale = 0;
+}
+
+/**
+ * \internal
+ * Append an encoded instruction to the program buffer of the given board,
+ * growing the buffer if necessary.
+ *
+ * \param imw The instruction memory word, as it would be sent to the board
+ * \param num_bytes Number of bytes making up the instruction
+ * \param inst What the instruction was built from, or NULL if it can not be
+ * patched later. The offset and num_bytes fields are filled in here.
+ * \return -1 on failure (and spinerr is set), 0 on success
+ */
+int
+prog_append (int board_num, const void *imw, int num_bytes,
+	     const PROG_INST * inst)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+  const unsigned char *bytes = (const unsigned char *) imw;
+  int i;
+
+  if (p->num_bytes + num_bytes > p->max_bytes)
+    {
+      int new_max = p->max_bytes ? p->max_bytes : PROG_INITIAL_BYTES;
+      char *new_data;
+
+      while (p->num_bytes + num_bytes > new_max)
+	{
+	  new_max *= 2;
+	}
+
+      new_data = (char *) realloc (p->data, new_max);
+      if (!new_data)
+	{
+	  spinerr = "Internal error: can't allocate program buffer";
+	  debug ("%s (%d bytes)", spinerr, new_max);
+	  return -1;
+	}
+
+      p->data = new_data;
+      p->max_bytes = new_max;
+    }
+
+  if (inst && p->num_insts == p->max_insts)
+    {
+      int new_max = p->max_insts ? 2 * p->max_insts : PROG_INITIAL_BYTES / 16;
+      PROG_INST *new_insts =
+	(PROG_INST *) realloc (p->insts, new_max * sizeof (PROG_INST));
+
+      if (!new_insts)
+	{
+	  spinerr = "Internal error: can't allocate program buffer";
+	  debug ("%s (%d instructions)", spinerr, new_max);
+	  return -1;
+	}
+
+      p->insts = new_insts;
+      p->max_insts = new_max;
+    }
+
+  if (inst)
+    {
+      p->insts[p->num_insts] = *inst;
+      p->insts[p->num_insts].offset = p->num_bytes;
+      p->insts[p->num_insts].num_bytes = num_bytes;
+      p->num_insts++;
+    }
+
+  if (p->num_bytes == 0)
+    {
+      p->hash = FNV_OFFSET_BASIS;
+      p->hash_stale = 0;
+    }
+
+  for (i = 0; i < num_bytes; i++)
+    {
+      p->hash = (p->hash ^ bytes[i]) * FNV_PRIME;
+    }
+
+  memcpy (p->data + p->num_bytes, imw, num_bytes);
+  p->num_bytes += num_bytes;
+
+  return 0;
+}
+
+/**
+ * \internal
+ * \return The number of bytes waiting to be sent to the given board.
+ */
+int
+prog_pending (int board_num)
+{
+  return prog_buf[board_num].num_bytes;
+}
+
+/**
+ * \internal
+ * \return The bytes waiting to be sent to the given board. The buffer is
+ * suitably aligned to be accessed as an array of ints.
+ */
+const char *
+prog_data (int board_num)
+{
+  return prog_buf[board_num].data;
+}
+
+/**
+ * \internal
+ * \return Nonzero if the buffered program is identical to the one that was
+ * last written to the board, so that it does not need to be sent again.
+ */
+int
+prog_is_loaded (int board_num)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+
+  prog_update_hash (p);
+
+  return p->loaded_valid && p->loaded_bytes == p->num_bytes
+    && p->loaded_hash == p->hash
+    && memcmp (p->loaded, p->data, p->num_bytes) == 0;
+}
+
+/**
+ * \internal
+ * Remember that the buffered program has been written to the board. A copy is
+ * kept so that later programs can be compared against it.
+ */
+void
+prog_set_loaded (int board_num)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+  PROG_INST *insts;
+  int max_insts;
+
+  prog_update_hash (p);
+
+  // The buffered instructions now describe the board, and the ones of the
+  // previous program become the next buffer
+  insts = p->loaded_insts;
+  max_insts = p->loaded_max_insts;
+  p->loaded_insts = p->insts;
+  p->loaded_max_insts = p->max_insts;
+  p->loaded_num_insts = p->num_insts;
+  p->insts = insts;
+  p->max_insts = max_insts;
+  p->num_insts = 0;
+
+  if (p->num_bytes > p->loaded_max)
+    {
+      char *new_loaded = (char *) realloc (p->loaded, p->max_bytes);
+
+      if (!new_loaded)
+	{
+	  // Not fatal, the next program will simply be sent in full
+	  debug ("can't allocate copy of program (%d bytes)", p->max_bytes);
+	  p->loaded_valid = 0;
+	  return;
+	}
+
+      p->loaded = new_loaded;
+      p->loaded_max = p->max_bytes;
+    }
+
+  memcpy (p->loaded, p->data, p->num_bytes);
+  p->loaded_valid = 1;
+  p->loaded_bytes = p->num_bytes;
+  p->loaded_hash = p->hash;
+}
+
+/**
+ * \internal
+ * Fill the buffer with the program that was last written to the board, so
+ * that some of its instructions can be replaced with prog_replace().
+ *
+ * \return -1 if there is no such program (and spinerr is set), 0 on success
+ */
+int
+prog_restore (int board_num)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+
+  if (!p->loaded_valid || p->loaded_num_insts == 0)
+    {
+      spinerr = "No pulse program has been written to the board";
+      debug ("%s", spinerr);
+      return -1;
+    }
+
+  prog_reset (board_num);
+
+  // Append the old image in one piece, then put back its instructions
+  if (prog_append (board_num, p->loaded, p->loaded_bytes, NULL) != 0)
+    {
+      return -1;
+    }
+
+  if (p->max_insts < p->loaded_num_insts)
+    {
+      PROG_INST *new_insts = (PROG_INST *) realloc (p->insts,
+						    p->loaded_max_insts *
+						    sizeof (PROG_INST));
+      if (!new_insts)
+	{
+	  spinerr = "Internal error: can't allocate program buffer";
+	  debug ("%s", spinerr);
+	  return -1;
+	}
+
+      p->insts = new_insts;
+      p->max_insts = p->loaded_max_insts;
+    }
+
+  memcpy (p->insts, p->loaded_insts, p->loaded_num_insts * sizeof (PROG_INST));
+  p->num_insts = p->loaded_num_insts;
+
+  return 0;
+}
+
+/**
+ * \internal
+ * \return Instruction number index of the buffered program, or NULL if there
+ * is no such instruction.
+ */
+PROG_INST *
+prog_get_inst (int board_num, int index)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+
+  if (index < 0 || index >= p->num_insts)
+    {
+      return NULL;
+    }
+
+  return &p->insts[index];
+}
+
+/**
+ * \internal
+ * \return The number of instructions in the buffered program which can be
+ * encoded again, see prog_append().
+ */
+int
+prog_num_insts (int board_num)
+{
+  return prog_buf[board_num].num_insts;
+}
+
+/**
+ * \internal
+ * Get the instructions of the buffered program, or of the program last
+ * written to the board.
+ *
+ * \param loaded Nonzero for the program last written to the board
+ * \param num_insts Set to the number of instructions
+ * \return The instructions, or NULL if there is no such program or some of its
+ * IMWs were not written by the pb_inst* functions.
+ */
+const PROG_INST *
+prog_program (int board_num, int loaded, int *num_insts)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+  const PROG_INST *insts = loaded ? p->loaded_insts : p->insts;
+  int n = loaded ? p->loaded_num_insts : p->num_insts;
+  int num_bytes = loaded ? p->loaded_bytes : p->num_bytes;
+
+  if ((loaded && !p->loaded_valid) || n == 0
+      || insts[n - 1].offset + insts[n - 1].num_bytes != num_bytes)
+    {
+      return NULL;
+    }
+
+  *num_insts = n;
+  return insts;
+}
+
+/**
+ * \internal
+ * Overwrite the IMW of an instruction in the buffered program. The new IMW
+ * must be the same size as the old one.
+ */
+void
+prog_replace (int board_num, const PROG_INST * inst, const void *imw)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+
+  memcpy (p->data + inst->offset, imw, inst->num_bytes);
+  p->hash_stale = 1;
+}
+
+/**
+ * \internal
+ * \return Nonzero if instruction number imw of the buffered program differs
+ * from what was last written to the board.
+ */
+static int
+prog_imw_dirty (PROG_BUFFER * p, int imw, int imw_bytes)
+{
+  int offset = imw * imw_bytes;
+
+  if (!p->loaded_valid || offset + imw_bytes > p->loaded_bytes)
+    {
+      return 1;
+    }
+
+  return memcmp (p->data + offset, p->loaded + offset, imw_bytes) != 0;
+}
+
+/**
+ * \internal
+ * Find how much of the buffered program has to be written to a board which
+ * can only be programmed from the first instruction on. Everything up to and
+ * including the last instruction that differs from what is on the board must
+ * be rewritten.
+ *
+ * \param imw_bytes Number of bytes making up one instruction
+ * \return The number of bytes to write, starting at the beginning of the buffer
+ */
+int
+prog_dirty_length (int board_num, int imw_bytes)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+  int num_imw = p->num_bytes / imw_bytes;
+  int i;
+
+  for (i = num_imw - 1; i >= 0; i--)
+    {
+      if (prog_imw_dirty (p, i, imw_bytes))
+	{
+	  return (i + 1) * imw_bytes;
+	}
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Forget what is in the instruction memory of the board. The next program
+ * will be written in full.
+ */
+void
+prog_invalidate (int board_num)
+{
+  prog_buf[board_num].loaded_valid = 0;
+}
+
+/**
+ * \internal
+ * Send the buffered program to the currently selected usb device, starting at
+ * the given address. The whole image is handed to usb_write_data() at once so
+ * that it goes out in the fewest possible bulk transfers.
+ *
+ * \return -1 on failure, 0 on success
+ */
+int
+prog_upload_usb (int board_num, unsigned int address)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+
+  if (p->num_bytes == 0)
+    {
+      return 0;
+    }
+
+  debug ("writing %d bytes to address 0x%x", p->num_bytes, address);
+
+  if (usb_write_address (address) < 0)
+    {
+      spinerr = "Error writing program address";
+      debug ("%s", spinerr);
+      return -1;
+    }
+
+  if (usb_write_data ((int *) p->data, p->num_bytes / sizeof (int)) < 0)
+    {
+      spinerr = "Error writing program data";
+      debug ("%s", spinerr);
+      return -1;
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Send only the instructions which differ from what was last written to the
+ * board. Each run of changed instructions is written separately, after
+ * pointing the address register at the first instruction of the run.
+ *
+ * \param address Address of the first instruction in the board memory
+ * \param imw_bytes Number of bytes making up one instruction
+ * \return -1 on failure, 0 on success
+ */
+int
+prog_upload_usb_diff (int board_num, unsigned int address, int imw_bytes)
+{
+  PROG_BUFFER *p = &prog_buf[board_num];
+  int num_imw = p->num_bytes / imw_bytes;
+  int words_per_imw = imw_bytes / sizeof (int);
+  int first, last, i;
+  int num_runs = 0, num_written = 0;
+
+  i = 0;
+  while (i < num_imw)
+    {
+      if (!prog_imw_dirty (p, i, imw_bytes))
+	{
+	  i++;
+	  continue;
+	}
+
+      // Extend the run until PROG_DIFF_MIN_GAP clean instructions in a row
+      first = last = i;
+      for (i++; i < num_imw && i - last <= PROG_DIFF_MIN_GAP; i++)
+	{
+	  if (prog_imw_dirty (p, i, imw_bytes))
+	    {
+	      last = i;
+	    }
+	}
+      i = last + 1;
+
+      if (usb_write_address (address + first) < 0)
+	{
+	  spinerr = "Error writing program address";
+	  debug ("%s", spinerr);
+	  return -1;
+	}
+
+      if (usb_write_data ((int *) (p->data + first * imw_bytes),
+			  (last - first + 1) * words_per_imw) < 0)
+	{
+	  spinerr = "Error writing program data";
+	  debug ("%s", spinerr);
+	  return -1;
+	}
+
+      num_runs++;
+      num_written += last - first + 1;
+    }
+
+  debug ("rewrote %d of %d instructions in %d transfers", num_written,
+	 num_imw, num_runs);
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Release the memory held by the program buffer of the given board.
+ */
+void
+prog_free (int board_num)
+{
+  free (prog_buf[board_num].data);
+  free (prog_buf[board_num].loaded);
+  free (prog_buf[board_num].insts);
+  free (prog_buf[board_num].loaded_insts);
+  memset (&prog_buf[board_num], 0, sizeof (PROG_BUFFER));
+}
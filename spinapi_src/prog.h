@@ -0,0 +1,69 @@
+/* prog.h
+ * Host-side buffering of the pulse program instruction memory words (IMWs).
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _PROG_H
+#define _PROG_H
+
+// Start address of the PulseBlaster core instruction memory on boards
+// using usb_method 2
+#define PB_USB_PROG_ADDRESS 0x80000
+
+// What an instruction was built from, so that it can be encoded again when
+// it is patched
+typedef struct
+{
+  int flags[3];		/** flag words, as passed to the encoder */
+  int inst;		/** opcode */
+  int inst_data;	/** instruction data, as passed to the encoder */
+  unsigned int delay;	/** delay field, as passed to the encoder */
+  unsigned int raw_delay;	/** delay field before the "1FF" fix, i.e. the length of the instruction in clock cycles minus 3 */
+  int from_pbonly;	/** nonzero if the flag packing and "1FF" fix of pb_inst_pbonly64() apply */
+  int split;		/** nonzero if the instruction is part of a longer one, see write_inst_cycles() */
+  int offset;		/** position of the IMW in the program buffer, in bytes */
+  int num_bytes;	/** size of the IMW, in bytes */
+} PROG_INST;
+
+void prog_reset (int board_num);
+int prog_append (int board_num, const void *imw, int num_bytes,
+		 const PROG_INST * inst);
+int prog_restore (int board_num);
+PROG_INST *prog_get_inst (int board_num, int index);
+int prog_num_insts (int board_num);
+const PROG_INST *prog_program (int board_num, int loaded, int *num_insts);
+void prog_replace (int board_num, const PROG_INST * inst, const void *imw);
+int prog_pending (int board_num);
+const char *prog_data (int board_num);
+int prog_is_loaded (int board_num);
+void prog_set_loaded (int board_num);
+void prog_invalidate (int board_num);
+int prog_dirty_length (int board_num, int imw_bytes);
+int prog_upload_usb (int board_num, unsigned int address);
+int prog_upload_usb_diff (int board_num, unsigned int address, int imw_bytes);
+void prog_free (int board_num);
+
+#endif /* #ifndef _PROG_H */
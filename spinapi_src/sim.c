@@ -0,0 +1,370 @@
+/* sim.c
+ * This module executes a pulse program on the host the way the PulseBlaster
+ * core would, counting clock cycles, and produces the timeline of the outputs.
+ * Loops are run through once and their other iterations are accounted for as
+ * a whole, so that programs which run for hours are simulated in about the
+ * time it takes to read them.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spinapi.h"
+#include "util.h"
+#include "prog.h"
+#include "sim.h"
+
+// Number of clock cycles an instruction takes on top of its delay field
+#define INST_OVERHEAD_CYCLES 3
+
+// Number of levels the PulseBlaster core can nest loops and subroutines
+#define SIM_MAX_DEPTH 8
+
+// Instructions executed before a program is considered to never finish. Loops
+// are only run through once, so this is only reached by programs which branch
+// around forever inside a loop or subroutine.
+#define SIM_MAX_STEPS (1 << 26)
+
+typedef struct
+{
+  int addr;		/** address of the LOOP instruction */
+  int count;		/** number of times the loop runs */
+  __int64 start;	/** clock cycle the loop started at */
+  int mark;		/** number of timeline segments when the loop started */
+  __int64 mark_cycles;	/** length of the last of those segments */
+  int waits;		/** number of WAIT instructions executed when the loop started */
+} SIM_LOOP;
+
+typedef struct
+{
+  PB_SIM_SEGMENT *timeline;	/** where the timeline is written */
+  int max_segments;		/** size of timeline */
+  PB_SIM_RESULT *result;	/** size of the timeline and totals */
+} SIM_STATE;
+
+/**
+ * \internal
+ * Append the output of an instruction to the timeline. It is merged into the
+ * last segment if the outputs are the same. Once the timeline is full,
+ * nothing more is added to it.
+ */
+static void
+sim_output (SIM_STATE * s, const int *flags, __int64 cycles)
+{
+  PB_SIM_RESULT *r = s->result;
+  PB_SIM_SEGMENT *seg;
+
+  if (r->truncated)
+    {
+      return;
+    }
+
+  if (r->num_segments > 0)
+    {
+      seg = &s->timeline[r->num_segments - 1];
+      if (memcmp (seg->flags, flags, sizeof (seg->flags)) == 0)
+	{
+	  seg->cycles += cycles;
+	  return;
+	}
+    }
+
+  if (r->num_segments == s->max_segments)
+    {
+      r->truncated = 1;
+      return;
+    }
+
+  seg = &s->timeline[r->num_segments++];
+  memcpy (seg->flags, flags, sizeof (seg->flags));
+  seg->cycles = cycles;
+}
+
+/**
+ * \internal
+ * Append the timeline of the remaining iterations of a loop which has run
+ * through once. Every iteration produces exactly the same outputs as the
+ * first one.
+ *
+ * \param remaining Number of iterations left
+ * \param body Length of one iteration in clock cycles
+ */
+static void
+sim_repeat_loop (SIM_STATE * s, const SIM_LOOP * loop, int remaining,
+		 __int64 body)
+{
+  PB_SIM_RESULT *r = s->result;
+  int end = r->num_segments;
+  int first_flags[3];
+  __int64 first_cycles = 0;
+  __int64 last_cycles;
+  int before;
+  int i, j;
+
+  if (r->truncated || end == 0)
+    {
+      return;
+    }
+
+  // The start of the loop may have been merged into the segment before it.
+  // Only the last segment grows while copying, so its length is taken now.
+  if (loop->mark > 0)
+    {
+      memcpy (first_flags, s->timeline[loop->mark - 1].flags,
+	      sizeof (first_flags));
+      first_cycles = s->timeline[loop->mark - 1].cycles - loop->mark_cycles;
+    }
+  last_cycles = s->timeline[end - 1].cycles;
+
+  for (i = 0; i < remaining && !r->truncated; i++)
+    {
+      before = r->num_segments;
+
+      if (first_cycles > 0)
+	{
+	  sim_output (s, first_flags, first_cycles);
+	}
+      for (j = loop->mark; j < end; j++)
+	{
+	  sim_output (s, s->timeline[j].flags,
+		      j == end - 1 ? last_cycles : s->timeline[j].cycles);
+	}
+
+      // If the whole iteration was merged into the last segment, so are all
+      // the others
+      if (r->num_segments == before && !r->truncated)
+	{
+	  s->timeline[before - 1].cycles += (remaining - i - 1) * body;
+	  break;
+	}
+    }
+}
+
+/**
+ * \internal
+ * Execute a pulse program the way the PulseBlaster core does, and produce the
+ * timeline of its outputs. Every instruction takes its delay plus 3 clock
+ * cycles, as calculated before any "1FF" fix is applied, and a LONG_DELAY
+ * takes that times its repeat count. WAIT instructions are assumed to be
+ * triggered right away.
+ *
+ * \param base Address of the first instruction of the program on the board.
+ * Jump targets in the instruction data are relative to this.
+ * \param clock The clock frequency of the PulseBlaster core, in GHz
+ * \param timeline Array which is filled with the segments of the timeline
+ * \param max_segments Size of timeline
+ * \param result Filled in with the totals and the size of the timeline
+ * \return -1 if the program can not run on the board (and spinerr is set),
+ * 0 if it stops, and 1 if it repeats forever
+ */
+int
+sim_run (const PROG_INST * insts, int num_insts, int base, double clock,
+	 PB_SIM_SEGMENT * timeline, int max_segments, PB_SIM_RESULT * result)
+{
+  SIM_STATE s;
+  SIM_LOOP loops[SIM_MAX_DEPTH];
+  int calls[SIM_MAX_DEPTH];
+  int num_loops = 0;
+  int num_calls = 0;
+  char *visited;
+  __int64 now = 0;
+  int return_value = -1;
+  int error = 0;
+  int steps;
+  int pc = 0;
+  int i;
+
+  memset (result, 0, sizeof (PB_SIM_RESULT));
+  s.timeline = timeline;
+  s.max_segments = max_segments;
+  s.result = result;
+
+  // Instructions reached outside of any loop or subroutine. Branching back
+  // to one of them repeats the program forever.
+  visited = (char *) calloc (num_insts, 1);
+  if (!visited)
+    {
+      spinerr = "Internal error: can't allocate simulator buffer";
+      debug ("%s (%d instructions)\n", spinerr, num_insts);
+      return -1;
+    }
+
+  for (steps = 0; steps < SIM_MAX_STEPS && return_value < 0; steps++)
+    {
+      const PROG_INST *inst;
+      __int64 cycles;
+      int target;
+
+      if (pc == num_insts)
+	{
+	  spinerr = "Pulse program runs past its last instruction";
+	  break;
+	}
+      if (pc < 0 || pc > num_insts)
+	{
+	  spinerr = "Jump to an address outside of the pulse program";
+	  break;
+	}
+
+      inst = &insts[pc];
+      target = inst->inst_data - base;
+      cycles = (__int64) inst->raw_delay + INST_OVERHEAD_CYCLES;
+
+      if (num_loops == 0 && num_calls == 0)
+	{
+	  visited[pc] = 1;
+	}
+
+      if (inst->inst == STOP)
+	{
+	  memcpy (result->end_flags, inst->flags, sizeof (result->end_flags));
+	  return_value = 0;
+	  break;
+	}
+
+      if (inst->inst == LOOP)
+	{
+	  if (num_loops == SIM_MAX_DEPTH)
+	    {
+	      spinerr = "Loops are nested too deeply";
+	      break;
+	    }
+	  // The LOOP instruction runs in every iteration
+	  loops[num_loops].addr = pc;
+	  loops[num_loops].count = inst->inst_data + 1;
+	  loops[num_loops].start = now;
+	  loops[num_loops].mark = result->num_segments;
+	  loops[num_loops].mark_cycles = result->num_segments > 0 ?
+	    timeline[result->num_segments - 1].cycles : 0;
+	  loops[num_loops].waits = result->num_waits;
+	  num_loops++;
+	}
+      else if (inst->inst == LONG_DELAY)
+	{
+	  cycles *= inst->inst_data + 2;
+	}
+
+      sim_output (&s, inst->flags, cycles);
+      now += cycles;
+
+      switch (inst->inst)
+	{
+	case CONTINUE:
+	case LONG_DELAY:
+	case LOOP:
+	  pc++;
+	  break;
+
+	case WAIT:
+	  result->num_waits++;
+	  pc++;
+	  break;
+
+	case END_LOOP:
+	  if (num_loops == 0 || target != loops[num_loops - 1].addr)
+	    {
+	      spinerr = "END_LOOP does not belong to the innermost loop";
+	      error = 1;
+	      break;
+	    }
+	  num_loops--;
+	  if (loops[num_loops].count > 1)
+	    {
+	      __int64 body = now - loops[num_loops].start;
+
+	      sim_repeat_loop (&s, &loops[num_loops],
+			       loops[num_loops].count - 1, body);
+	      now += (loops[num_loops].count - 1) * body;
+	      result->num_waits += (loops[num_loops].count - 1)
+		* (result->num_waits - loops[num_loops].waits);
+	    }
+	  pc++;
+	  break;
+
+	case JSR:
+	  if (num_calls == SIM_MAX_DEPTH)
+	    {
+	      spinerr = "Subroutines are nested too deeply";
+	      error = 1;
+	      break;
+	    }
+	  calls[num_calls++] = pc + 1;
+	  pc = target;
+	  break;
+
+	case RTS:
+	  if (num_calls == 0)
+	    {
+	      spinerr = "RTS outside of a subroutine";
+	      error = 1;
+	      break;
+	    }
+	  pc = calls[--num_calls];
+	  break;
+
+	case BRANCH:
+	  if (num_loops == 0 && num_calls == 0 && target >= 0
+	      && target < num_insts && visited[target])
+	    {
+	      result->repeats = 1;
+	      return_value = 1;
+	    }
+	  pc = target;
+	  break;
+
+	default:
+	  spinerr = "Instruction can not be simulated";
+	  error = 1;
+	  break;
+	}
+
+      if (error)
+	{
+	  break;
+	}
+    }
+
+  if (return_value < 0 && steps == SIM_MAX_STEPS)
+    {
+      spinerr = "Pulse program does not finish";
+    }
+
+  if (return_value < 0)
+    {
+      debug ("%s\n", spinerr);
+    }
+
+  result->cycles = now;
+  result->runtime = now / clock;
+  for (i = 0; i < result->num_segments; i++)
+    {
+      timeline[i].length = timeline[i].cycles / clock;
+    }
+
+  free (visited);
+  return return_value;
+}
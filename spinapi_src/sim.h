@@ -0,0 +1,38 @@
+/* sim.h
+ * Host-side simulation of the PulseBlaster core.
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include "prog.h"
+
+int sim_run (const PROG_INST * insts, int num_insts, int base, double clock,
+	     PB_SIM_SEGMENT * timeline, int max_segments,
+	     PB_SIM_RESULT * result);
+
+#endif /* #ifndef _SIM_H */
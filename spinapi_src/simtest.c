@@ -0,0 +1,124 @@
+/* simtest.c
+ *
+ * This program runs small pulse programs through the simulator behind
+ * pb_simulate() and checks the totals it reports, such as the number of WAIT
+ * instructions executed when they are inside of loops. No board is needed.
+ *
+ * This code is used for our own internal debugging procedures. It is of no use to customers.
+ *
+ * Build it against the library sources, e.g.
+ *   gcc -o simtest simtest.c <spinapi objects> -lusb -lm
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "spinapi.h"
+#include "sim.h"
+
+#define CLOCK 0.1		// GHz
+#define MAX_INSTS 16
+#define MAX_SEGMENTS 64
+
+typedef struct
+{
+  const char *name;
+  int num_insts;
+  int insts[MAX_INSTS][3];	// flags, opcode and instruction data
+  int num_waits;		// expected number of WAITs executed
+  __int64 cycles;		// expected length in clock cycles
+} SIM_TEST;
+
+// Every instruction takes 10 clock cycles, and the program ends as the STOP
+// is reached. A LOOP with instruction data n runs n + 1 times.
+static const SIM_TEST tests[] = {
+  {"WAIT outside of a loop", 3,
+   {{1, CONTINUE, 0}, {2, WAIT, 0}, {0, STOP, 0}},
+   1, 20},
+  {"WAIT inside a loop", 4,
+   {{1, LOOP, 3}, {2, WAIT, 0}, {1, END_LOOP, 0}, {0, STOP, 0}},
+   4, 4 * 30},
+  {"WAITs inside nested loops", 7,
+   {{1, LOOP, 2}, {2, WAIT, 0}, {3, LOOP, 1}, {4, WAIT, 0},
+    {3, END_LOOP, 2}, {1, END_LOOP, 0}, {0, STOP, 0}},
+   3 * (1 + 2), 3 * (30 + 2 * 30)},
+  {"WAIT inside a loop which outputs the same all along", 4,
+   {{1, LOOP, 9}, {1, WAIT, 0}, {1, END_LOOP, 0}, {0, STOP, 0}},
+   10, 10 * 30},
+};
+
+static int
+run_test (const SIM_TEST * t, int max_segments)
+{
+  PROG_INST insts[MAX_INSTS];
+  PB_SIM_SEGMENT timeline[MAX_SEGMENTS];
+  PB_SIM_RESULT result;
+  int return_value;
+  int i;
+
+  memset (insts, 0, sizeof (insts));
+  for (i = 0; i < t->num_insts; i++)
+    {
+      insts[i].flags[0] = t->insts[i][0];
+      insts[i].inst = t->insts[i][1];
+      insts[i].inst_data = t->insts[i][2];
+      insts[i].raw_delay = 10 - 3;
+    }
+
+  return_value = sim_run (insts, t->num_insts, 0, CLOCK,
+			  max_segments ? timeline : NULL, max_segments,
+			  &result);
+
+  if (return_value != 0 || result.num_waits != t->num_waits
+      || result.cycles != t->cycles)
+    {
+      printf ("%s (%d segments): returned %d, %d WAITs, %lld cycles, "
+	      "expected 0, %d WAITs, %lld cycles\n", t->name, max_segments,
+	      return_value, result.num_waits, (long long) result.cycles,
+	      t->num_waits, (long long) t->cycles);
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+main ()
+{
+  int failed = 0;
+  int i;
+
+  // With and without a timeline, which is where the loops are unrolled
+  for (i = 0; i < (int) (sizeof (tests) / sizeof (tests[0])); i++)
+    {
+      failed |= run_test (&tests[i], MAX_SEGMENTS);
+      failed |= run_test (&tests[i], 0);
+    }
+
+  printf (failed ? "FAILED\n" : "OK\n");
+  return failed ? -1 : 0;
+}
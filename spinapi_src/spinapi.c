@@ -42,6 +42,11 @@
 #include "caps.h"
 #include "if.h"
 #include "usb.h"
+#include "prog.h"
+#include "encode.h"
+#include "optimize.h"
+#include "sim.h"
+#include "image.h"
 
 /*
 *
@@ -102,6 +107,82 @@ BOARD_INFO board[MAX_NUM_BOARDS];
 static int cur_device = -1;
 static int cur_device_addr = 0;
 
+// Shortest instruction the PulseBlaster core can execute, in clock cycles (a
+// delay field of 2), and longest one (a full 32 bit delay field)
+#define MIN_INST_CYCLES 5
+#define MAX_INST_CYCLES (0xFFFFFFFFLL + 3)
+
+// Largest repeat count of a LONG_DELAY, limited by the 20 bit instruction data
+#define MAX_LONG_DELAY_REPS (0xFFFFF + 2)
+
+// Number of repeat counts split_cycles() tries when looking for one which
+// divides a length evenly, starting from the smallest one that can work
+#define MAX_SPLIT_CANDIDATES 4096
+
+// Size of the blocks in which outp_stream_write() sends data to the
+// PulseBlaster core data port (port_base + 6)
+#define OUTP_STREAM_SIZE 4096
+
+typedef struct
+{
+  char data[OUTP_STREAM_SIZE];	/** bytes waiting to be written to the board */
+  int len;			/** number of bytes waiting */
+  unsigned int address;		/** address the bytes are written to */
+  double bytes;			/** bytes written since the last pb_start_programming() */
+  double seconds;		/** time spent writing those bytes */
+} OUTP_STREAM;
+
+static OUTP_STREAM outp_stream[MAX_NUM_BOARDS];
+
+// How pulse programs are written to each board, see pb_set_upload_mode()
+static int upload_mode[MAX_NUM_BOARDS];
+
+// Which optimizations are applied to pulse programs, see pb_set_optimization()
+static int optimization[MAX_NUM_BOARDS];
+
+// Where in the instruction memory pulse programs are placed, see
+// pb_set_double_buffer(), pb_set_library_size() and pb_catalog_reserve()
+typedef struct
+{
+  int enabled;		/** nonzero if the instruction memory is split into two banks */
+  int bank_size;	/** number of instructions in each bank */
+  int next_bank;	/** bank the next program is written to */
+  int base;		/** first instruction of the program being written */
+  int loaded_base;	/** first instruction of the program last written */
+  int running_start;	/** start address the board currently uses */
+  int pending_start;	/** start address to set at the next pb_start(), or -1 */
+  int library_size;	/** number of instructions reserved for the subroutine library at the end of the instruction memory */
+  int library_insts;	/** number of instructions of the library on the board */
+  int catalog_entry;	/** catalog entry the program being written goes to, or -1 */
+  int resident_end;	/** end of the last pulse program written outside the catalog */
+} PROG_BANKS;
+
+static PROG_BANKS prog_banks[MAX_NUM_BOARDS];
+
+// Named pulse programs which are kept in the instruction memory, see
+// pb_catalog_reserve()
+#define CATALOG_MAX_ENTRIES 32
+#define CATALOG_MAX_NAME 32
+
+typedef struct
+{
+  char name[CATALOG_MAX_NAME];	/** name of the program, or "" if the entry is unused */
+  int base;		/** first instruction of the region reserved for the program */
+  int size;		/** number of instructions reserved */
+  int num_insts;	/** number of instructions written, or 0 if the program has not been written */
+  double runtime;	/** time the program runs for in nanoseconds, or -1 if it waits for triggers or runs forever */
+} CATALOG_ENTRY;
+
+static CATALOG_ENTRY catalog[MAX_NUM_BOARDS][CATALOG_MAX_ENTRIES];
+
+// When each board was last started with pb_start(), see pb_wait_idle()
+static double start_time[MAX_NUM_BOARDS];
+
+// Shortest and longest time pb_wait_idle() sleeps between two status reads
+// when it does not know when the program ends, in seconds
+#define WAIT_MIN_POLL 100e-6
+#define WAIT_MAX_POLL 10e-3
+
 /** \internal
  * This is set to a description string whenever an error occurs inside a function */
 char *spinerr;
@@ -115,6 +196,34 @@ char *version = "20110913";//VER_STRING_API;
 
 int do_os_init (int board);
 int do_os_close (int board);
+static int finish_pulse_program (void);
+static int flush_pulse_program (int mode);
+static int current_upload_mode (void);
+static int library_base (void);
+static int catalog_bottom (void);
+static void catalog_loaded (void);
+static double loaded_runtime (void);
+static int outp_stream_flush (void);
+static int outp_stream_write (const char *data, int len);
+static int hs_write (const char *pattern, int pattern_bytes, int num_cycles);
+static int write_imw (const void *imw, int num_bytes, const PROG_INST * inst);
+static int write_inst (int *pflags, int inst, int inst_data,
+		       unsigned int delay, int from_pbonly, int split);
+static int pci_start_pulse_program (void);
+int write_inst_cycles (int *pflags, int inst, int inst_data, __int64 cycles,
+		       int from_pbonly);
+static int length_to_delay (double length, unsigned int *delay);
+static __int64 length_cycles (double length);
+static int check_cycles (__int64 cycles);
+static int length_to_cycles (double length, __int64 * cycles);
+static int pbonly_cycles (__int64 flags, int inst, int inst_data,
+			  __int64 cycles);
+static int dds2_cycles (int freq0, int phase0, int amp0, int dds_en0,
+			int phase_reset0, int freq1, int phase1, int amp1,
+			int dds_en1, int phase_reset1, int flags, int inst,
+			int inst_data, __int64 cycles);
+static int split_cycles (__int64 cycles, int allow_single, int *reps,
+			 __int64 * per, __int64 * rest);
 
 /**
  * \mainpage SpinAPI Documentation
@@ -252,6 +361,9 @@ pb_init (void)
 	  return -1;
 	}
 
+      // Nothing is known yet about the registers of this board
+      reg_shadow_invalidate (cur_board);
+
       // If this is a RadioProcessor, set ADC and DAC defaults. This is done
       // here instead of pb_set_defaults() because the user should not ever
       // change these values.
@@ -262,6 +374,11 @@ pb_init (void)
 	  pb_set_radio_hw (adc_control, dac_control);
 	}
 
+      prog_invalidate (cur_board);
+      memset (&prog_banks[cur_board], 0, sizeof (PROG_BANKS));
+      prog_banks[cur_board].pending_start = -1;
+      prog_banks[cur_board].catalog_entry = -1;
+      memset (catalog[cur_board], 0, sizeof (catalog[cur_board]));
       board[cur_board].did_init = 1;
     }
   else
@@ -301,6 +418,8 @@ pb_close (void)
     }
 
   board[cur_board].did_init = 0;
+  prog_free (cur_board);
+  optimize_free (cur_board);
   return do_os_close (cur_board);
 }
 
@@ -320,6 +439,23 @@ pb_start_programming (int device)
       debug
 	("pb_start_programming: WARNING: pb_start_programming() called without previous stop\n",
 	 spinerr);
+      finish_pulse_program ();
+      image_end ();
+    }
+
+  if (device == PULSE_LIBRARY && prog_banks[cur_board].library_size == 0)
+    {
+      spinerr = "No instruction memory has been reserved for a subroutine library";
+      debug ("pb_start_programming: %s\n", spinerr);
+      return -1;
+    }
+
+  // Images are recorded on the host only, and need no board
+  if (device == PULSE_IMAGE)
+    {
+      image_begin ();
+      cur_device = device;
+      return 0;
     }
 
   if (board[cur_board].usb_method == 2)
@@ -329,7 +465,28 @@ pb_start_programming (int device)
       if (device == PULSE_PROGRAM)
 	{
 	  num_instructions = 0;	// Clear number of instructions  
-	  usb_write_address (0x80000);	//Write the address register with the start of the PB core memory.
+	  prog_reset (cur_board);	// Instructions are buffered and written to the PB core memory by pb_stop_programming()
+	  prog_banks[cur_board].catalog_entry = -1;
+
+	  // With double buffering, a program which has not been started yet is
+	  // replaced, otherwise the bank which is not running is used
+	  if (prog_banks[cur_board].enabled && prog_banks[cur_board].pending_start >= 0)
+	    prog_banks[cur_board].base = prog_banks[cur_board].pending_start;
+	  else if (prog_banks[cur_board].enabled)
+	    prog_banks[cur_board].base = prog_banks[cur_board].next_bank * prog_banks[cur_board].bank_size;
+	  else
+	    prog_banks[cur_board].base = 0;
+	}
+
+      // The library goes to the end of the instruction memory, where it
+      // stays while pulse programs are written and started
+      if (device == PULSE_LIBRARY)
+	{
+	  num_instructions = 0;
+	  prog_reset (cur_board);
+	  prog_banks[cur_board].base = library_base ();
+	  prog_banks[cur_board].library_insts = 0;
+	  prog_banks[cur_board].catalog_entry = -1;
 	}
 
       if (device == FREQ_REGS)
@@ -368,52 +525,21 @@ pb_start_programming (int device)
       if (device == PULSE_PROGRAM)
 	{
 	  num_instructions = 0;	// Clear number of instructions
+	  prog_reset (cur_board);	// Instructions are buffered and written by pb_stop_programming()
 
-	  if (board[cur_board].firmware_id == 0xa13 || board[cur_board].firmware_id == 0xC10)	//Fix me.
-	    {
-	      //For 0x0a13, the IMW size is 88 bits. (11x8=88)
-	      return_value = pb_outp (port_base + 2, 11);	// This is an instruction, therefore Bytes Per Word (BPW) = 11
-	    }
-      else if(board[cur_board].firmware_id == 0x0908)	//Fix me.
-	    {
-	      //For 0x0908, the IMW size is 64 bits. (8x8=64)
-	      return_value = pb_outp (port_base + 2, 8);	// This is an instruction, therefore Bytes Per Word (BPW) = 8
-	    }
-      else if(board[cur_board].firmware_id == 0x1105 || board[cur_board].firmware_id == 0x1106 || board[cur_board].firmware_id == 0x1107)	//Fix me.
-	    {
-	      //For 0x1105, the IMW size is 32 bits. (4x8=64)
-	      return_value = pb_outp (port_base + 2, 4);	// This is an instruction, therefore Bytes Per Word (BPW) = 4
-	    }
-	  else
-	    {
-	      return_value = pb_outp (port_base + 2, 10);	// This is an instruction, therefore Bytes Per Word (BPW) = 10
-	    }
-
-	  if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = my_strcat ("BPW=10 write failed", spinerr);
-	      debug ("pb_start_programming: %s\n", spinerr);
-	      return return_value;
-	    }
-
-	  return_value = pb_outp (port_base + 3, device);	// Device = RAM
-	  if (return_value != 0 && (!(ISA_BOARD)))
+	  if (board[cur_board].encoder == NULL)
 	    {
-	      spinerr = my_strcat ("Device=RAM write failed", spinerr);
+	      spinerr = "Board has not been initialized";
 	      debug ("pb_start_programming: %s\n", spinerr);
-	      return return_value;
+	      return -1;
 	    }
 
-	  return_value = pb_outp (port_base + 4, 0);	// Reset mem counter
+	  return_value = pci_start_pulse_program ();
 	  if (return_value != 0 && (!(ISA_BOARD)))
 	    {
-	      spinerr =
-		my_strcat ("mem counter write failed (PULSE_PROGRAM)",
-			   spinerr);
 	      debug ("pb_start_programming: %s\n", spinerr);
 	      return return_value;
 	    }
-
 	}
       else if (device == FREQ_REGS || device == TX_PHASE_REGS
 	       || device == RX_PHASE_REGS)
@@ -450,6 +576,9 @@ pb_start_programming (int device)
   cur_device = device;
   cur_device_addr = 0;
 
+  outp_stream[cur_board].bytes = 0.0;
+  outp_stream[cur_board].seconds = 0.0;
+
   return 0;
 }
 
@@ -462,8 +591,23 @@ pb_stop_programming (void)
 
   debug ("pb_stop_programming: (device=%d)\n", cur_device);
 
+  if (cur_device == PULSE_IMAGE)
+    {
+      image_end ();
+      cur_device = -1;
+      return 0;
+    }
+
   if (board[cur_board].usb_method != 2)
   {
+      return_value = finish_pulse_program ();
+      if (return_value != 0 && (!(ISA_BOARD)))
+	  {
+	    debug ("pb_stop_programming: %s\n", spinerr);
+	    cur_device = -1;
+	    return return_value;
+	  }
+
       return_value = pb_outp (port_base + 7, 0);
       if (return_value != 0 && (!(ISA_BOARD)))
 	  {
@@ -475,6 +619,23 @@ pb_stop_programming (void)
   {    
 	  if(cur_device == PULSE_PROGRAM)
 	  {
+	    return_value = finish_pulse_program ();
+	    if (return_value != 0)
+	      {
+	        debug ("pb_stop_programming: %s\n", spinerr);
+	        cur_device = -1;
+	        return return_value;
+	      }
+
+	    // The new program runs from the next pb_start() on. Programs of the
+	    // catalog only run once they are selected.
+	    if (prog_banks[cur_board].enabled)
+	      prog_banks[cur_board].pending_start = prog_banks[cur_board].base;
+	    else if (prog_banks[cur_board].catalog_entry < 0)
+	      prog_banks[cur_board].pending_start =
+		prog_banks[cur_board].running_start != prog_banks[cur_board].base
+		? prog_banks[cur_board].base : -1;
+
 	    if(board[cur_board].firmware_id == 0x0C13)
 		{
 		  debug("pb_stop_programming(PULSE_PROGRAM): Writing shape period information to DDS-I board\n");
@@ -497,6 +658,16 @@ pb_stop_programming (void)
 		  usb_write_data(shape_period_array[1], 7);
 		}
 	  }
+	  else if(cur_device == PULSE_LIBRARY)
+	  {
+	    return_value = finish_pulse_program ();
+	    if (return_value != 0)
+	      {
+	        debug ("pb_stop_programming: %s\n", spinerr);
+	        cur_device = -1;
+	        return return_value;
+	      }
+	  }
       usb_write_address (0);
   }
 
@@ -511,12 +682,34 @@ pb_start (void)
 {
   spinerr = noerr;
   debug("pb_start():");
+
+  // Programs which never call pb_stop_programming() still expect their
+  // instructions to be on the board when it is started.
+  if (finish_pulse_program () != 0)
+    {
+      debug ("pb_start: %s\n", spinerr);
+      return -1;
+    }
  
   if (board[cur_board].usb_method == 2)
     {
+      PROG_BANKS *banks = &prog_banks[cur_board];
       int start_flag = 0x01;
+
+      // Switch to the program bank that was written last
+      if (banks->pending_start >= 0)
+	{
+	  debug ("pb_start: starting at instruction %d\n", banks->pending_start);
+	  pb_write_register (board[cur_board].pb_base_address + REG_START_ADDRESS,
+			     banks->pending_start);
+	  banks->running_start = banks->pending_start;
+	  banks->next_bank = banks->running_start ? 0 : 1;
+	  banks->pending_start = -1;
+	}
+
       usb_write_address (board[cur_board].pb_base_address + 0x00);
       usb_write_data (&start_flag, 1);
+      start_time[cur_board] = my_gettime ();
       return 0;
     }
 
@@ -529,6 +722,7 @@ pb_start (void)
       return return_value;
     }
 
+  start_time[cur_board] = my_gettime ();
   return 0;
 }
 
@@ -591,6 +785,12 @@ pb_reset (void)
 {
    spinerr = noerr;
    debug("pb_reset():"); 
+
+   // The contents of the instruction memory and the registers can no longer
+   // be trusted
+   prog_invalidate (cur_board);
+   reg_shadow_invalidate (cur_board);
+
    if (board[cur_board].usb_method == 2)
    {
       /* Equivalent to pb_stop() for PBDDS-II Boards */
@@ -740,153 +940,81 @@ pb_inst_onerf (int freq, int phase, int rf_output_enable, int flags, int inst,
 
 SPINCORE_API int 
 pb_4C_inst(int flag, double length)
-{    
-    debug("Firmware ID: 0x%x\n", board[cur_board].firmware_id);  
-      
-    if(board[cur_board].firmware_id == 0x1105 || board[cur_board].firmware_id == 0x1106 || board[cur_board].firmware_id == 0x1107)
-    {
-        int temp = 0;
-        int return_value;
-        double pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
+{
+  const IMW_ENCODER *encoder = board[cur_board].encoder;
+  unsigned char imw[IMW_MAX_BYTES];
+  unsigned int delay;
+  double pb_clock;
+  __int64 cycles;
+  __int64 num_parts;
+  __int64 i;
+  int return_value;
 
-        unsigned int delay = (int) rint ((length * pb_clock) - 1.0);	//(Assumes clock in GHz and length in ns)
-        
-        if(delay > 0x3FFFFFFF || delay < 2)
-        {
-             spinerr = "Instruction delay will not work with your board";
-             debug ("pb_4C_inst: %s\n", spinerr);
-             return -91;
-        }
+  // Images hold ordinary instructions, which work on every board
+  if (encoder == NULL || encoder->serialize_4C == NULL || image_recording ())
+    return pb_inst_pbonly(flag, CONTINUE, 0, length);
 
-        //writing instruction to memory in this format:
-        //  |  31 | 30 | 29 .. 0 |
-        //  |Flag | Op-Code  | Delay   |
-        // write 8-bits at a time
-		temp = 0;
-        temp += (flag << 7); // put flag bit in most significant location of byte     
-        temp += ((0x3F000000 & delay) >> 24);       // put 3 MSBits of the delay in correct location of byte
-        return_value = pb_outp(port_base + 6, temp);
+  pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
+  cycles = (__int64) rint ((length * pb_clock) - 1.0) + 1;	//(Assumes clock in GHz and length in ns)
 
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 1)";
-	      debug ("pb_4C_inst: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
-	    
-        temp = 0;
-        temp = ((0x00FF0000 & delay) >> 16);
-        return_value = pb_outp(port_base + 6, temp);
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 2)";
-	      debug ("pb_4C_inst: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
-		
-	    temp = 0;
-        temp = ((0x0000FF00 & delay) >> 8);
-        return_value = pb_outp(port_base + 6, temp);
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 3)";
-	      debug ("pb_4C_inst: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
-		
-	    temp = 0;
-        temp = (0x000000FF & delay);
-        return_value = pb_outp(port_base + 6, temp);
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 4)";
-	      debug ("pb_4C_inst: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
-		
-		
+  // The 4C designs have no LONG_DELAY, so a length which does not fit into
+  // the delay field is split evenly over several instructions
+  num_parts = (cycles + PB4C_MAX_DELAY) / (PB4C_MAX_DELAY + 1);
+  if (num_parts < 1)
+    num_parts = 1;
+
+  for (i = 0; i < num_parts; i++)
+    {
+      delay = (unsigned int) (cycles / num_parts + (i < cycles % num_parts) - 1);
+
+      return_value = encoder->serialize_4C (flag, CONTINUE, delay, imw);
+      if (return_value < 0)
+	{
+	  debug ("pb_4C_inst: %s\n", spinerr);
+	  return return_value;
+	}
+
+      return_value = write_imw (imw, return_value, NULL);
+      if (return_value != 0 && (!(ISA_BOARD)))
+	{
+	  debug ("pb_4C_inst: %s\n", spinerr);
+	  return return_value;
+	}
     }
-    else
-        return pb_inst_pbonly(flag, CONTINUE, 0, length);  
 
-	return 0;
+  return 0;
 }
 
 SPINCORE_API int
 pb_4C_stop(void)
 {
-    if(board[cur_board].firmware_id == 0x1105 || board[cur_board].firmware_id == 0x1106 || board[cur_board].firmware_id == 0x1107)
-    {
-        int temp = 0;
-        int return_value;
-        double pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
+  const IMW_ENCODER *encoder = board[cur_board].encoder;
+  unsigned char imw[IMW_MAX_BYTES];
+  unsigned int delay;
+  double pb_clock;
+  int return_value;
 
-        unsigned int delay = (int) rint ((30.0*ns * pb_clock) - 1.0);	//(Assumes clock in GHz and length in ns)
-        if(delay > 0x3FFFFFFF || delay < 2)
-        {
-             spinerr = "Instruction delay will not work with your board";
-             debug ("pb_4C_inst: %s\n", spinerr);
-             return -91;
-        }
+  if (encoder == NULL || encoder->serialize_4C == NULL || image_recording ())
+    return pb_inst_pbonly(0, STOP, 0, 25 * ns);
 
-        //writing instruction to memory in this format:
-        //  |  31 | 30  | 29 .. 0 |
-        //  |Flag | Op-Code  | Delay   |
-        // write 8-bits at a time    
-		
-		temp = 0;
-        temp += (1 << 6);  // put opcode in correct location
-        temp += ((0x3F000000 & delay) >> 24);       // put MSBits of the delay in correct location of byte
-        return_value = pb_outp(port_base + 6, temp);
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 1)";
-	      debug ("pb_4C_stop: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
-	    
-        temp = 0;
-        temp = ((0x00FF0000 & delay) >> 16);
-        return_value = pb_outp(port_base + 6, temp);
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 2)";
-	      debug ("pb_4C_stop: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
-		
-	    temp = 0;
-        temp = ((0x0000FF00 & delay) >> 8);
-        return_value = pb_outp(port_base + 6, temp);
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 3)";
-	      debug ("pb_4C_stop: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
-	    temp = 0;
-        temp = (0x000000FF & delay);
-        return_value = pb_outp(port_base + 6, temp);
-        if (return_value != 0 && (!(ISA_BOARD)))
-	    {
-	      spinerr = "Communications error (loop 4)";
-	      debug ("pb_4C_stop: %s\n", spinerr);
-	      debug ("return value was: %d\n", return_value);
-	      return return_value;
-	    }
+  pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
+  delay = (int) rint ((30.0*ns * pb_clock) - 1.0);	//(Assumes clock in GHz and length in ns)
 
+  return_value = encoder->serialize_4C (0, STOP, delay, imw);
+  if (return_value < 0)
+    {
+      debug ("pb_4C_stop: %s\n", spinerr);
+      return return_value;
     }
-    else
-        return pb_inst_pbonly(0, STOP, 0, 25 * ns); 
 
-	return 0;
+  return_value = write_imw (imw, return_value, NULL);
+  if (return_value != 0 && (!(ISA_BOARD)))
+    {
+      debug ("pb_4C_stop: %s\n", spinerr);
+      return return_value;
+    }
+
+  return 0;
 }
 
 SPINCORE_API int
@@ -899,25 +1027,70 @@ pb_inst_pbonly (unsigned int flags, int inst, int inst_data, double length)
 SPINCORE_API int
 pb_inst_pbonly64 (__int64 flags, int inst, int inst_data, double length)
 {
-  unsigned int delay;
-  double pb_clock, clock_period;
+  spinerr = noerr;
+
+  if (image_recording ())
+    {
+      int fields[2] = { (int) (flags & 0xFFFFFFFF), (int) (flags >> 32) };
+      return image_record (IMAGE_PBONLY, fields, inst, inst_data, length);
+    }
+
+  debug ("pb_inst_pbonly: inst=%lld, inst_data=%d,length=%f, flags=0x%.8x\n", inst, inst_data,
+	 length, flags);
+
+  return pbonly_cycles (flags, inst, inst_data, length_cycles (length));
+}
 
+SPINCORE_API int
+pb_inst_pbonly_cycles (unsigned int flags, int inst, int inst_data,
+		       __int64 cycles)
+{
+  __int64 flags64 = flags;
+  return pb_inst_pbonly64_cycles (flags64, inst, inst_data, cycles);
+}
+
+SPINCORE_API int
+pb_inst_pbonly64_cycles (__int64 flags, int inst, int inst_data,
+			 __int64 cycles)
+{
   spinerr = noerr;
 
-  pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
-  clock_period = 1.0 / pb_clock;
+  if (image_recording ())
+    {
+      spinerr = "Lengths in clock cycles can not be recorded in a pulse program image";
+      debug ("pb_inst_pbonly64_cycles: %s\n", spinerr);
+      return -1;
+    }
 
-  delay = (unsigned int) rint ((length * pb_clock) - 3.0);	//(Assumes clock in GHz and length in ns)
+  debug ("pb_inst_pbonly64_cycles: inst=%d, inst_data=%d, cycles=%lld, flags=0x%.8llx\n",
+	 inst, inst_data, cycles, flags);
 
+  return pbonly_cycles (flags, inst, inst_data, cycles);
+}
 
-  debug ("pb_inst_pbonly: inst=%lld, inst_data=%d,length=%f, flags=0x%.8x\n", inst, inst_data,
-	 length, flags);
+/**
+ * \internal
+ * The part of pb_inst_pbonly64() and pb_inst_pbonly64_cycles() after the
+ * length has become a number of clock cycles.
+ */
+static int
+pbonly_cycles (__int64 flags, int inst, int inst_data, __int64 cycles)
+{
+  int flag_words[3];
+  int return_value;
 
-  if (delay < 2)
+  if (board[cur_board].encoder == NULL)
     {
-      spinerr = "Instruction delay is too small to work with your board";
+      spinerr = "Board has not been initialized";
       debug ("pb_inst_pbonly: %s\n", spinerr);
-      return -91;
+      return -1;
+    }
+
+  return_value = check_cycles (cycles);
+  if (return_value != 0)
+    {
+      debug ("pb_inst_pbonly: %s\n", spinerr);
+      return return_value;
     }
 
   if (inst == LOOP)
@@ -941,32 +1114,14 @@ pb_inst_pbonly64 (__int64 flags, int inst, int inst_data, double length)
       inst_data -= 2;
     }
 
-  //-------------------PB CORE counter issue--------------------------------------------------------------------------------------------------------------------------------------------------
-  //An extra clock cycle must be subtracted from all instructions that result in a value ending in 0xFF being sent to the core counter (with the exception of 0x0FF).
-  //Boards which have been fixed (and which have readable firmware IDs) do not require this and will bypass the following software fix.
-  //
-  //For boards which have been fixed but do not have firmware registers, there is no way for spinapi to know whether or not the fault has been corrected.
-  //Therefore, on all generic PulseBlaster boards and also on the older PBESR boards (boards using AMCC_DEVID and PBESR_PRO_DEVID) the 'FF' fix will
-  //be applied by default.  If you wish to bypass this fix, please use:
-  //      pb_bypass_FF_fix (1);     //bypass the fix below - no extra clock cycle will be subtracted ( board[cur_board].has_FF_fix will be set to 1 )
-  //      pb_bypass_FF_fix(0):    //turn on the software fix - ( board[cur_board].has_FF_fix will be set to 0 )
-  //
-  if (board[cur_board].has_FF_fix != 1)
-    {
-      if (((delay & 0xFF) == 0xFF) && (delay > 0xFF))
-	{
-	  delay--;
-	  debug ("pb_inst_pbonly: __ONE CLOCK CYCLE SUBTRACTED__\n", spinerr);
-	}
-    }
-  //_______________________________________________________________________________________________________________
-
-  //------------------------
-  // SP16 Designs 15-1, 15-2, and 15-3 have Flag0 and Flag1 reversed in Firmware
-  if( (board[cur_board].firmware_id > 0xF0) && (board[cur_board].firmware_id <= 0xF3) )
-      flags = (flags & 0xFFFFFFFC) + ((flags & 0x01) << 1) + ((flags & 0x02) >> 1);
+  // Put the flag bits where the firmware expects them. The PB Core "1FF"
+  // counter fix (see pb_bypass_FF_fix()) is applied by write_inst().
+  flag_words[0] = (int) (flags & 0xFFFFFFFF);
+  flag_words[1] = (int) (flags >> 32);
+  flag_words[2] = 0;
+  board[cur_board].encoder->pack_flags (flag_words);
 
-  return pb_inst_direct (((int*)&flags), inst, inst_data, delay);
+  return write_inst_cycles (flag_words, inst, inst_data, cycles, 1);
 }
 
 SPINCORE_API int
@@ -974,7 +1129,15 @@ pb_inst_dds2 (int freq0, int phase0, int amp0, int dds_en0, int phase_reset0,
 	      int freq1, int phase1, int amp1, int dds_en1, int phase_reset1,
 	      int flags, int inst, int inst_data, double length)
 {
-  if (board[cur_board].firmware_id != 0xe01 && board[cur_board].firmware_id != 0xe02 && board[cur_board].firmware_id != 0x0E03 && board[cur_board].firmware_id != 0x0C13)
+  if (image_recording ())
+    {
+      int fields[11] = { freq0, phase0, amp0, dds_en0, phase_reset0,
+	freq1, phase1, amp1, dds_en1, phase_reset1, flags
+      };
+      return image_record (IMAGE_DDS2, fields, inst, inst_data, length);
+    }
+
+  if (board[cur_board].encoder == NULL || board[cur_board].encoder->pack_dds2 == NULL)
     {
       debug
 	("pb_inst_dds2: Your current board does not support this function. Please check your manual.\n");
@@ -983,6 +1146,51 @@ pb_inst_dds2 (int freq0, int phase0, int amp0, int dds_en0, int phase_reset0,
     }
   spinerr = noerr;
 
+  debug ("pb_inst_dds2: inst=%d, inst_data=%d,length=%f\n", inst, inst_data,
+	 length);
+
+  return dds2_cycles (freq0, phase0, amp0, dds_en0, phase_reset0, freq1,
+		      phase1, amp1, dds_en1, phase_reset1, flags, inst,
+		      inst_data, length_cycles (length));
+}
+
+SPINCORE_API int
+pb_inst_dds2_cycles (int freq0, int phase0, int amp0, int dds_en0,
+		     int phase_reset0, int freq1, int phase1, int amp1,
+		     int dds_en1, int phase_reset1, int flags, int inst,
+		     int inst_data, __int64 cycles)
+{
+  spinerr = noerr;
+
+  if (image_recording ())
+    {
+      spinerr = "Lengths in clock cycles can not be recorded in a pulse program image";
+      debug ("pb_inst_dds2_cycles: %s\n", spinerr);
+      return -1;
+    }
+
+  if (board[cur_board].encoder == NULL || board[cur_board].encoder->pack_dds2 == NULL)
+    {
+      debug
+	("pb_inst_dds2_cycles: Your current board does not support this function. Please check your manual.\n");
+      return 0;
+    }
+
+  return dds2_cycles (freq0, phase0, amp0, dds_en0, phase_reset0, freq1,
+		      phase1, amp1, dds_en1, phase_reset1, flags, inst,
+		      inst_data, cycles);
+}
+
+/**
+ * \internal
+ * The part of pb_inst_dds2() and pb_inst_dds2_cycles() after the length has
+ * become a number of clock cycles.
+ */
+static int
+dds2_cycles (int freq0, int phase0, int amp0, int dds_en0, int phase_reset0,
+	     int freq1, int phase1, int amp1, int dds_en1, int phase_reset1,
+	     int flags, int inst, int inst_data, __int64 cycles)
+{
   if (freq0 >= board[cur_board].dds_nfreq[0] || freq0 < 0)
     {
       spinerr = "Frequency register select 0 out of range";
@@ -1026,28 +1234,19 @@ pb_inst_dds2 (int freq0, int phase0, int amp0, int dds_en0, int phase_reset0,
     }
 
   debug
-    ("pb_inst_dds2: using DDS 96 bit partitioning scheme(no shape support)\n",
-     inst, inst_data, length);
-
-  unsigned int delay;
-  double pb_clock, clock_period;
-
-  spinerr = noerr;
+    ("pb_inst_dds2: using DDS 96 bit partitioning scheme(no shape support)\n");
 
-  pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
-  clock_period = 1.0 / pb_clock;
-
-  delay = (unsigned int) rint ((length * pb_clock) - 3.0);	//(Assumes clock in GHz and length in ns)
+  int return_value;
 
-  debug ("pb_inst_dds2: inst=%d, inst_data=%d,length=%f\n", inst, inst_data,
-	 length);
+  debug ("pb_inst_dds2: inst=%d, inst_data=%d, cycles=%lld\n", inst, inst_data,
+	 cycles);
   debug ("pb_inst_dds2: freq0=0x%X, phase0=0x%X, amp0=0x%X, freq1=0x%X, phase1=0x%X, amp1=0x%X\n",freq0,phase0,amp0,freq1,phase1,amp1);
 
-  if (delay < 2)
+  return_value = check_cycles (cycles);
+  if (return_value != 0)
     {
-      spinerr = "Instruction delay is too small to work with your board";
       debug ("pb_inst_dds2: %s\n", spinerr);
-      return -91;
+      return return_value;
     }
 
   if (inst == LOOP)
@@ -1073,210 +1272,442 @@ pb_inst_dds2 (int freq0, int phase0, int amp0, int dds_en0, int phase_reset0,
     }
   int flag_word[3];
 
-  flag_word[0] = flag_word[1] = flag_word[2] = 0;
-  
-  if(board[cur_board].firmware_id == 0x0C13)
-  {
-	  flag_word[0] |= (flags & 0xF) << 0;        // 4 Flag Bits
-	  flag_word[0] |= (dds_en0 & 0x1) << 4;      // DDS Tx Enable
-	  flag_word[0] |= (phase_reset0 & 0x1) << 5; // Phase Reset
-	  flag_word[0] |= (freq0 & 0x3FF) << 6;      // 10 Frequency Select Bits (1024 Freq. Registers)
-	  flag_word[0] |= (phase0 & 0x7F) << 16;     // 7 Phase Select Bits (128 Phase Registers)
-	  flag_word[0] |= (amp0 & 0x1FF) << 23;      // lower 9 of 10 Amp. Select Bits
-	  
-	  flag_word[1] |= (amp0 & 0x200) >> 9;       // upper 1 of 10 Amp. Select Bits.
-  }
-  else if(board[cur_board].firmware_id == 0x0E03)
-  {
-    flag_word[0] |= (flags & 0xF) << 0;           // 4 Flag Bits
-    flag_word[0] |= (dds_en0 & 0x1) << 4;         // DDS1 Tx Enable
-    flag_word[0] |= (dds_en1 & 0x1) << 5;         // DDS2 Tx Enable
-    flag_word[0] |= (phase_reset0 & 0x1) << 6;    // DDS1 Phase Reset
-    flag_word[0] |= (phase_reset1 & 0x1) << 7;    // DDS2 Phase Reset
-    flag_word[0] |= (freq0 & 0x3FF) << 8;         // DDS1 Frequency Select Bits (1024 Freq. Registers)
-    flag_word[0] |= (freq1 & 0x3FF) << 18;        // DDS2 Frequency Select Bits (1024 Freq. Registers)
-    flag_word[0] |= (phase0 & 0xF) << 28;         // Lower 4 DDS1 Phase Select Bits (128 Phase Registers)
-
-    flag_word[1] |= (phase0 & 0x70) >> 4;         // Upper 3 DDS1 Phase Select Bits
-	flag_word[1] |= (phase1 & 0x7F) << 3;         // DDS2 Phase Select Bits (128 Phase Registers)
-    flag_word[1] |= (amp0 & 0x3FF) << 10;         // DDS1 Amplitude Select Bits (1024 Amp. Registers)
-    flag_word[1] |= (amp1 & 0x3FF) << 20;         // DDS2 Amplitude Select Bits (1024 Amp. Registers)
-  }
-  else
-  {
-    flag_word[0] |= (flags & 0xFFF) << 0;
-    flag_word[0] |= (dds_en0 & 0x1) << 12;
-    flag_word[0] |= (dds_en1 & 0x1) << 13;
-    flag_word[0] |= (phase_reset0 & 0x1) << 14;
-    flag_word[0] |= (phase_reset1 & 0x1) << 15;
-    flag_word[0] |= (freq0 & 0xF) << 16;
-    flag_word[0] |= (freq1 & 0xF) << 20;
-    flag_word[0] |= (phase0 & 0x7) << 24;
-    flag_word[0] |= (phase1 & 0x7) << 27;
-    flag_word[0] |= (amp0 & 0x3) << 30;
-
-    flag_word[1] |= (amp1 & 0x3) << 0;
-  }
+  board[cur_board].encoder->pack_dds2 (flag_word, flags,
+				       freq0, phase0, amp0, dds_en0, phase_reset0, 0,
+				       freq1, phase1, amp1, dds_en1, phase_reset1, 0);
 
-  return pb_inst_direct(flag_word, inst, inst_data, delay);
+  return write_inst_cycles (flag_word, inst, inst_data, cycles, 0);
 }
 
 SPINCORE_API int
 pb_inst_direct (int *pflags, int inst, int inst_data_direct, int length)
 {
-  int instruction[8];
-  int i;
-  int flags;
+  spinerr = noerr;
+
+  if (image_recording ())
+    {
+      spinerr = "IMWs can not be part of a pulse program image";
+      debug ("pb_inst_direct: %s\n", spinerr);
+      return -1;
+    }
+
+  if (board[cur_board].encoder == NULL)
+    {
+      spinerr = "Board has not been initialized";
+      debug ("pb_inst_direct: %s\n", spinerr);
+      return -1;
+    }
+
+  return write_inst (pflags, inst, inst_data_direct, length, 0, 0);
+}
+
+SPINCORE_API int
+pb_write_imws (const char *layout, double clock, int has_FF_fix,
+	       const void *imws, int num_insts)
+{
+  const IMW_ENCODER *encoder = board[cur_board].encoder;
+  double pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult * 1000.0;
   int return_value;
-  unsigned int temp_byte;
-  unsigned int BIT_MASK = 0xFF0000;
-  unsigned int OCW = 0;
-  unsigned int OPCODE = 0;
-  unsigned int DELAY = 0;
 
   spinerr = noerr;
 
-    if (board[cur_board].usb_method == 2) {
-		instruction[0] = length;
-        instruction[1] = (0xF & inst) | ((0xFFFFF & inst_data_direct) << 4) | ((0xFF & pflags[0]) <<24);
-        instruction[2] = ((0xFFFFFF & (pflags[0] >> 8)) << 0) | ((pflags[1] & 0xFF) << 24);
-        instruction[3] = ((0xFFFFFF & (pflags[1] >> 8)) << 0) | ((pflags[2] & 0xFF) << 24);
-		instruction[4] = 0;
-		instruction[5] = 0;
-		instruction[6] = 0;
-		instruction[7] = 0;
-
-        debug ("pb_inst_direct: Programming DDS2 IMW: 0x%X %X %X %X.\n", instruction[3], instruction[2], instruction[1], instruction[0]);
+  if (cur_device != PULSE_PROGRAM || encoder == NULL)
+    {
+      spinerr = "IMWs can only be written between pb_start_programming(PULSE_PROGRAM) and pb_stop_programming()";
+      debug ("pb_write_imws: %s\n", spinerr);
+      return -1;
+    }
 
-		if(board[cur_board].firmware_id == 0x0E03)
-           usb_write_data (instruction, 8);
-		else
-		   usb_write_data (instruction, 4);
+  if (strcmp (layout, encoder->name) != 0 || encoder->serialize_4C != NULL)
+    {
+      spinerr = "IMWs were encoded for another firmware layout";
+      debug ("pb_write_imws: %s (%s, board uses %s)\n", spinerr, layout, encoder->name);
+      return -1;
     }
-	else{
-	
-  // Make sure the different fields of the instruction are within 
-  // the proper range
-  if (board[cur_board].firmware_id == 0xa13 || board[cur_board].firmware_id == 0xC10)
-    {				//Need to replace this asap.
-		flags = pflags[0];
-      if (flags != (flags & 0x0FFFFFFFF))
-	{
-	  spinerr = "Flag word is limited to 32 bits";
-	  debug ("pb_inst_direct: %s\n", spinerr);
-	  return -1;
-	}
+
+  // The flag words RadioInst packs are those of pb_inst_radio() on a plain
+  // RadioProcessor. Boards with DDS shapes or a custom design lay them out
+  // differently, although they share the IMW layout.
+  if (board[cur_board].is_radioprocessor && !encoder->radio_via_dds2
+      && (board[cur_board].supports_dds_shape
+	  || board[cur_board].custom_design != 0))
+    {
+      spinerr = "IMWs encoded in advance are not supported by this RadioProcessor";
+      debug ("pb_write_imws: %s\n", spinerr);
+      return -1;
     }
-  else
+
+  if (fabs (clock - pb_clock) > 1e-9 * pb_clock
+      || (has_FF_fix != 0) != (board[cur_board].has_FF_fix == 1))
     {
-		flags = pflags[0];
-		  if (flags != (flags & 0x0FFFFFF))
-		{
-		  spinerr = "Flag word is limited to 24 bits";
-		  debug ("pb_inst_direct: %s\n", spinerr);
-		  return -1;
-		}
-		}
+      spinerr = "IMWs were encoded for another clock frequency or FF fix setting";
+      debug ("pb_write_imws: %s (%f MHz, FF fix %d)\n", spinerr, clock, has_FF_fix);
+      return -1;
+    }
 
-	  if (inst > 8)
-		{
-		  spinerr = "Invalid opcode";
-		  debug ("pb_inst_direct: %s\n", spinerr);
-		  return -1;
-		}
-	  if (inst_data_direct != (inst_data_direct & 0x0FFFFF))
-		{
-		  spinerr = "Instruction is limited to 20 bits";
-		  debug ("pb_inst_direct: %s\n", spinerr);
-		  return -1;
-		}
+  if (num_instructions != 0 || prog_banks[cur_board].base != 0)
+    {
+      spinerr = "IMWs encoded in advance must start the pulse program";
+      debug ("pb_write_imws: %s\n", spinerr);
+      return -1;
+    }
 
-	  OPCODE = (inst) | (inst_data_direct << 4);
-	  OCW = flags;
-	  DELAY = length;
+  return_value = write_imw (imws, num_insts * encoder->num_IMW_bytes, NULL);
+  if (return_value != 0)
+    {
+      debug ("pb_write_imws: %s\n", spinerr);
+      return return_value;
+    }
+  num_instructions += num_insts;
 
-	  debug ("pb_inst_direct: OPCODE=0x%x, flags=0x%.8x, delay=%d\n", OPCODE, OCW,
-		 DELAY);
-	  if (board[cur_board].firmware_id == 0xa13 || board[cur_board].firmware_id == 0xC10)
-		{				//Need to replace this asap.
-		  for (i = 0; i < 4; i++)
-		{
-		  temp_byte = 0xFF000000 & OCW;
-		  temp_byte >>= 24;
-		  return_value = pb_outp (port_base + 6, temp_byte);
-		  if (return_value != 0 && (!(ISA_BOARD)))
-			{
-			  spinerr = "Communications error (loop 1)";
-			  debug ("pb_inst_direct: %s\n", spinerr);
-			  debug ("return value was: %d\n", return_value);
-			  return return_value;
-			}
-		  OCW <<= 8;
-		}
-		}
-		else if (board[cur_board].firmware_id == 0x0908)
-		{				//Need to replace this asap.
-		  temp_byte = 0xFF & OCW;
-		  return_value = pb_outp (port_base + 6, temp_byte);
-		  if (return_value != 0 && (!(ISA_BOARD)))
-			{
-			  spinerr = "Communications error (loop 1)";
-			  debug ("pb_inst_direct: %s\n", spinerr);
-			  debug ("return value was: %d\n", return_value);
-			  return return_value;
-			}
-		}
-	  else
-		{
-		  for (i = 0; i < 3; i++)
-		{
-		  temp_byte = BIT_MASK & OCW;
-		  temp_byte >>= 16;
-		  return_value = pb_outp (port_base + 6, temp_byte);
-		  if (return_value != 0 && (!(ISA_BOARD)))
-			{
-			  spinerr = "Communications error (loop 1)";
-			  debug ("pb_inst_direct: %s\n", spinerr);
-			  debug ("return value was: %d\n", return_value);
-			  return return_value;
-			}
-		  OCW <<= 8;
-		}
-		}
-	  BIT_MASK = 0xFF0000;
-	  for (i = 0; i < 3; i++)
-		{
+  debug ("pb_write_imws: %d instructions\n", num_insts);
 
-		  temp_byte = BIT_MASK & OPCODE;
-		  temp_byte >>= 16;
-		  return_value = pb_outp (port_base + 6, temp_byte);
-		  if (return_value != 0 && (!(ISA_BOARD)))
-		{
-		  spinerr = "Communications error (loop 2)";
-		  debug ("pb_inst_direct: %s\n", spinerr);
-		  return return_value;
-		}
-		  OPCODE <<= 8;
-		}
-	  BIT_MASK = 0xFF000000;
-	  for (i = 0; i < 4; i++)
-		{
-		  temp_byte = BIT_MASK & DELAY;
-		  temp_byte >>= 24;
-		  return_value = pb_outp (port_base + 6, temp_byte);
-		  if (return_value != 0 && (!(ISA_BOARD)))
-		{
-		  spinerr = "Communications error (loop 3)";
-		  debug ("pb_inst_direct: %s\n", spinerr);
-		  return return_value;
-		}
-		  DELAY <<= 8;
+  return 0;
+}
+
+/**
+ * \internal
+ * Encode an instruction and send it towards the board. The instruction is
+ * remembered, so that pb_patch_delay() and pb_patch_flags() can change it later.
+ *
+ * \param from_pbonly Nonzero if pflags have been through the flag packing of
+ * pb_inst_pbonly64(). The "1FF" fix is then applied to the delay, and so it
+ * must be to any patched values.
+ * \param split Nonzero if this is one of the instructions write_inst_cycles()
+ * made up a long one from. It can then not be patched on its own.
+ * \return The address of the instruction on success. A negative number is
+ * returned on failure, and spinerr is set to a description of the error.
+ */
+static int
+write_inst (int *pflags, int inst, int inst_data, unsigned int delay,
+	    int from_pbonly, int split)
+{
+  int instruction[IMW_MAX_BYTES / sizeof (int)];
+  PROG_INST record;
+  int num_bytes;
+  int return_value;
+
+  debug ("write_inst: inst=%d, inst_data=%d, flags=0x%.8x, delay=%d\n",
+	 inst, inst_data, pflags[0], delay);
+
+  // Jump targets are given relative to the start of the program, or of the
+  // subroutine library with PB_LIBRARY()
+  if ((inst == BRANCH || inst == JSR) && (inst_data & PB_LIBRARY_BIT))
+    {
+      PROG_BANKS *banks = &prog_banks[cur_board];
+      int end = cur_device == PULSE_LIBRARY ? banks->library_size : banks->library_insts;
+
+      inst_data &= ~PB_LIBRARY_BIT;
+      if (inst_data < 0 || inst_data >= end)
+	{
+	  spinerr = end ? "Address is outside of the subroutine library"
+	    : "No subroutine library has been written";
+	  debug ("write_inst: %s\n", spinerr);
+	  return -1;
+	}
+      inst_data += library_base ();
     }
-  }
+  else if (inst == BRANCH || inst == JSR || inst == END_LOOP)
+    {
+      inst_data += prog_banks[cur_board].base;
+    }
+
+  record.raw_delay = delay;
+  if (from_pbonly)
+    {
+      delay = board[cur_board].fix_delay (delay);
+    }
+
+  num_bytes = board[cur_board].encoder->serialize (pflags, inst, inst_data,
+						   delay, (unsigned char *) instruction);
+  if (num_bytes < 0)
+    {
+      debug ("write_inst: %s\n", spinerr);
+      return num_bytes;
+    }
+
+  memcpy (record.flags, pflags, sizeof (record.flags));
+  record.inst = inst;
+  record.inst_data = inst_data;
+  record.delay = delay;
+  record.from_pbonly = from_pbonly;
+  record.split = split;
+
+  return_value = write_imw (instruction, num_bytes, &record);
+  if (return_value != 0 && (!(ISA_BOARD)))
+    {
+      debug ("write_inst: %s\n", spinerr);
+      return return_value;
+    }
+
   num_instructions += 1;
   return num_instructions - 1;
 }
 
+/**
+ * \internal
+ * Convert the length of an instruction (in ns) to the number of clock cycles
+ * it takes. This is the same for all pb_inst* functions, and for
+ * pb_length_to_cycles().
+ */
+static __int64
+length_cycles (double length)
+{
+  double pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
+
+  return (__int64) rint ((length * pb_clock) - 3.0) + 3;	//(Assumes clock in GHz and length in ns)
+}
+
+/**
+ * \internal
+ * Check that an instruction of the given number of clock cycles is long
+ * enough for the board.
+ *
+ * \return -91 if the length is too short for the board (and spinerr is set),
+ * 0 on success
+ */
+static int
+check_cycles (__int64 cycles)
+{
+  if (cycles < MIN_INST_CYCLES)
+    {
+      spinerr = "Instruction delay is too small to work with your board";
+      return -91;
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Convert the length of an instruction (in ns) to the number of clock cycles
+ * it takes, and check that it is long enough for the board.
+ *
+ * \return -91 if the length is too short for the board (and spinerr is set),
+ * 0 on success
+ */
+static int
+length_to_cycles (double length, __int64 * cycles)
+{
+  *cycles = length_cycles (length);
+
+  return check_cycles (*cycles);
+}
+
+SPINCORE_API int
+pb_length_to_cycles (int num, const double *length, __int64 * cycles,
+		     double *residual)
+{
+  double pb_clock = board[cur_board].clock * board[cur_board].pb_clock_mult;
+  int i;
+
+  spinerr = noerr;
+
+  if (pb_clock <= 0.0)
+    {
+      spinerr = "Board has not been initialized";
+      debug ("pb_length_to_cycles: %s\n", spinerr);
+      return -1;
+    }
+
+  // The same conversion as length_cycles(), with the clock looked up once
+  for (i = 0; i < num; i++)
+    {
+      cycles[i] = (__int64) rint ((length[i] * pb_clock) - 3.0) + 3;
+    }
+
+  if (residual != NULL)
+    {
+      for (i = 0; i < num; i++)
+	{
+	  residual[i] = length[i] - (double) cycles[i] / pb_clock;
+	}
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Convert the length of an instruction (in ns) to the value of its delay
+ * field, for a length that must fit into a single instruction.
+ *
+ * \return -91 if the delay does not work with the board (and spinerr is set),
+ * 0 on success
+ */
+static int
+length_to_delay (double length, unsigned int *delay)
+{
+  __int64 cycles;
+  int return_value;
+
+  return_value = length_to_cycles (length, &cycles);
+  if (return_value != 0)
+    {
+      return return_value;
+    }
+
+  if (cycles > MAX_INST_CYCLES)
+    {
+      spinerr = "Instruction delay is too long for a single instruction";
+      return -91;
+    }
+
+  *delay = (unsigned int) (cycles - 3);
+  return 0;
+}
+
+/**
+ * \internal
+ * Find how to make up a length which is too long for one instruction with a
+ * LONG_DELAY, which repeats an instruction of per clock cycles reps times,
+ * followed or preceded by one instruction of rest clock cycles.
+ *
+ * \param allow_single If nonzero, the LONG_DELAY is used on its own (and rest
+ * is set to 0) if the length can be divided evenly by one of the first
+ * MAX_SPLIT_CANDIDATES repeat counts that are large enough.
+ * \return -91 if the length is too long for the board (and spinerr is set),
+ * 0 on success
+ */
+static int
+split_cycles (__int64 cycles, int allow_single, int *reps, __int64 * per,
+	      __int64 * rest)
+{
+  __int64 n;
+  __int64 last;
+
+  if (allow_single)
+    {
+      n = (cycles + MAX_INST_CYCLES - 1) / MAX_INST_CYCLES;
+      if (n < 2)
+	n = 2;
+
+      last = n + MAX_SPLIT_CANDIDATES - 1;
+      if (last > MAX_LONG_DELAY_REPS)
+	last = MAX_LONG_DELAY_REPS;
+
+      for (; n <= last; n++)
+	{
+	  if (cycles % n == 0)
+	    {
+	      *reps = (int) n;
+	      *per = cycles / n;
+	      *rest = 0;
+	      return 0;
+	    }
+	}
+    }
+
+  // The repetitions take as much as possible, and the rest is at least as
+  // long as the shortest instruction
+  n = (cycles - MIN_INST_CYCLES + MAX_INST_CYCLES - 1) / MAX_INST_CYCLES;
+  if (n < 2)
+    n = 2;
+
+  if (n > MAX_LONG_DELAY_REPS)
+    {
+      spinerr = "Instruction delay is too long to work with your board";
+      return -91;
+    }
+
+  *reps = (int) n;
+  *per = (cycles - MIN_INST_CYCLES) / n;
+  *rest = cycles - n * *per;
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Write an instruction of any length. Lengths which do not fit into the delay
+ * field are made up with a LONG_DELAY of the same flags, exact to the clock
+ * cycle. If the instruction is a CONTINUE whose length can be divided evenly,
+ * the LONG_DELAY replaces it. Otherwise the LONG_DELAY comes after a CONTINUE,
+ * LOOP or WAIT, so that it is part of the loop body or follows the trigger,
+ * and before any other instruction, so that the time passes before the jump.
+ *
+ * \param inst_data Instruction data, as passed to the encoder
+ * \param cycles Length of the instruction in clock cycles
+ * \return The address of the first instruction written on success. A negative
+ * number is returned on failure, and spinerr is set to a description of the
+ * error.
+ */
+int
+write_inst_cycles (int *pflags, int inst, int inst_data, __int64 cycles,
+		   int from_pbonly)
+{
+  __int64 per;
+  __int64 rest;
+  int reps;
+  int first;
+  int return_value;
+
+  if (cycles <= MAX_INST_CYCLES)
+    {
+      return write_inst (pflags, inst, inst_data, (unsigned int) (cycles - 3),
+			 from_pbonly, 0);
+    }
+
+  // A LONG_DELAY which is too long is made up again from its total length
+  if (inst == LONG_DELAY)
+    {
+      if (cycles > MAX_INST_CYCLES * MAX_LONG_DELAY_REPS / (inst_data + 2))
+	{
+	  spinerr = "Instruction delay is too long to work with your board";
+	  return -91;
+	}
+      cycles *= inst_data + 2;
+      inst = CONTINUE;
+      inst_data = 0;
+    }
+
+  return_value = split_cycles (cycles, inst == CONTINUE, &reps, &per, &rest);
+  if (return_value != 0)
+    {
+      debug ("write_inst_cycles: %s\n", spinerr);
+      return return_value;
+    }
+
+  debug ("write_inst_cycles: %lld cycles made up of %d x %lld + %lld\n",
+	 cycles, reps, per, rest);
+
+  if (rest == 0)
+    {
+      return write_inst (pflags, LONG_DELAY, reps - 2,
+			 (unsigned int) (per - 3), from_pbonly, 1);
+    }
+
+  if (inst == CONTINUE || inst == LOOP || inst == WAIT)
+    {
+      first = write_inst (pflags, inst, inst_data, (unsigned int) (rest - 3),
+			  from_pbonly, 1);
+      if (first < 0)
+	{
+	  return first;
+	}
+      return_value = write_inst (pflags, LONG_DELAY, reps - 2,
+				 (unsigned int) (per - 3), from_pbonly, 1);
+    }
+  else
+    {
+      first = write_inst (pflags, LONG_DELAY, reps - 2,
+			  (unsigned int) (per - 3), from_pbonly, 1);
+      if (first < 0)
+	{
+	  return first;
+	}
+      return_value = write_inst (pflags, inst, inst_data,
+				 (unsigned int) (rest - 3), from_pbonly, 1);
+    }
+
+  if (return_value < 0)
+    {
+      return return_value;
+    }
+
+  return first;
+}
+
 SPINCORE_API int
 pb_set_freq (double freq)
 {
@@ -1486,6 +1917,105 @@ pb_read_status (void)
 	return status;
 }
  
+SPINCORE_API int
+pb_wait_idle (double timeout, double *latency)
+{
+  PROG_BANKS *banks = &prog_banks[cur_board];
+  double begin, now, last_busy, delay;
+  double backoff = WAIT_MIN_POLL;
+  double runtime = -1.0;
+  double end = 0.0;
+  int status;
+  int i;
+
+  spinerr = noerr;
+
+  begin = my_gettime ();
+  last_busy = begin;
+
+  // Predict when the program started by the last pb_start() ends. Programs
+  // which wait for triggers or run forever can not be predicted. The board
+  // may run a program of the catalog which was written before the last one.
+  if (banks->running_start == banks->loaded_base)
+    {
+      runtime = loaded_runtime ();
+    }
+  else
+    {
+      for (i = 0; i < CATALOG_MAX_ENTRIES; i++)
+	{
+	  if (catalog[cur_board][i].name[0] && catalog[cur_board][i].num_insts
+	      && catalog[cur_board][i].base == banks->running_start)
+	    runtime = catalog[cur_board][i].runtime;
+	}
+    }
+  if (runtime >= 0.0 && start_time[cur_board] > 0.0)
+    {
+      end = start_time[cur_board] + 1e-9 * runtime;
+    }
+  spinerr = noerr;
+
+  debug ("pb_wait_idle: program ends in %.6f s\n", end > 0.0 ? end - begin : -1.0);
+
+  for (;;)
+    {
+      status = pb_read_status ();
+      now = my_gettime ();
+
+      if (status < 0)
+	{
+	  debug ("pb_wait_idle: %s\n", spinerr);
+	  return status;
+	}
+
+      // Stopped after having been started, and neither running, waiting nor
+      // scanning. Right after a reset only bit 0 is set, until the start or
+      // trigger takes effect.
+      if ((status & 0x03) == 0x03 && !(status & 0x1C))
+	{
+	  break;
+	}
+      last_busy = now;
+
+      if (timeout >= 0.0 && now - begin >= 1e-3 * timeout)
+	{
+	  spinerr = "Timed out waiting for the pulse program to finish";
+	  debug ("pb_wait_idle: %s\n", spinerr);
+	  return -1;
+	}
+
+      // Sleep through most of the time left, so that the status is read more
+      // often as the end comes closer. After that, or without a prediction,
+      // read it at intervals which grow from WAIT_MIN_POLL to WAIT_MAX_POLL.
+      if (end - now > WAIT_MIN_POLL)
+	{
+	  delay = 0.9 * (end - now);
+	}
+      else
+	{
+	  delay = backoff;
+	  backoff = 2.0 * backoff < WAIT_MAX_POLL ? 2.0 * backoff : WAIT_MAX_POLL;
+	}
+      if (timeout >= 0.0 && now + delay > begin + 1e-3 * timeout)
+	{
+	  delay = begin + 1e-3 * timeout - now;
+	}
+
+      my_sleep (delay);
+    }
+
+  // The board stopped at some point after it was last seen busy, and not
+  // before the predicted end
+  if (latency)
+    {
+      *latency = 1e3 * (now - (end > last_busy ? end : last_busy));
+    }
+
+  debug ("pb_wait_idle: idle after %.6f s\n", now - begin);
+
+  return 0;
+}
+
 SPINCORE_API char
 *pb_status_message()
 {
@@ -1624,10 +2154,134 @@ pb_set_ISA_address (int address)
 /// API for backwards compatibility.
 ///
 
-SPINCORE_API int
-pb_outp (unsigned int address, char data)
-{
-  spinerr = noerr;
+/**
+ * \internal
+ * Write out the bytes outp_stream_write() has collected for the current
+ * board. This is done with the fastest method the board allows: a single
+ * string i/o write for boards connected directly to PCI, or one pass through
+ * the mailbox handshake for boards with an AMCC bridge chip.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+outp_stream_flush (void)
+{
+  OUTP_STREAM *st = &outp_stream[cur_board];
+  double start;
+  int ret = 0;
+  int i;
+
+  if (st->len == 0)
+    {
+      return 0;
+    }
+
+  start = my_gettime ();
+
+  if (board[cur_board].use_amcc == 1)
+    {
+      ret = do_amcc_outp_block (cur_board, st->address, st->data, st->len);
+    }
+  else if (board[cur_board].use_amcc == 2)
+    {
+      for (i = 0; i < st->len && ret == 0; i++)
+	{
+	  ret = do_amcc_outp_old (cur_board, st->address, st->data[i]);
+	}
+    }
+  else
+    {
+#ifdef WINDOWS
+      // The precompiled Windows driver only writes single bytes
+      for (i = 0; i < st->len && ret == 0; i++)
+	{
+	  ret = os_outp (cur_board, st->address, st->data[i]);
+	}
+#else
+      ret = os_outp_block (cur_board, st->address, st->data, st->len);
+#endif
+    }
+
+  st->seconds += my_gettime () - start;
+  st->bytes += st->len;
+
+  debug ("outp_stream_flush: wrote %d bytes to 0x%x (%.0f bytes/s)\n",
+	 st->len, st->address,
+	 st->seconds > 0.0 ? st->bytes / st->seconds : 0.0);
+
+  st->len = 0;
+
+  return ret;
+}
+
+/**
+ * \internal
+ * Write a block of bytes to the PulseBlaster core data port (port_base + 6).
+ * This is the same as calling pb_outp() once for each byte. Everything has
+ * been written when this returns, so that a failed transfer is reported by
+ * the call which asked for it.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+outp_stream_write (const char *data, int len)
+{
+  OUTP_STREAM *st = &outp_stream[cur_board];
+  int ret;
+  int n;
+
+  if (board[cur_board].is_usb)
+    {
+      return usb_do_outp_block (port_base + 6, data, len);
+    }
+
+  st->address = port_base + 6;
+
+  while (len > 0)
+    {
+      n = OUTP_STREAM_SIZE - st->len;
+      if (n > len)
+	{
+	  n = len;
+	}
+
+      memcpy (st->data + st->len, data, n);
+      st->len += n;
+      data += n;
+      len -= n;
+
+      if (st->len == OUTP_STREAM_SIZE)
+	{
+	  ret = outp_stream_flush ();
+	  if (ret != 0)
+	    {
+	      return ret;
+	    }
+	}
+    }
+
+  return outp_stream_flush ();
+}
+
+SPINCORE_API double
+pb_get_outp_rate (void)
+{
+  spinerr = noerr;
+
+  if (outp_stream[cur_board].seconds <= 0.0)
+    {
+      return 0.0;
+    }
+
+  return outp_stream[cur_board].bytes / outp_stream[cur_board].seconds;
+}
+
+SPINCORE_API int
+pb_outp (unsigned int address, char data)
+{
+  spinerr = noerr;
 
   // If this is a USB device...
   if (board[cur_board].is_usb) {
@@ -1650,119 +2304,1730 @@ pb_outp (unsigned int address, char data)
     }
 }
 
-SPINCORE_API char
-pb_inp (unsigned int address)
+SPINCORE_API char
+pb_inp (unsigned int address)
+{
+  spinerr = noerr;
+
+  if (board[cur_board].is_usb)
+    {
+      debug ("pb_inp: no support for usb devices\n");
+      return -1;
+    }
+
+  if (board[cur_board].use_amcc)
+    {
+      if (board[cur_board].use_amcc == 2)
+	{
+	  spinerr = "Input from board not supported with this board revision";
+	  debug ("pb_inp: %s\n", spinerr);
+	  return -1;
+	}
+      return do_amcc_inp (cur_board, address);
+    }
+  else
+    {
+      return os_inp (cur_board, address);
+    }
+}
+
+SPINCORE_API int
+pb_outw (unsigned int address, unsigned int data)
+{
+  spinerr = noerr;
+
+  if (board[cur_board].is_usb)
+    {
+      debug ("pb_outw: no support for usb devices\n");
+      return -1;
+    }
+
+  // amcc chip does not use 32 bit I/O, so this must be our custom PCI core
+  return os_outw (cur_board, address, data);
+}
+
+SPINCORE_API unsigned int
+pb_inw (unsigned int address)
+{
+  spinerr = noerr;
+
+  if (board[cur_board].is_usb)
+    {
+      debug ("pb_inw: no support for usb devices\n");
+      return -1;
+    }
+
+  // amcc chip does not use 32 bit I/O, so this must be our custom PCI core
+  return os_inw (cur_board, address);
+}
+
+SPINCORE_API void
+pb_sleep_ms (int milliseconds)
+{
+#ifdef WINDOWS
+  Sleep (milliseconds);		// on windows, sleep() function takes values in ms.
+#else
+#include <unistd.h>
+  usleep (milliseconds * 1000);	// this linux function takes time in us
+#endif
+}
+
+
+
+
+int
+do_os_init (int board)
+{
+  int dev_id;
+
+  debug ("do_os_init: board # %d\n", board);
+  debug ("do_os_init: num_pci_boards: %d\n", num_pci_boards);
+  debug ("do_os_init: num_usb_devices: %d\n", num_usb_devices);
+
+
+  if (board < num_pci_boards)
+    {
+      debug ("do_os_init: initializing pci\n");
+      dev_id = os_init (board);
+    }
+  else
+    {
+      debug ("do_os_init: initializing usb\n");
+      dev_id = os_usb_init (board - num_pci_boards);
+      usb_reset_gpif (board - num_pci_boards);
+    }
+
+  return dev_id;
+}
+
+int
+do_os_close (int board)
+{
+  int ret = -1;
+
+  if (board < num_pci_boards)
+    {
+      debug ("do_os_close: closing pci\n");
+      ret = os_close (board);
+    }
+  else
+    {
+      debug ("do_os_close: closing usb\n");
+      ret = os_usb_close ();
+    }
+
+  return ret;
+}
+
+/**
+ * \internal
+ * Send one encoded instruction towards the board. While a pulse program is
+ * being programmed (and always on boards using usb_method 2) the instruction
+ * is buffered on the host, and the whole program is written at once by
+ * flush_pulse_program(). Otherwise it goes straight to the core data port.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+write_imw (const void *imw, int num_bytes, const PROG_INST * inst)
+{
+  if (board[cur_board].usb_method == 2 || cur_device == PULSE_PROGRAM)
+    {
+      return prog_append (cur_board, imw, num_bytes, inst);
+    }
+
+  return outp_stream_write ((const char *) imw, num_bytes);
+}
+
+/**
+ * \internal
+ * Complete the pulse program being programmed: optimize it if requested with
+ * pb_set_optimization(), check that it fits where it goes, and write it to the
+ * board.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+finish_pulse_program (void)
+{
+  int return_value;
+
+  if ((cur_device != PULSE_PROGRAM && cur_device != PULSE_LIBRARY)
+      || prog_pending (cur_board) == 0)
+    {
+      return 0;
+    }
+
+  // The library is never optimized: pulse programs jump to the addresses
+  // its pb_inst* calls returned, and the address map belongs to the pulse
+  // program on the board
+  if (cur_device == PULSE_PROGRAM)
+    {
+      if (optimization[cur_board] != OPTIMIZE_NONE)
+	{
+	  return_value = optimize_program (cur_board, &board[cur_board],
+					   prog_banks[cur_board].base,
+					   optimization[cur_board],
+					   &num_instructions);
+	  if (return_value != 0)
+	    {
+	      prog_reset (cur_board);
+	      return return_value;
+	    }
+	}
+      else
+	{
+	  optimize_forget (cur_board, num_instructions);
+	}
+    }
+
+  if (cur_device == PULSE_LIBRARY)
+    {
+      if (num_instructions > prog_banks[cur_board].library_size)
+	{
+	  spinerr = "Subroutine library does not fit in its instruction memory";
+	  prog_reset (cur_board);
+	  return -1;
+	}
+    }
+  else if (prog_banks[cur_board].catalog_entry >= 0)
+    {
+      if (num_instructions > catalog[cur_board][prog_banks[cur_board].catalog_entry].size)
+	{
+	  spinerr = "Pulse program does not fit in its program catalog entry";
+	  prog_reset (cur_board);
+	  return -1;
+	}
+    }
+  else if (prog_banks[cur_board].enabled && num_instructions > prog_banks[cur_board].bank_size)
+    {
+      spinerr = "Pulse program does not fit in one program bank";
+      prog_reset (cur_board);
+      return -1;
+    }
+  else if (prog_banks[cur_board].library_size > 0
+	   && prog_banks[cur_board].base + num_instructions > library_base ())
+    {
+      spinerr = "Pulse program overlaps the subroutine library";
+      prog_reset (cur_board);
+      return -1;
+    }
+  else if (prog_banks[cur_board].base + num_instructions > catalog_bottom ())
+    {
+      spinerr = "Pulse program overlaps the program catalog";
+      prog_reset (cur_board);
+      return -1;
+    }
+
+  return_value = flush_pulse_program (current_upload_mode ());
+  if (return_value == 0 && cur_device == PULSE_PROGRAM
+      && prog_banks[cur_board].catalog_entry >= 0)
+    {
+      catalog[cur_board][prog_banks[cur_board].catalog_entry].num_insts = num_instructions;
+    }
+  else if (return_value == 0 && cur_device == PULSE_PROGRAM)
+    {
+      prog_banks[cur_board].resident_end = prog_banks[cur_board].base + num_instructions;
+    }
+
+  return return_value;
+}
+
+/**
+ * \internal
+ * Write the buffered instructions of a pulse program to the board. If the
+ * board already holds exactly this program (because nothing has changed since
+ * it was last written, and pb_invalidate_program() has not been called), the
+ * transfer is skipped.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+flush_pulse_program (int mode)
+{
+  int imw_bytes;
+  int num_bytes;
+  int return_value;
+
+  if ((cur_device != PULSE_PROGRAM && cur_device != PULSE_LIBRARY)
+      || prog_pending (cur_board) == 0)
+    {
+      return 0;
+    }
+
+  if (mode != UPLOAD_FULL && prog_is_loaded (cur_board))
+    {
+      debug ("flush_pulse_program: program unchanged, not sending %d bytes\n",
+	     prog_pending (cur_board));
+      prog_reset (cur_board);
+      return 0;
+    }
+
+  imw_bytes = board[cur_board].encoder->num_IMW_bytes;
+
+  if (board[cur_board].usb_method == 2)
+    {
+      unsigned int address = PB_USB_PROG_ADDRESS + prog_banks[cur_board].base;
+
+      if (mode == UPLOAD_DIFF)
+	return_value = prog_upload_usb_diff (cur_board, address, imw_bytes);
+      else
+	return_value = prog_upload_usb (cur_board, address);
+    }
+  else
+    {
+      // The memory counter can only be reset to the first instruction, so
+      // the best we can do is stop after the last changed one
+      if (mode == UPLOAD_DIFF)
+	num_bytes = prog_dirty_length (cur_board, imw_bytes);
+      else
+	num_bytes = prog_pending (cur_board);
+
+      debug ("flush_pulse_program: writing %d of %d bytes\n", num_bytes,
+	     prog_pending (cur_board));
+
+      return_value = outp_stream_write (prog_data (cur_board), num_bytes);
+    }
+
+  // The library is apart from the pulse programs, so what is known about
+  // the program on the board stays valid
+  if (cur_device == PULSE_LIBRARY)
+    {
+      prog_banks[cur_board].library_insts = return_value == 0 ? num_instructions : 0;
+    }
+  else if (return_value == 0)
+    {
+      prog_set_loaded (cur_board);
+      prog_banks[cur_board].loaded_base = prog_banks[cur_board].base;
+      catalog_loaded ();
+    }
+  else
+    {
+      prog_invalidate (cur_board);
+    }
+
+  prog_reset (cur_board);
+
+  return return_value;
+}
+
+/**
+ * \internal
+ * Prepare the PulseBlaster core of a board which is not using usb_method 2 to
+ * receive pulse program instructions, starting with the first one.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+pci_start_pulse_program (void)
+{
+  int return_value;
+
+  // This is an instruction, therefore Bytes Per Word (BPW) is the size of the IMW
+  return_value = pb_outp (port_base + 2, board[cur_board].encoder->num_IMW_bytes);
+  if (return_value != 0 && (!(ISA_BOARD)))
+    {
+      spinerr = my_strcat ("BPW write failed", spinerr);
+      return return_value;
+    }
+
+  return_value = pb_outp (port_base + 3, PULSE_PROGRAM);	// Device = RAM
+  if (return_value != 0 && (!(ISA_BOARD)))
+    {
+      spinerr = my_strcat ("Device=RAM write failed", spinerr);
+      return return_value;
+    }
+
+  return_value = pb_outp (port_base + 4, 0);	// Reset mem counter
+  if (return_value != 0 && (!(ISA_BOARD)))
+    {
+      spinerr =
+	my_strcat ("mem counter write failed (PULSE_PROGRAM)", spinerr);
+      return return_value;
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Change the delay and/or flags of instructions in the program buffer, which
+ * must have been filled by prog_restore(). Nothing is sent to the board.
+ *
+ * \param length New lengths of the instructions, or NULL to keep them
+ * \param flags New flags of the instructions, or NULL to keep them
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+patch_encode (int num, const int *addr, const double *length,
+	      const __int64 * flags)
+{
+  const IMW_ENCODER *encoder = board[cur_board].encoder;
+  int instruction[IMW_MAX_BYTES / sizeof (int)];
+  PROG_INST *record;
+  unsigned int delay;
+  int return_value;
+  int index;
+  int merged;
+  int i;
+
+  for (i = 0; i < num; i++)
+    {
+      // Addresses are the ones returned by the pb_inst* functions, even if
+      // the program was optimized
+      index = optimize_lookup (cur_board, addr[i], &merged);
+      record = prog_get_inst (cur_board, index);
+      if (record == NULL)
+	{
+	  spinerr = "Instruction address out of range";
+	  prog_reset (cur_board);
+	  return -1;
+	}
+      if (merged)
+	{
+	  spinerr = "Instruction was merged with others by the optimizer";
+	  prog_reset (cur_board);
+	  return -1;
+	}
+      // Its length is shared with the LONG_DELAY it was split up with
+      if (record->split)
+	{
+	  spinerr = "Instruction was split up because it is too long for one";
+	  prog_reset (cur_board);
+	  return -1;
+	}
+
+      if (length)
+	{
+	  return_value = length_to_delay (length[i], &delay);
+	  if (return_value != 0)
+	    {
+	      prog_reset (cur_board);
+	      return return_value;
+	    }
+
+	  record->raw_delay = delay;
+	  record->delay = record->from_pbonly ? board[cur_board].fix_delay (delay) : delay;
+	}
+
+      if (flags)
+	{
+	  record->flags[0] = (int) (flags[i] & 0xFFFFFFFF);
+	  record->flags[1] = (int) (flags[i] >> 32);
+	  record->flags[2] = 0;
+
+	  if (record->from_pbonly)
+	    encoder->pack_flags (record->flags);
+	}
+
+      return_value = encoder->serialize (record->flags, record->inst,
+					 record->inst_data, record->delay,
+					 (unsigned char *) instruction);
+      if (return_value < 0)
+	{
+	  prog_reset (cur_board);
+	  return return_value;
+	}
+
+      prog_replace (cur_board, record, instruction);
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Write the instructions of the program buffer which were changed by
+ * patch_encode() to the board.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+patch_send (void)
+{
+  int return_value;
+
+  // Only the changed instructions are written, exactly as with UPLOAD_DIFF
+  cur_device = PULSE_PROGRAM;
+  prog_banks[cur_board].base = prog_banks[cur_board].loaded_base;
+
+  if (board[cur_board].usb_method == 2)
+    {
+      return_value = flush_pulse_program (UPLOAD_DIFF);
+    }
+  else
+    {
+      return_value = pb_outp (port_base + 0, 0);	// Reset PulseBlasterDDS
+      if (return_value == 0 || ISA_BOARD)
+	return_value = pci_start_pulse_program ();
+      if (return_value == 0 || ISA_BOARD)
+	return_value = flush_pulse_program (UPLOAD_DIFF);
+      if (return_value == 0 || ISA_BOARD)
+	return_value = pb_outp (port_base + 7, 0);
+    }
+
+  cur_device = -1;
+
+  if (return_value != 0 && (!(ISA_BOARD)))
+    {
+      prog_invalidate (cur_board);
+      prog_reset (cur_board);
+      return return_value;
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Change the delay and/or flags of instructions in the program that was last
+ * written to the board, and write the changed instructions.
+ *
+ * \param length New lengths of the instructions, or NULL to keep them
+ * \param flags New flags of the instructions, or NULL to keep them
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+patch_instructions (int num, const int *addr, const double *length,
+		    const __int64 * flags)
+{
+  int return_value;
+
+  if (board[cur_board].encoder == NULL)
+    {
+      spinerr = "Board has not been initialized";
+      return -1;
+    }
+
+  if (cur_device != -1)
+    {
+      spinerr = "Can not patch instructions while programming the board";
+      return -1;
+    }
+
+  if (prog_restore (cur_board) != 0)
+    {
+      return -1;
+    }
+
+  // Encode everything on the host first, so that nothing is sent if any of
+  // the instructions can not be patched
+  return_value = patch_encode (num, addr, length, flags);
+  if (return_value != 0)
+    {
+      return return_value;
+    }
+
+  return patch_send ();
+}
+
+SPINCORE_API int
+pb_patch_delay (int addr, double length)
+{
+  int return_value;
+
+  spinerr = noerr;
+
+  debug ("pb_patch_delay: addr=%d, length=%f\n", addr, length);
+
+  return_value = patch_instructions (1, &addr, &length, NULL);
+  if (return_value != 0)
+    {
+      debug ("pb_patch_delay: %s\n", spinerr);
+    }
+
+  return return_value;
+}
+
+SPINCORE_API int
+pb_patch_flags (int addr, __int64 flags)
+{
+  int return_value;
+
+  spinerr = noerr;
+
+  debug ("pb_patch_flags: addr=%d, flags=0x%llx\n", addr, flags);
+
+  return_value = patch_instructions (1, &addr, NULL, &flags);
+  if (return_value != 0)
+    {
+      debug ("pb_patch_flags: %s\n", spinerr);
+    }
+
+  return return_value;
+}
+
+SPINCORE_API int
+pb_patch_instructions (int num, int *addr, double *length, __int64 * flags)
+{
+  int return_value;
+
+  spinerr = noerr;
+
+  debug ("pb_patch_instructions: num=%d\n", num);
+
+  if (num < 0 || addr == NULL)
+    {
+      spinerr = "Invalid instruction list";
+      debug ("pb_patch_instructions: %s\n", spinerr);
+      return -1;
+    }
+
+  return_value = patch_instructions (num, addr, length, flags);
+  if (return_value != 0)
+    {
+      debug ("pb_patch_instructions: %s\n", spinerr);
+    }
+
+  return return_value;
+}
+
+/**
+ * \internal
+ * \return Nonzero if device is one of the register banks pb_run_sweep() can
+ * change.
+ */
+static int
+sweep_is_register_bank (int device)
+{
+  return device == FREQ_REGS || device == TX_PHASE_REGS
+    || device == RX_PHASE_REGS || device == COS_PHASE_REGS
+    || device == SIN_PHASE_REGS;
+}
+
+/**
+ * \internal
+ * Sort the columns of a parameter table by device and target, so that each
+ * register bank can be written from register 0 on, and check that the
+ * columns of each bank cover its first registers without gaps.
+ *
+ * \param order Set to the column numbers, in order
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+sweep_sort (int num_params, const PB_SWEEP_PARAM * params, int *order)
+{
+  const PB_SWEEP_PARAM *a, *b;
+  int i, j, tmp;
+
+  for (i = 0; i < num_params; i++)
+    {
+      if (params[i].device != PULSE_PROGRAM
+	  && !sweep_is_register_bank (params[i].device))
+	{
+	  spinerr = "Invalid sweep parameter device";
+	  return -1;
+	}
+      order[i] = i;
+    }
+
+  for (i = 1; i < num_params; i++)
+    {
+      for (j = i; j > 0; j--)
+	{
+	  a = &params[order[j - 1]];
+	  b = &params[order[j]];
+	  if (a->device < b->device
+	      || (a->device == b->device && a->target <= b->target))
+	    break;
+
+	  tmp = order[j];
+	  order[j] = order[j - 1];
+	  order[j - 1] = tmp;
+	}
+    }
+
+  for (i = 0; i < num_params; i++)
+    {
+      b = &params[order[i]];
+      if (!sweep_is_register_bank (b->device))
+	continue;
+
+      a = i > 0 ? &params[order[i - 1]] : NULL;
+      if (b->target != (a && a->device == b->device ? a->target + 1 : 0))
+	{
+	  spinerr = "Sweep registers must be numbered from 0, without gaps";
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+/**
+ * \internal
+ * Encode the instruction lengths of one point of a sweep into the program
+ * buffer. Only the lengths which differ from the previous point are changed,
+ * and nothing is sent to the board.
+ *
+ * \param row Values of the point
+ * \param prev Values of the previous point, or NULL to change all lengths
+ * \param addr,length Space for num_params addresses and lengths
+ * \return The number of instructions changed. A negative number is returned
+ * on failure, and spinerr is set to a description of the error.
+ */
+static int
+sweep_encode (int num_params, const PB_SWEEP_PARAM * params,
+	      const double *row, const double *prev, int *addr,
+	      double *length)
+{
+  int return_value;
+  int num = 0;
+  int i;
+
+  for (i = 0; i < num_params; i++)
+    {
+      if (params[i].device == PULSE_PROGRAM && (!prev || row[i] != prev[i]))
+	{
+	  addr[num] = params[i].target;
+	  length[num] = row[i];
+	  num++;
+	}
+    }
+
+  if (num == 0)
+    {
+      return 0;
+    }
+
+  if (prog_restore (cur_board) != 0)
+    {
+      return -1;
+    }
+
+  return_value = patch_encode (num, addr, length, NULL);
+  if (return_value != 0)
+    {
+      return return_value;
+    }
+
+  return num;
+}
+
+/**
+ * \internal
+ * Write the register banks of one point of a sweep which differ from the
+ * previous point.
+ *
+ * \param order Column numbers, sorted by sweep_sort()
+ * \param row Values of the point
+ * \param prev Values of the previous point, or NULL to write all banks
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+sweep_registers (int num_params, const PB_SWEEP_PARAM * params,
+		 const int *order, const double *row, const double *prev)
+{
+  int return_value;
+  int device;
+  int changed;
+  int first, last;
+  int i;
+
+  for (first = 0; first < num_params; first = last)
+    {
+      device = params[order[first]].device;
+      changed = !prev;
+      for (last = first; last < num_params
+	   && params[order[last]].device == device; last++)
+	{
+	  if (prev && row[order[last]] != prev[order[last]])
+	    changed = 1;
+	}
+
+      if (!sweep_is_register_bank (device) || !changed)
+	continue;
+
+      return_value = pb_start_programming (device);
+      for (i = first; i < last && return_value == 0; i++)
+	{
+	  if (device == FREQ_REGS)
+	    return_value = pb_set_freq (row[order[i]]);
+	  else
+	    return_value = pb_set_phase (row[order[i]]);
+	}
+      if (return_value == 0)
+	return_value = pb_stop_programming ();
+      else
+	cur_device = -1;
+
+      if (return_value != 0)
+	{
+	  return return_value;
+	}
+    }
+
+  return 0;
+}
+
+SPINCORE_API int
+pb_run_sweep (int num_params, const PB_SWEEP_PARAM * params, int num_points,
+	      const double *values, int num_fid_points, int *real_data,
+	      int *imag_data, double *overhead)
+{
+  const double *row, *prev;
+  char *next_error = NULL;
+  double begin, started, finished, latency;
+  double *length = NULL;
+  int *order = NULL;
+  int *addr = NULL;
+  int return_value;
+  int num_changed;
+  int next_changed = 0;
+  int i;
+
+  spinerr = noerr;
+
+  debug ("pb_run_sweep: num_params=%d, num_points=%d, num_fid_points=%d\n",
+	 num_params, num_points, num_fid_points);
+
+  if (num_params < 0 || num_points < 1 || (num_params > 0 && (!params || !values))
+      || (!real_data != !imag_data) || (real_data && num_fid_points < 1))
+    {
+      spinerr = "Invalid sweep";
+      debug ("pb_run_sweep: %s\n", spinerr);
+      return -1;
+    }
+
+  if (cur_device != -1)
+    {
+      spinerr = "Can not run a sweep while programming the board";
+      debug ("pb_run_sweep: %s\n", spinerr);
+      return -1;
+    }
+
+  if (num_params > 0)
+    {
+      order = (int *) malloc (num_params * sizeof (int));
+      addr = (int *) malloc (num_params * sizeof (int));
+      length = (double *) malloc (num_params * sizeof (double));
+      if (!order || !addr || !length)
+	{
+	  spinerr = "Internal error: can't allocate sweep tables";
+	  return_value = -1;
+	  goto done;
+	}
+    }
+
+  return_value = sweep_sort (num_params, params, order);
+  if (return_value != 0)
+    {
+      goto done;
+    }
+
+  num_changed = sweep_encode (num_params, params, values, NULL, addr, length);
+  if (num_changed < 0)
+    {
+      return_value = num_changed;
+      goto done;
+    }
+
+  for (i = 0; i < num_points; i++)
+    {
+      row = values ? values + i * num_params : NULL;
+      prev = i > 0 ? row - num_params : NULL;
+
+      begin = my_gettime ();
+
+      if (num_changed > 0)
+	{
+	  return_value = patch_send ();
+	  if (return_value != 0)
+	    goto done;
+	}
+
+      return_value = sweep_registers (num_params, params, order, row, prev);
+      if (return_value != 0)
+	goto done;
+
+      // Every point runs from the start of the program, and its data is made
+      // up of its own scans only
+      return_value = pb_stop ();
+      if (return_value != 0)
+	goto done;
+
+      if (board[cur_board].supports_scan_count)
+	{
+	  return_value = pb_scan_count (1);
+	  if (return_value != 0)
+	    goto done;
+	}
+
+      return_value = pb_start ();
+      if (return_value != 0)
+	goto done;
+
+      started = my_gettime ();
+
+      // The next point is made ready while the board runs this one
+      if (i + 1 < num_points)
+	{
+	  next_changed = sweep_encode (num_params, params, row + num_params,
+				       row, addr, length);
+	  if (next_changed < 0)
+	    next_error = spinerr;
+	}
+
+      return_value = pb_wait_idle (-1.0, &latency);
+      if (return_value != 0)
+	goto done;
+
+      finished = my_gettime ();
+
+      if (real_data)
+	{
+	  return_value = pb_get_data (num_fid_points,
+				      real_data + i * num_fid_points,
+				      imag_data + i * num_fid_points);
+	  if (return_value != 0)
+	    goto done;
+	}
+
+      if (overhead)
+	{
+	  overhead[i] = 1e3 * ((started - begin) + (my_gettime () - finished))
+	    + latency;
+	}
+
+      if (next_error)
+	{
+	  spinerr = next_error;
+	  return_value = -1;
+	  goto done;
+	}
+
+      num_changed = next_changed;
+    }
+
+done:
+  if (return_value != 0)
+    {
+      debug ("pb_run_sweep: %s\n", spinerr);
+    }
+
+  free (order);
+  free (addr);
+  free (length);
+
+  return return_value;
+}
+
+/**
+ * \internal
+ * \return The upload mode to use for the pulse program being programmed.
+ * With double buffering the program goes to a bank which holds an older
+ * program than the one last written, so it is always written in full, as is
+ * the subroutine library and any program which does not go where the last one
+ * went.
+ */
+static int
+current_upload_mode (void)
+{
+  if (prog_banks[cur_board].enabled || cur_device == PULSE_LIBRARY
+      || prog_banks[cur_board].base != prog_banks[cur_board].loaded_base)
+    {
+      return UPLOAD_FULL;
+    }
+
+  return upload_mode[cur_board];
+}
+
+SPINCORE_API int
+pb_set_double_buffer (int enable)
+{
+  PROG_BANKS *banks = &prog_banks[cur_board];
+
+  spinerr = noerr;
+
+  debug ("pb_set_double_buffer: enable=%d\n", enable);
+
+  if (board[cur_board].usb_method != 2)
+    {
+      spinerr = "Double buffering is not supported by your board";
+      debug ("pb_set_double_buffer: %s\n", spinerr);
+      return -1;
+    }
+
+  if (cur_device != -1)
+    {
+      spinerr = "Can not change double buffering while programming the board";
+      debug ("pb_set_double_buffer: %s\n", spinerr);
+      return -1;
+    }
+
+  if (enable && catalog_bottom () < library_base ())
+    {
+      spinerr = "Double buffering can not be used with a program catalog";
+      debug ("pb_set_double_buffer: %s\n", spinerr);
+      return -1;
+    }
+
+  if (enable)
+    {
+      banks->enabled = 1;
+      banks->bank_size = library_base () / 2;
+      banks->next_bank = banks->running_start ? 0 : 1;
+      banks->pending_start = -1;
+    }
+  else
+    {
+      banks->enabled = 0;
+      banks->pending_start = banks->running_start ? 0 : -1;
+    }
+
+  // The last program written may not be where the next one goes
+  prog_invalidate (cur_board);
+
+  return 0;
+}
+
+/**
+ * \internal
+ * \return The address of the first instruction of the subroutine library, which
+ * is also the number of instructions left for pulse programs
+ */
+static int
+library_base (void)
+{
+  return board[cur_board].num_instructions - prog_banks[cur_board].library_size;
+}
+
+SPINCORE_API int
+pb_set_library_size (int num_insts)
+{
+  PROG_BANKS *banks = &prog_banks[cur_board];
+  int i;
+
+  spinerr = noerr;
+
+  debug ("pb_set_library_size: num_insts=%d\n", num_insts);
+
+  if (board[cur_board].usb_method != 2)
+    {
+      spinerr = "Subroutine libraries are not supported by your board";
+      debug ("pb_set_library_size: %s\n", spinerr);
+      return -1;
+    }
+
+  if (cur_device != -1)
+    {
+      spinerr = "Can not change the subroutine library while programming the board";
+      debug ("pb_set_library_size: %s\n", spinerr);
+      return -1;
+    }
+
+  if (num_insts < 0 || num_insts >= board[cur_board].num_instructions)
+    {
+      spinerr = "Invalid subroutine library size";
+      debug ("pb_set_library_size: %s\n", spinerr);
+      return -1;
+    }
+
+  for (i = 0; i < CATALOG_MAX_ENTRIES; i++)
+    {
+      if (catalog[cur_board][i].name[0] && catalog[cur_board][i].base
+	  + catalog[cur_board][i].size > board[cur_board].num_instructions - num_insts)
+	{
+	  spinerr = "Subroutine library would overlap the program catalog";
+	  debug ("pb_set_library_size: %s\n", spinerr);
+	  return -1;
+	}
+    }
+
+  banks->library_size = num_insts;
+  banks->library_insts = 0;
+  if (banks->enabled)
+    {
+      banks->bank_size = library_base () / 2;
+    }
+
+  // The last program written may be where the library goes now
+  prog_invalidate (cur_board);
+
+  return 0;
+}
+
+/**
+ * \internal
+ * \return The index of the catalog entry with the given name, or -1 if there
+ * is none
+ */
+static int
+catalog_lookup (const char *name)
+{
+  int i;
+
+  if (name == NULL || name[0] == '\0')
+    {
+      return -1;
+    }
+
+  for (i = 0; i < CATALOG_MAX_ENTRIES; i++)
+    {
+      if (strcmp (catalog[cur_board][i].name, name) == 0)
+	{
+	  return i;
+	}
+    }
+
+  return -1;
+}
+
+/**
+ * \internal
+ * \return The first instruction of the lowest region reserved for the
+ * catalog, which is where pulse programs outside of it have to end, or
+ * library_base() if nothing is reserved
+ */
+static int
+catalog_bottom (void)
+{
+  int bottom = library_base ();
+  int i;
+
+  for (i = 0; i < CATALOG_MAX_ENTRIES; i++)
+    {
+      if (catalog[cur_board][i].name[0] && catalog[cur_board][i].base < bottom)
+	{
+	  bottom = catalog[cur_board][i].base;
+	}
+    }
+
+  return bottom;
+}
+
+/**
+ * \internal
+ * Look for room for a new catalog entry. Entries are placed as high up in the
+ * instruction memory as they fit, so that pulse programs outside of the
+ * catalog keep as much room as possible at the start of it. The pulse program
+ * last written outside of the catalog stays on the board, and may be the one
+ * the board runs, so the lowest free region starts where it ends.
+ *
+ * \param num_insts Number of instructions needed
+ * \param largest If not NULL, set to the size of the largest free region
+ * \return The first instruction of the highest free region which can hold
+ * num_insts instructions, or -1 if there is none
+ */
+static int
+catalog_find_space (int num_insts, int *largest)
+{
+  CATALOG_ENTRY *entries = catalog[cur_board];
+  int found = -1;
+  int end = library_base ();
+  int start;
+  int below;
+  int i;
+
+  if (largest)
+    {
+      *largest = 0;
+    }
+
+  // Walk down from the library, from one free region to the next
+  for (;;)
+    {
+      below = -1;
+      for (i = 0; i < CATALOG_MAX_ENTRIES; i++)
+	{
+	  if (entries[i].name[0] && entries[i].base < end
+	      && (below < 0 || entries[i].base > entries[below].base))
+	    {
+	      below = i;
+	    }
+	}
+
+      start = below >= 0 ? entries[below].base + entries[below].size
+	: prog_banks[cur_board].resident_end;
+      if (found < 0 && end - start >= num_insts)
+	{
+	  found = end - num_insts;
+	}
+      if (largest && end - start > *largest)
+	{
+	  *largest = end - start;
+	}
+
+      if (below < 0)
+	{
+	  return found;
+	}
+      end = entries[below].base;
+    }
+}
+
+/**
+ * \internal
+ * Simulate the program last written to the board.
+ *
+ * \return How long it runs for, in nanoseconds, or -1 if that can not be
+ * predicted because it waits for triggers or runs forever
+ */
+static double
+loaded_runtime (void)
+{
+  PB_SIM_RESULT sim;
+  const PROG_INST *insts;
+  double runtime = -1.0;
+  int num_insts;
+
+  insts = prog_program (cur_board, 1, &num_insts);
+  if (insts
+      && sim_run (insts, num_insts, prog_banks[cur_board].loaded_base,
+		  board[cur_board].clock * board[cur_board].pb_clock_mult,
+		  NULL, 0, &sim) == 0 && !sim.repeats && sim.num_waits == 0)
+    {
+      runtime = sim.runtime;
+    }
+
+  return runtime;
+}
+
+/**
+ * \internal
+ * Remember how long the program which was just written runs for, if it went to
+ * the catalog, for pb_wait_idle() to use after it has been selected again.
+ */
+static void
+catalog_loaded (void)
+{
+  char *error = spinerr;
+  int i;
+
+  for (i = 0; i < CATALOG_MAX_ENTRIES; i++)
+    {
+      if (catalog[cur_board][i].name[0]
+	  && catalog[cur_board][i].base == prog_banks[cur_board].loaded_base)
+	{
+	  catalog[cur_board][i].runtime = loaded_runtime ();
+	  spinerr = error;
+	}
+    }
+}
+
+SPINCORE_API int
+pb_catalog_reserve (const char *name, int num_insts)
+{
+  CATALOG_ENTRY *entry = NULL;
+  int base;
+  int i;
+
+  spinerr = noerr;
+
+  debug ("pb_catalog_reserve: name=%s, num_insts=%d\n", name ? name : "(null)",
+	 num_insts);
+
+  if (board[cur_board].usb_method != 2)
+    {
+      spinerr = "Program catalogs are not supported by your board";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  if (cur_device != -1)
+    {
+      spinerr = "Can not change the program catalog while programming the board";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  if (prog_banks[cur_board].enabled)
+    {
+      spinerr = "Double buffering can not be used with a program catalog";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  if (name == NULL || name[0] == '\0' || strlen (name) >= CATALOG_MAX_NAME)
+    {
+      spinerr = "Invalid program catalog name";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  if (num_insts < 1)
+    {
+      spinerr = "Invalid program catalog entry size";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  if (catalog_lookup (name) >= 0)
+    {
+      spinerr = "Program catalog already has a program of this name";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  for (i = 0; i < CATALOG_MAX_ENTRIES && !entry; i++)
+    {
+      if (catalog[cur_board][i].name[0] == '\0')
+	{
+	  entry = &catalog[cur_board][i];
+	}
+    }
+
+  if (entry == NULL)
+    {
+      spinerr = "Program catalog is full";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  base = catalog_find_space (num_insts, NULL);
+  if (base < 0)
+    {
+      spinerr = "Not enough instruction memory left for the program catalog entry";
+      debug ("pb_catalog_reserve: %s\n", spinerr);
+      return -1;
+    }
+
+  strcpy (entry->name, name);
+  entry->base = base;
+  entry->size = num_insts;
+  entry->num_insts = 0;
+  entry->runtime = -1.0;
+
+  debug ("pb_catalog_reserve: instructions %d to %d\n", base,
+	 base + num_insts - 1);
+
+  return base;
+}
+
+SPINCORE_API int
+pb_catalog_remove (const char *name)
+{
+  int index;
+
+  spinerr = noerr;
+
+  debug ("pb_catalog_remove: name=%s\n", name ? name : "(null)");
+
+  if (cur_device != -1)
+    {
+      spinerr = "Can not change the program catalog while programming the board";
+      debug ("pb_catalog_remove: %s\n", spinerr);
+      return -1;
+    }
+
+  index = catalog_lookup (name);
+  if (index < 0)
+    {
+      spinerr = "No such program in the program catalog";
+      debug ("pb_catalog_remove: %s\n", spinerr);
+      return -1;
+    }
+
+  // Its region could be reserved and written again while the board runs it
+  if (catalog[cur_board][index].base == prog_banks[cur_board].running_start
+      || catalog[cur_board][index].base == prog_banks[cur_board].pending_start)
+    {
+      spinerr = "Can not remove the program the board is set to run";
+      debug ("pb_catalog_remove: %s\n", spinerr);
+      return -1;
+    }
+
+  memset (&catalog[cur_board][index], 0, sizeof (CATALOG_ENTRY));
+
+  return 0;
+}
+
+SPINCORE_API int
+pb_catalog_space (void)
+{
+  int largest;
+
+  spinerr = noerr;
+
+  if (board[cur_board].usb_method != 2)
+    {
+      spinerr = "Program catalogs are not supported by your board";
+      debug ("pb_catalog_space: %s\n", spinerr);
+      return -1;
+    }
+
+  catalog_find_space (0, &largest);
+
+  return largest;
+}
+
+SPINCORE_API int
+pb_catalog_begin (const char *name)
+{
+  int return_value;
+  int index;
+
+  spinerr = noerr;
+
+  debug ("pb_catalog_begin: name=%s\n", name ? name : "(null)");
+
+  index = catalog_lookup (name);
+  if (index < 0)
+    {
+      spinerr = "No such program in the program catalog";
+      debug ("pb_catalog_begin: %s\n", spinerr);
+      return -1;
+    }
+
+  return_value = pb_start_programming (PULSE_PROGRAM);
+  if (return_value != 0)
+    {
+      return return_value;
+    }
+
+  // Addresses stay relative to the start of the program, and are relocated
+  // to the region of the entry as the instructions are written
+  prog_banks[cur_board].base = catalog[cur_board][index].base;
+  prog_banks[cur_board].catalog_entry = index;
+  catalog[cur_board][index].num_insts = 0;
+
+  return 0;
+}
+
+SPINCORE_API int
+pb_catalog_select (const char *name)
 {
+  PROG_BANKS *banks = &prog_banks[cur_board];
+  CATALOG_ENTRY *entry;
+  int index;
+
   spinerr = noerr;
 
-  if (board[cur_board].is_usb)
+  debug ("pb_catalog_select: name=%s\n", name ? name : "(null)");
+
+  if (cur_device != -1)
     {
-      debug ("pb_inp: no support for usb devices\n");
+      spinerr = "Can not select a program while programming the board";
+      debug ("pb_catalog_select: %s\n", spinerr);
       return -1;
     }
 
-  if (board[cur_board].use_amcc)
+  index = catalog_lookup (name);
+  if (index < 0)
     {
-      if (board[cur_board].use_amcc == 2)
-	{
-	  spinerr = "Input from board not supported with this board revision";
-	  debug ("pb_inp: %s\n", spinerr);
-	  return -1;
-	}
-      return do_amcc_inp (cur_board, address);
+      spinerr = "No such program in the program catalog";
+      debug ("pb_catalog_select: %s\n", spinerr);
+      return -1;
     }
-  else
+
+  entry = &catalog[cur_board][index];
+  if (entry->num_insts == 0)
     {
-      return os_inp (cur_board, address);
+      spinerr = "Program catalog entry has not been written";
+      debug ("pb_catalog_select: %s\n", spinerr);
+      return -1;
     }
+
+  // Only the start address changes, at the next pb_start()
+  banks->pending_start = entry->base != banks->running_start ? entry->base : -1;
+
+  return 0;
 }
 
 SPINCORE_API int
-pb_outw (unsigned int address, unsigned int data)
+pb_set_upload_mode (int mode)
 {
   spinerr = noerr;
 
-  if (board[cur_board].is_usb)
+  if (mode != UPLOAD_CACHED && mode != UPLOAD_FULL && mode != UPLOAD_DIFF)
     {
-      debug ("pb_outw: no support for usb devices\n");
+      spinerr = "Invalid upload mode";
+      debug ("pb_set_upload_mode: %s\n", spinerr);
       return -1;
     }
 
-  // amcc chip does not use 32 bit I/O, so this must be our custom PCI core
-  return os_outw (cur_board, address, data);
+  debug ("pb_set_upload_mode: mode=%d\n", mode);
+  upload_mode[cur_board] = mode;
+
+  return 0;
 }
 
-SPINCORE_API unsigned int
-pb_inw (unsigned int address)
+SPINCORE_API int
+pb_set_optimization (int level)
 {
   spinerr = noerr;
 
-  if (board[cur_board].is_usb)
+  if (level & ~(OPTIMIZE_PEEPHOLE | OPTIMIZE_ROLL_LOOPS))
     {
-      debug ("pb_inw: no support for usb devices\n");
+      spinerr = "Invalid optimization level";
+      debug ("pb_set_optimization: %s\n", spinerr);
       return -1;
     }
 
-  // amcc chip does not use 32 bit I/O, so this must be our custom PCI core
-  return os_inw (cur_board, address);
+  debug ("pb_set_optimization: level=%d\n", level);
+  optimization[cur_board] = level;
+
+  return 0;
 }
 
-SPINCORE_API void
-pb_sleep_ms (int milliseconds)
+SPINCORE_API int
+pb_get_optimized_address (int addr)
 {
-#ifdef WINDOWS
-  Sleep (milliseconds);		// on windows, sleep() function takes values in ms.
-#else
-#include <unistd.h>
-  usleep (milliseconds * 1000);	// this linux function takes time in us
-#endif
+  int optimized;
+
+  spinerr = noerr;
+
+  optimized = optimize_lookup (cur_board, addr, NULL);
+  if (optimized < 0)
+    {
+      spinerr = "Instruction address out of range";
+      debug ("pb_get_optimized_address: %s\n", spinerr);
+      return -1;
+    }
+
+  return optimized;
 }
 
+SPINCORE_API int
+pb_get_inst_cost (int inst, int inst_data, double length)
+{
+  __int64 cycles;
+  __int64 per;
+  __int64 rest;
+  int reps;
+  int return_value;
+
+  spinerr = noerr;
+
+  return_value = length_to_cycles (length, &cycles);
+  if (return_value == 0 && cycles > MAX_INST_CYCLES && inst == LONG_DELAY)
+    {
+      if (inst_data < 2 || cycles > MAX_INST_CYCLES * MAX_LONG_DELAY_REPS / inst_data)
+	{
+	  spinerr = "Instruction delay is too long to work with your board";
+	  return_value = -91;
+	}
+      cycles *= inst_data;
+      inst = CONTINUE;
+    }
+  if (return_value == 0 && cycles > MAX_INST_CYCLES)
+    {
+      return_value = split_cycles (cycles, inst == CONTINUE, &reps, &per, &rest);
+    }
+  if (return_value != 0)
+    {
+      debug ("pb_get_inst_cost: %s\n", spinerr);
+      return return_value;
+    }
 
+  if (cycles <= MAX_INST_CYCLES || rest == 0)
+    {
+      return 1;
+    }
 
+  return 2;
+}
 
-int
-do_os_init (int board)
+SPINCORE_API int
+pb_get_optimized_size (int *original, int *optimized)
 {
-  int dev_id;
+  spinerr = noerr;
 
-  debug ("do_os_init: board # %d\n", board);
-  debug ("do_os_init: num_pci_boards: %d\n", num_pci_boards);
-  debug ("do_os_init: num_usb_devices: %d\n", num_usb_devices);
+  optimize_size (cur_board, original, optimized);
 
+  return 0;
+}
 
-  if (board < num_pci_boards)
+SPINCORE_API int
+pb_simulate (PB_SIM_SEGMENT * timeline, int max_segments,
+	     PB_SIM_RESULT * result)
+{
+  const PROG_INST *insts;
+  int programming = (cur_device == PULSE_PROGRAM);
+  int num_insts;
+  int base;
+  int return_value;
+
+  spinerr = noerr;
+
+  if (!result)
     {
-      debug ("do_os_init: initializing pci\n");
-      dev_id = os_init (board);
+      spinerr = "No result structure given";
+      debug ("pb_simulate: %s\n", spinerr);
+      return -1;
     }
-  else
+
+  if (!timeline)
     {
-      debug ("do_os_init: initializing usb\n");
-      dev_id = os_usb_init (board - num_pci_boards);
-      usb_reset_gpif (board - num_pci_boards);
+      max_segments = 0;
     }
 
-  return dev_id;
+  insts = prog_program (cur_board, !programming, &num_insts);
+  if (!insts)
+    {
+      spinerr = "No pulse program to simulate";
+      debug ("pb_simulate: %s\n", spinerr);
+      return -1;
+    }
+
+  base = programming ? prog_banks[cur_board].base : prog_banks[cur_board].loaded_base;
+
+  return_value = sim_run (insts, num_insts, base,
+			  board[cur_board].clock * board[cur_board].pb_clock_mult,
+			  timeline, max_segments, result);
+
+  debug ("pb_simulate: %d instructions, %lld cycles, %d segments (returns %d)\n",
+	 num_insts, result->cycles, result->num_segments, return_value);
+
+  return return_value;
 }
 
-int
-do_os_close (int board)
+SPINCORE_API int
+pb_save_image (const char *filename)
 {
-  int ret = -1;
+  int return_value;
 
-  if (board < num_pci_boards)
+  spinerr = noerr;
+
+  return_value = image_save (filename);
+  if (return_value != 0)
     {
-      debug ("do_os_close: closing pci\n");
-      ret = os_close (board);
+      debug ("pb_save_image: %s\n", spinerr);
     }
-  else
+
+  return return_value;
+}
+
+/**
+ * \internal
+ * Add cached IMWs of an image to the pulse program. If the image was cached at
+ * another position, the jumps are moved and encoded again.
+ *
+ * \param offset How far the image is from where it was cached, in instructions
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+write_cached_image (const PROG_INST * insts, int num_insts,
+		    const unsigned char *imws, int offset)
+{
+  unsigned char imw[IMW_MAX_BYTES];
+  PROG_INST record;
+  int return_value;
+  int i;
+
+  for (i = 0; i < num_insts; i++)
     {
-      debug ("do_os_close: closing usb\n");
-      ret = os_usb_close ();
+      record = insts[i];
+      memcpy (imw, imws + record.offset, record.num_bytes);
+
+      if (offset != 0 && (record.inst == BRANCH || record.inst == JSR || record.inst == END_LOOP))
+	{
+	  record.inst_data += offset;
+	  return_value = board[cur_board].encoder->serialize (record.flags, record.inst,
+							      record.inst_data, record.delay, imw);
+	  if (return_value < 0)
+	    {
+	      return return_value;
+	    }
+	}
+
+      return_value = write_imw (imw, record.num_bytes, &record);
+      if (return_value != 0)
+	{
+	  return return_value;
+	}
+
+      num_instructions += 1;
     }
 
-  return ret;
+  return 0;
+}
+
+SPINCORE_API int
+pb_load_image (const char *filename)
+{
+  IMAGE *image;
+  IMAGE_KEY key;
+  PROG_INST *insts;
+  unsigned char *imws;
+  const PROG_INST *written;
+  int first = num_instructions;
+  int position = prog_banks[cur_board].base + num_instructions;
+  int cached_position;
+  int num_insts;
+  int return_value;
+
+  spinerr = noerr;
+
+  if (cur_device != PULSE_PROGRAM || board[cur_board].encoder == NULL)
+    {
+      spinerr = "Images can only be loaded between pb_start_programming(PULSE_PROGRAM) and pb_stop_programming()";
+      debug ("pb_load_image: %s\n", spinerr);
+      return -1;
+    }
+
+  image = image_open (filename);
+  if (!image)
+    {
+      debug ("pb_load_image: %s (%s)\n", spinerr, filename);
+      return -1;
+    }
+
+  image_make_key (&board[cur_board], &key);
+
+  if (image_cacheable (image))
+    {
+      num_insts = image_cache_read (filename, image, &key, &cached_position, &insts, &imws);
+      if (num_insts >= 0)
+	{
+	  debug ("pb_load_image: %d instructions from cache\n", num_insts);
+	  return_value = write_cached_image (insts, num_insts, imws, position - cached_position);
+	  free (insts);
+	  free (imws);
+	  image_free (image);
+	  if (return_value != 0)
+	    {
+	      debug ("pb_load_image: %s\n", spinerr);
+	      return return_value;
+	    }
+	  return first;
+	}
+    }
+
+  return_value = image_encode (image, first);
+  if (return_value >= 0 && num_instructions != first + return_value)
+    {
+      spinerr = "Pulse program image can not be encoded for this board";
+      return_value = -1;
+    }
+  if (return_value < 0)
+    {
+      debug ("pb_load_image: %s\n", spinerr);
+      image_free (image);
+      return return_value;
+    }
+
+  // Only instructions which can be encoded again are cached
+  written = prog_program (cur_board, 0, &num_insts);
+  if (image_cacheable (image) && written && num_insts == num_instructions)
+    {
+      image_cache_write (filename, image, &key, position, written + first,
+			 return_value, (const unsigned char *) prog_data (cur_board));
+    }
+
+  image_free (image);
+  return first;
+}
+
+SPINCORE_API int
+pb_invalidate_program (void)
+{
+  spinerr = noerr;
+
+  debug ("pb_invalidate_program: board %d\n", cur_board);
+  prog_invalidate (cur_board);
+
+  return 0;
 }
 
 SPINCORE_API void
@@ -1775,6 +4040,7 @@ pb_bypass_FF_fix (int option)
 	debug
 	  ("pb_bypass_FF_fix: bypassing software fix.. no clock cycles will be subtracted from 0x..FF delays.\n");
 	board[cur_board].has_FF_fix = 1;
+	select_delay_fix (&board[cur_board]);
 	break;
       }
     case 0:
@@ -1782,6 +4048,7 @@ pb_bypass_FF_fix (int option)
 	debug
 	  ("pb_bypass_FF_fix: software fix turned on: one clock cycle will be subtracted from 0x..FF delays.\n");
 	board[cur_board].has_FF_fix = 0;
+	select_delay_fix (&board[cur_board]);
 	break;
       }
     default:
@@ -1794,6 +4061,48 @@ pb_bypass_FF_fix (int option)
 
 }
 
+/**
+ * \internal
+ * Write the output pattern of a PBESR-PRO-II instruction once for each clock
+ * cycle of its length. The repeated pattern is built in a buffer and written
+ * in blocks, rather than with one pb_outp() per byte.
+ *
+ * \param pattern Bytes sent for one clock cycle (1 for hs8, 3 for hs24)
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+static int
+hs_write (const char *pattern, int pattern_bytes, int num_cycles)
+{
+  char buf[OUTP_STREAM_SIZE];
+  int buf_cycles = OUTP_STREAM_SIZE / pattern_bytes;
+  int n;
+  int ret;
+
+  if (buf_cycles > num_cycles)
+    {
+      buf_cycles = num_cycles;
+    }
+  for (n = 0; n < buf_cycles; n++)
+    {
+      memcpy (buf + n * pattern_bytes, pattern, pattern_bytes);
+    }
+
+  while (num_cycles > 0)
+    {
+      n = num_cycles < buf_cycles ? num_cycles : buf_cycles;
+
+      ret = outp_stream_write (buf, n * pattern_bytes);
+      if (ret != 0)
+	{
+	  return ret;
+	}
+      num_cycles -= n;
+    }
+
+  return 0;
+}
+
 SPINCORE_API int
 pb_inst_hs8(char* Flags, double length)
 {
@@ -1846,8 +4155,11 @@ pb_inst_hs8(char* Flags, double length)
      //Each pb_outp instruction controls the output for one clock cycle,
      //  so send this line to the board as many times as it takes to
      //  create the requested instruction length.
-     for (i = 1; i <= num_cycles; i++)
-         pb_outp(6,hex_flags0);     
+     if (hs_write (&hex_flags0, 1, num_cycles) != 0)
+     {
+        debug("pb_inst_hs8: %s\n",spinerr);
+        return -1;
+     }
         
      return num_cycles;
 }
@@ -1857,6 +4169,7 @@ pb_inst_hs24(char* Flags, double length)
 {
      int i,num_cycles;
      char hex_flags0,hex_flags1,hex_flags2;
+     char hex_flags[3];
      double clock_freq = board[cur_board].clock;
      spinerr = noerr;
      
@@ -1918,16 +4231,78 @@ pb_inst_hs24(char* Flags, double length)
      //Each pb_outp instruction controls the output for one clock cycle,
      //  so send this line to the board as many times as it takes to
      //  create the requested instruction length.
-     for (i = 1; i <= num_cycles; i++)
+     hex_flags[0] = hex_flags0;
+     hex_flags[1] = hex_flags1;
+     hex_flags[2] = hex_flags2;
+     if (hs_write (hex_flags, 3, num_cycles) != 0)
      {
-         pb_outp(6,hex_flags0);
-         pb_outp(6,hex_flags1);
-         pb_outp(6,hex_flags2);
-     }        
+        debug("pb_inst_hs24: %s\n",spinerr);
+        return -1;
+     }
         
      return num_cycles;
 }
 
+SPINCORE_API int
+pb_inst_hs_block (int num_bits, const int *flags, const double *lengths,
+		  int num_insts)
+{
+  char pattern[3];
+  int num_cycles;
+  int total = 0;
+  int i;
+
+  spinerr = noerr;
+
+  if (num_bits != 8 && num_bits != 24)
+    {
+      spinerr = "Number of bits must be 8 or 24";
+      debug ("pb_inst_hs_block: %s\n", spinerr);
+      return -2;
+    }
+
+  // Check every length first, so that nothing is written for a bad program
+  for (i = 0; i < num_insts; i++)
+    {
+      num_cycles = (int) rint (lengths[i] * board[cur_board].clock);
+      if (num_cycles < 1)
+	{
+	  spinerr = "Length must be greater than or equal to one clock period";
+	  debug ("pb_inst_hs_block: instruction %d: %s\n", i, spinerr);
+	  return -4;
+	}
+    }
+
+  for (i = 0; i < num_insts; i++)
+    {
+      num_cycles = (int) rint (lengths[i] * board[cur_board].clock);
+
+      if (num_bits == 8)
+	{
+	  pattern[0] = 0xFF & flags[i];
+	}
+      else
+	{
+	  // Channel 23 first, as in pb_inst_hs24()
+	  pattern[0] = 0xFF & (flags[i] >> 16);
+	  pattern[1] = 0xFF & (flags[i] >> 8);
+	  pattern[2] = 0xFF & flags[i];
+	}
+
+      if (hs_write (pattern, num_bits / 8, num_cycles) != 0)
+	{
+	  debug ("pb_inst_hs_block: %s\n", spinerr);
+	  return -1;
+	}
+      total += num_cycles;
+    }
+
+  debug ("pb_inst_hs_block: %d instructions, %d clock cycles\n", num_insts,
+	 total);
+
+  return total;
+}
+
 
 SPINCORE_API int
 pb_select_dds (int dds_num)
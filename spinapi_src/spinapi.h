@@ -46,6 +46,16 @@
 #define RX_PHASE_REGS  3
 #define PHASE_REGS_0   3
 
+// Records a board independent image of a pulse program, see pb_save_image()
+#define PULSE_IMAGE    4
+// Writes the subroutine library, see pb_set_library_size()
+#define PULSE_LIBRARY  5
+
+// Jump target of a JSR or BRANCH into the subroutine library, see
+// pb_set_library_size()
+#define PB_LIBRARY_BIT 0x40000000
+#define PB_LIBRARY(address) ((address) | PB_LIBRARY_BIT)
+
 // These are names used by RadioProcessor
 #define COS_PHASE_REGS 51
 #define SIN_PHASE_REGS 50
@@ -74,6 +84,16 @@
 #define WAIT 8
 #define RTI 9
 
+//Defines for the different ways of writing a pulse program, see pb_set_upload_mode()
+#define UPLOAD_CACHED 0
+#define UPLOAD_FULL 1
+#define UPLOAD_DIFF 2
+
+//Defines for the optimizations applied to pulse programs, see pb_set_optimization()
+#define OPTIMIZE_NONE 0
+#define OPTIMIZE_PEEPHOLE 1
+#define OPTIMIZE_ROLL_LOOPS 2
+
 //Defines for using different units of time
 #define ns 1.0
 #define us 1000.0
@@ -157,6 +177,56 @@ typedef struct
   int average;
 } PB_OVERFLOW_STRUCT;
 
+/// \brief Segment of a simulated timeline
+///
+/// A stretch of time during which the outputs of the board do not change, see
+/// pb_simulate().
+typedef struct
+{
+  /// Flag words of the instructions, as given to the encoder of the board. For
+  /// DDS boards these also hold the frequency, phase and amplitude registers selected.
+  int flags[3];
+  /// Length of the segment in clock cycles
+  __int64 cycles;
+  /// Length of the segment in nanoseconds
+  double length;
+} PB_SIM_SEGMENT;
+
+/// \brief Result of a simulation
+///
+/// Totals of a pulse program run by pb_simulate().
+typedef struct
+{
+  /// Time until the program stops, or until it starts over, in nanoseconds
+  double runtime;
+  /// Time until the program stops, or until it starts over, in clock cycles
+  __int64 cycles;
+  /// 1 if the program branches back and runs forever, 0 if it stops
+  int repeats;
+  /// Number of WAIT instructions executed, each assumed to be triggered right away
+  int num_waits;
+  /// Number of segments written to the timeline
+  int num_segments;
+  /// 1 if the timeline was too small to hold all of the segments
+  int truncated;
+  /// Flag words of the STOP instruction, which the outputs are left at
+  int end_flags[3];
+} PB_SIM_RESULT;
+
+/// \brief Parameter of an arrayed experiment
+///
+/// What one column of the parameter table given to pb_run_sweep() changes.
+typedef struct
+{
+  /// PULSE_PROGRAM to change the length of an instruction, or FREQ_REGS,
+  /// TX_PHASE_REGS, RX_PHASE_REGS, COS_PHASE_REGS or SIN_PHASE_REGS to change
+  /// a register
+  int device;
+  /// Address of the instruction, as returned by the pb_inst* function, or
+  /// number of the register
+  int target;
+} PB_SWEEP_PARAM;
+
 //if building windows dll, compile with -DDLL_EXPORTS flag
 //if building code to use windows dll, no -D flag necessary
 #ifdef WINDOWS
@@ -246,6 +316,8 @@ SPINCORE_API int pb_close (void);
  * <li>RX_PHASE_REGS - The phase registers for the RX channel will be programmed using pb_set_phase() (DDS enabled boards only)
  * <li>COS_PHASE_REGS - The phase registers for the cos (real) channel (RadioProcessor boards only)
  * <li>SIN_PHASE_REGS - The phase registers for the sine (imaginary) channel (RadioProcessor boards only)
+ * <li>PULSE_IMAGE - The pb_inst* instructions are recorded into a pulse program image, see pb_save_image(). No board is needed.
+ * <li>PULSE_LIBRARY - The subroutine library will be programmed using the pb_inst* instructions, see pb_set_library_size().
  * </ul>
  * \return A negative number is returned on failure, and spinerr is set to a 
  * description of the error. 0 is returned on success.
@@ -313,7 +385,9 @@ SPINCORE_API int pb_set_phase (double phase);
  *
  *
  * \param inst_data Instruction specific data. Internally this is a 20 bit unsigned number, so the largest value that can be passed is 2^20-1 (the largest value possible for a 20 bit number). See above table to find out what this means for each instruction.
- * \param length Length of this instruction in nanoseconds.
+ * \param length Length of this instruction in nanoseconds. Lengths which are too
+ * long for the delay field of the board are made up exactly with an additional
+ * LONG_DELAY instruction of the same outputs, see pb_get_inst_cost().
  * \return The address of the created instruction is returned. This can be used
  * as the branch address for any branch instructions. A negative number is
  * returned on failure, and spinerr is set to a description of the error.
@@ -343,7 +417,9 @@ SPINCORE_API int pb_inst_onerf (int freq, int phase, int rf_output_enable,
  * This function is used to write a pulse program to any PulseBlaster QuadCore design 
  *
  *\param flag Output flag pattern for the current instruction.
- *\param length Length of the current instruction in nanoseconds.
+ *\param length Length of the current instruction in nanoseconds. Lengths which
+ * are too long for the 30 bit delay field are split evenly over several
+ * instructions.
  *
  *\return Returns 0 on success.
  *
@@ -373,6 +449,40 @@ SPINCORE_API int pb_inst_pbonly (unsigned int flags, int inst, int inst_data,
  */
 SPINCORE_API int pb_inst_pbonly64 (__int64 flags, int inst, int inst_data,
 				   double length);
+/**
+ * The same as pb_inst_pbonly(), but the length is given as a number of clock
+ * cycles of the PulseBlaster core, so that no rounding takes place. Lengths
+ * too long for one instruction are made up with a LONG_DELAY, exact to the
+ * clock cycle, as with pb_inst_pbonly(). Such instructions can not be recorded
+ * in a pulse program image (see pb_start_programming()).
+ *
+ * \param cycles Length of the instruction in clock cycles, at least 5
+ */
+SPINCORE_API int pb_inst_pbonly_cycles (unsigned int flags, int inst,
+					int inst_data, __int64 cycles);
+/**
+ * The same as pb_inst_pbonly64(), but the length is given as a number of
+ * clock cycles. See pb_inst_pbonly_cycles().
+ */
+SPINCORE_API int pb_inst_pbonly64_cycles (__int64 flags, int inst,
+					  int inst_data, __int64 cycles);
+/**
+ * Convert lengths in nanoseconds to the numbers of clock cycles the pb_inst*
+ * functions would use for them on the current board, which must have its
+ * clock set with pb_core_clock(). The residual is what is lost by rounding,
+ * so that a program can carry it over into the next length and keep its
+ * timing exact.
+ *
+ * \param num Number of lengths to convert
+ * \param length Lengths, in nanoseconds
+ * \param cycles Where the numbers of clock cycles are stored
+ * \param residual Where length minus the length of cycles is stored, in
+ * nanoseconds. May be NULL.
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_length_to_cycles (int num, const double *length,
+				      __int64 * cycles, double *residual);
 /**
  * This function allows you to directly specify the fields for an instruction, which will
  * then be passed directly to the board without any modification by software.
@@ -398,13 +508,416 @@ SPINCORE_API int pb_inst_pbonly64 (__int64 flags, int inst, int inst_data,
  */
 SPINCORE_API int pb_inst_direct (int *pflags, int inst, int inst_data_direct,
 				                 int length);
+/**
+ * Write a whole pulse program of IMWs which were encoded in advance, such as
+ * those encoded at compile time by spinapi_static.hpp. This must be called
+ * right after pb_start_programming(PULSE_PROGRAM), since jumps in the IMWs
+ * refer to the start of the program, and double buffering must be off. The
+ * IMWs can not be patched, optimized or simulated.
+ *
+ * The layout, clock and "1FF" fix setting the IMWs were encoded for are
+ * checked against the board, so that IMWs meant for another board are never
+ * written to it. RadioProcessors with DDS shapes or a custom design arrange
+ * the flag bits of their instructions differently, and are not supported.
+ *
+ * \param layout Name of the firmware layout the IMWs were encoded for
+ * \param clock Clock frequency of the PulseBlaster core the lengths were calculated for, in MHz
+ * \param has_FF_fix 1 if the "1FF" fix was left out (see pb_bypass_FF_fix()), 0 otherwise
+ * \param imws The IMWs, one after the other
+ * \param num_insts Number of IMWs
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_write_imws (const char *layout, double clock,
+				int has_FF_fix, const void *imws,
+				int num_insts);
 /**
  * Finishes the programming for a specific onboard devices which was started by pb_start_programming(). 
  *
+ * Pulse program instructions are sent to the board here. If the program is
+ * identical to the one that was last written to the board, it is not sent again.
+ *
  * \return A negative number is returned on failure, and spinerr is set to a 
  * description of the error. 0 is returned on success.
  */
 SPINCORE_API int pb_stop_programming (void);
+/**
+ * Tell spinapi that the instruction memory of the board may no longer hold the
+ * last pulse program that was written to it, for example because the board was
+ * power cycled. The next pulse program will be written in full, even if it is
+ * unchanged. This is done automatically by pb_init() and pb_reset().
+ *
+ * \return 0 is returned on success.
+ */
+SPINCORE_API int pb_invalidate_program (void);
+/**
+ * Choose how pb_stop_programming() writes a pulse program to the board.
+ *
+ * \param mode One of the following:
+ * - UPLOAD_CACHED (default) - The program is written in full, unless it is
+ * identical to the one last written to the board, in which case nothing is sent.
+ * - UPLOAD_FULL - The program is always written in full.
+ * - UPLOAD_DIFF - Only the instructions which differ from the program last
+ * written to the board are sent. On USB boards which use the newer programming
+ * method each changed range of instructions is written on its own. Other boards
+ * can only be programmed starting from the first instruction, so everything up
+ * to the last changed instruction is rewritten.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_set_upload_mode (int mode);
+/**
+ * Split the instruction memory of the board into two banks, so that a new pulse
+ * program can be written while the previous one is still running. Each pulse
+ * program is written to the bank which is not in use, and the board switches to
+ * it at the next call to pb_start(). Until then, the previous program keeps
+ * running undisturbed. Programs may use at most half of the instruction memory
+ * of the board (not counting the subroutine library, see pb_set_library_size()),
+ * and are always written in full.
+ *
+ * Instruction addresses returned by the pb_inst* functions, and used for
+ * branches, loops and subroutines, remain relative to the start of the program.
+ *
+ * This is only supported by USB boards which use the newer programming method,
+ * and must not be called between pb_start_programming() and
+ * pb_stop_programming().
+ *
+ * \param enable 1 to use two program banks, 0 to place every program at the
+ * start of the instruction memory (default)
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_set_double_buffer (int enable);
+/**
+ * Reserve the end of the instruction memory for a library of subroutines which
+ * stays on the board while pulse programs come and go, so that blocks shared
+ * by many programs are written only once. The library is written like a pulse
+ * program, between pb_start_programming(PULSE_LIBRARY) and
+ * pb_stop_programming(). Each subroutine ends with an RTS, and its address is
+ * the one the pb_inst* function returned for its first instruction.
+ *
+ * Pulse programs call a subroutine of the library with a JSR to
+ * PB_LIBRARY(address), which is resolved when the instruction is written. The
+ * library must have been written by then. Pulse programs can only use the
+ * instruction memory below the library. pb_simulate() does not follow calls
+ * into the library, and pb_set_optimization() does not apply to it.
+ *
+ * This is only supported by USB boards which use the newer programming method,
+ * and must not be called between pb_start_programming() and
+ * pb_stop_programming(). Changing the size discards the library.
+ *
+ * \param num_insts Number of instructions to reserve, or 0 for no library
+ * (default)
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_set_library_size (int num_insts);
+/**
+ * Reserve a region of the instruction memory for a named pulse program of the
+ * program catalog. The programs of the catalog stay on the board side by side,
+ * so that switching between them with pb_catalog_select() only changes the
+ * address the board starts at, instead of writing the program again.
+ *
+ * Regions are placed as high up in the instruction memory as they fit, below
+ * the subroutine library (see pb_set_library_size()). Pulse programs written
+ * with pb_start_programming(PULSE_PROGRAM) go to the start of the instruction
+ * memory as usual, and must end below the lowest region of the catalog. The
+ * last of them stays on the board, and no region is reserved on top of it.
+ *
+ * This is only supported by USB boards which use the newer programming method,
+ * can not be used together with double buffering (see pb_set_double_buffer()),
+ * and must not be called between pb_start_programming() and
+ * pb_stop_programming().
+ *
+ * \param name Name of the program, at most 31 characters
+ * \param num_insts Number of instructions to reserve
+ *
+ * \return The address of the first instruction of the region. A negative
+ * number is returned on failure, and spinerr is set to a description of the
+ * error.
+ */
+SPINCORE_API int pb_catalog_reserve (const char *name, int num_insts);
+/**
+ * Remove a program from the program catalog, so that its region of the
+ * instruction memory can be reserved again. The program the board runs, or
+ * will run after the next pb_start() (see pb_catalog_select()), can not be
+ * removed. See pb_catalog_reserve().
+ *
+ * \param name Name of the program
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_catalog_remove (const char *name);
+/**
+ * \return The largest number of instructions which can still be reserved
+ * with pb_catalog_reserve(). A negative number is returned on failure, and
+ * spinerr is set to a description of the error.
+ */
+SPINCORE_API int pb_catalog_space (void);
+/**
+ * Start writing a program of the program catalog. This is used instead of
+ * pb_start_programming(PULSE_PROGRAM), and the program is written with the
+ * pb_inst* functions and pb_stop_programming() as usual. Instruction addresses
+ * remain relative to the start of the program, and are relocated to its
+ * region of the instruction memory. The program the board runs does not
+ * change until this one is selected with pb_catalog_select().
+ *
+ * pb_patch_delay(), pb_patch_flags() and pb_run_sweep() change the program
+ * which was written last. See pb_catalog_reserve().
+ *
+ * \param name Name of the program
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_catalog_begin (const char *name);
+/**
+ * Select the program of the program catalog which the board runs from the
+ * next pb_start() on. Only the start address of the board is written, by
+ * pb_start(). Writing a pulse program with pb_start_programming(PULSE_PROGRAM)
+ * selects that program again. See pb_catalog_reserve().
+ *
+ * \param name Name of the program, which must have been written with
+ * pb_catalog_begin()
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_catalog_select (const char *name);
+/**
+ * Choose which optimizations pb_stop_programming() applies to a pulse program
+ * before it is written to the board. The subroutine library (see
+ * pb_set_library_size()) is always written as given. Optimized programs run exactly as written,
+ * but need fewer instructions, so that they take less time to write and larger
+ * programs fit into the instruction memory.
+ *
+ * The addresses returned by the pb_inst* functions can still be used as branch,
+ * loop and subroutine targets, and with pb_patch_delay() and pb_patch_flags().
+ * Use pb_get_optimized_address() to find where an instruction ended up.
+ *
+ * \param level OPTIMIZE_NONE (default) to write programs exactly as given, or
+ * any combination of the following:
+ * - OPTIMIZE_PEEPHOLE - Consecutive CONTINUE instructions which output the
+ * same flags are merged into one. BRANCH instructions to the next instruction,
+ * and LOOP/END_LOOP pairs which run only once, become CONTINUE instructions.
+ * Instructions which are the target of a branch, loop or subroutine call are
+ * never merged into the instruction before them.
+ * - OPTIMIZE_ROLL_LOOPS - Blocks of instructions which are repeated back to
+ * back are rolled up into a LOOP/END_LOOP, nesting loops up to 8 levels deep.
+ * The first instruction of the block becomes the LOOP and the last one the
+ * END_LOOP, so blocks must start and end with a CONTINUE. Blocks of CONTINUE
+ * instructions which appear more than once elsewhere are moved into a
+ * subroutine after the end of the program, called with a JSR which replaces
+ * the instruction before each copy. Subroutines are only created for programs
+ * which do not use JSR themselves and end with a STOP or BRANCH.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_set_optimization (int level);
+/**
+ * Find where an instruction of the last pulse program is in the instruction
+ * memory of the board, after that program was optimized (see
+ * pb_set_optimization()). Instructions which were merged all have the same
+ * address. Without optimization the address is returned unchanged.
+ *
+ * \param addr Address of the instruction, as returned by the pb_inst* function
+ * which created it
+ *
+ * \return The address of the instruction in the optimized program. A negative
+ * number is returned on failure, and spinerr is set to a description of the
+ * error.
+ */
+SPINCORE_API int pb_get_optimized_address (int addr);
+/**
+ * Get the number of instructions of the last pulse program, before and after it
+ * was optimized (see pb_set_optimization()).
+ *
+ * \param original Set to the number of instructions written by the pb_inst*
+ * functions
+ * \param optimized Set to the number of instructions written to the board
+ *
+ * \return 0 is returned on success.
+ */
+SPINCORE_API int pb_get_optimized_size (int *original, int *optimized);
+/**
+ * Run the pulse program on the host as the PulseBlaster core would, without
+ * the board, and give the timeline of its outputs. Between
+ * pb_start_programming() and pb_stop_programming() the instructions given so
+ * far are simulated, and otherwise the program last written to the board, as
+ * optimized by pb_set_optimization().
+ *
+ * Every instruction lasts exactly as many clock cycles as the pb_inst* function
+ * calculated, LOOP and LONG_DELAY instructions are repeated as on the board,
+ * and WAIT instructions are assumed to be triggered right away. Each iteration
+ * of a loop produces the same outputs, so loops are only executed once, and a
+ * loop of a million iterations is simulated as fast as one of two. Simulation
+ * ends at a STOP instruction, or when the program branches back to an
+ * instruction it already executed outside of any loop or subroutine.
+ *
+ * Consecutive instructions with the same outputs are joined into one segment
+ * of the timeline. RTI instructions can not be simulated.
+ *
+ * \param timeline Array which is filled with the segments of the timeline, or
+ * NULL if only the totals are wanted
+ * \param max_segments Size of the timeline array. If the timeline does not fit,
+ * it is cut off, and result->truncated is set.
+ * \param result Filled in with the runtime and the size of the timeline
+ * \return 0 if the program stops, 1 if it runs forever. A negative number is
+ * returned on failure, and spinerr is set to a description of the error.
+ */
+SPINCORE_API int pb_simulate (PB_SIM_SEGMENT * timeline, int max_segments,
+			      PB_SIM_RESULT * result);
+/**
+ * Save the pulse program image recorded between
+ * pb_start_programming(PULSE_IMAGE) and pb_stop_programming() to a file. While
+ * an image is recorded, pb_inst_pbonly(), pb_inst_pbonly64(), pb_inst_radio(),
+ * pb_inst_radio_shape(), pb_inst_dds2(), pb_inst_dds2_shape() and the functions
+ * built on them keep their arguments instead of encoding the instruction for a
+ * board, and return the address of the instruction in the image. Jumps to
+ * these addresses are kept as well.
+ *
+ * The image does not depend on the board, and is loaded onto any board with
+ * pb_load_image(). Nothing is checked until then.
+ *
+ * \param filename Name of the image file to write
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_save_image (const char *filename);
+/**
+ * Add the instructions of a pulse program image written by pb_save_image() to
+ * the pulse program, encoded for the current board. This must be called
+ * between pb_start_programming(PULSE_PROGRAM) and pb_stop_programming(), and
+ * can be mixed with pb_inst* calls. Every instruction is encoded exactly as
+ * the pb_inst* function it was recorded from would encode it now, and jumps
+ * within the image are moved to where the instructions end up.
+ *
+ * The encoded instructions are saved in a cache file next to the image, named
+ * after the image with a suffix for the kind of board, and are used instead
+ * of encoding the image again the next time it is loaded onto that kind of
+ * board. Images which use DDS shapes are always encoded again, since that
+ * programs the shape period registers.
+ *
+ * \param filename Name of the image file
+ * \return The address of the first instruction of the image in the pulse
+ * program. A negative number is returned on failure, and spinerr is set to a
+ * description of the error.
+ */
+SPINCORE_API int pb_load_image (const char *filename);
+/**
+ * Find how many instructions of the instruction memory one call to a pb_inst*
+ * function will use. Instructions whose length is too long for the delay field
+ * of the board are made up with a LONG_DELAY instruction of the same outputs,
+ * exact to the clock cycle:
+ * - A CONTINUE becomes a single LONG_DELAY if its length can be divided evenly
+ * into a repeat count close to the smallest possible one, and a CONTINUE
+ * followed by a LONG_DELAY otherwise.
+ * - A LOOP or WAIT is followed by a LONG_DELAY making up the rest of its length,
+ * which for a LOOP is part of the loop.
+ * - Any other instruction is preceded by a LONG_DELAY, so that the time passes
+ * before it takes effect. The address returned by the pb_inst* function is that
+ * of the LONG_DELAY.
+ * - A LONG_DELAY is made up again from its total length, as for a CONTINUE.
+ *
+ * \param inst The instruction, as passed to the pb_inst* function
+ * \param inst_data The instruction data, as passed to the pb_inst* function
+ * \param length The length of the instruction, in nanoseconds
+ *
+ * \return The number of instructions used. A negative number is returned on
+ * failure, and spinerr is set to a description of the error.
+ */
+SPINCORE_API int pb_get_inst_cost (int inst, int inst_data, double length);
+/**
+ * Change the length of one instruction of the pulse program that is on the
+ * board, without programming the whole program again. The delay is calculated
+ * exactly as it would have been by the pb_inst* function which created the
+ * instruction, and only that instruction is written to the board. Boards
+ * which can only be programmed from the first instruction on will have all
+ * instructions up to this one rewritten, see pb_set_upload_mode().
+ *
+ * This must not be called between pb_start_programming() and
+ * pb_stop_programming(). On PCI boards the pulse program is stopped. An
+ * instruction which the optimizer merged with others, or which was too long
+ * for a single instruction (see pb_get_inst_cost()), can not be patched.
+ *
+ * \param addr Address of the instruction, as returned by the pb_inst* function
+ * \param length New length of the instruction, in nanoseconds
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_patch_delay (int addr, double length);
+/**
+ * Change the output flags of one instruction of the pulse program that is on
+ * the board, without programming the whole program again. This replaces the
+ * whole flag field, as given to pb_inst_pbonly64(). See pb_patch_delay().
+ *
+ * \param addr Address of the instruction, as returned by the pb_inst* function
+ * \param flags New flag field of the instruction
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_patch_flags (int addr, __int64 flags);
+/**
+ * Change the length and/or output flags of several instructions of the pulse
+ * program that is on the board at once. The instructions are all encoded
+ * before anything is sent, and then written together. If any of them can not
+ * be changed, the board is left untouched. See pb_patch_delay().
+ *
+ * \param num Number of instructions to change
+ * \param addr Array of num instruction addresses
+ * \param length Array of num new lengths (in nanoseconds), or NULL to leave the lengths unchanged
+ * \param flags Array of num new flag fields, or NULL to leave the flags unchanged
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_patch_instructions (int num, int *addr, double *length,
+					__int64 * flags);
+/**
+ * Run an arrayed experiment. The pulse program and registers already on the
+ * board are the base sequence, and each row of the parameter table gives the
+ * instruction lengths and register values of one point. The points are run
+ * back to back: the instructions and register banks which differ from the
+ * previous point are written (see pb_patch_instructions()), the core is
+ * reset with pb_stop() and the scan counter with pb_scan_count() (on boards
+ * which have one), the program is started, and once it has finished (see
+ * pb_wait_idle()) the acquired data is read into the next row of the data
+ * arrays. The instructions of the next point are encoded while the board is
+ * running the current one.
+ *
+ * Registers are written from register 0 on, so the columns changing one
+ * register bank must cover registers 0 to n-1 of that bank. Lengths are in
+ * nanoseconds, frequencies and phases in the units of pb_set_freq() and
+ * pb_set_phase(). Programs which wait for a hardware trigger wait for it at
+ * every point.
+ *
+ * This must not be called between pb_start_programming() and
+ * pb_stop_programming(). If a point can not be set up, the points before it
+ * have been run and their data read when the error is returned.
+ *
+ * \param num_params Number of columns of the parameter table
+ * \param params Array of num_params descriptions of the columns
+ * \param num_points Number of points, that is rows of the parameter table
+ * \param values Parameter table of num_points rows of num_params values
+ * \param num_fid_points Number of complex points acquired at each point
+ * \param real_data Array of num_points * num_fid_points values which the real
+ * data of each point is stored into, one point after the other, or NULL if
+ * no data is to be read
+ * \param imag_data Same as real_data, for the imaginary data
+ * \param overhead If not NULL, an array of num_points values which is set to
+ * the time each point took on top of the time the pulse program was running,
+ * in milliseconds
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_run_sweep (int num_params, const PB_SWEEP_PARAM * params,
+			       int num_points, const double *values,
+			       int num_fid_points, int *real_data,
+			       int *imag_data, double *overhead);
 /**
  * Send a software trigger to the board. This will start execution of a pulse
  * program. It will also trigger a program which is currently paused due to
@@ -442,6 +955,16 @@ SPINCORE_API int pb_reset (void);
  * \param data The byte to write
  */
 SPINCORE_API int pb_outp (unsigned int address, char data);
+/**
+ * Get the rate at which pulse programs have been written to the PulseBlaster
+ * core of the current board since the last call to pb_start_programming().
+ * Instructions are sent to a PCI board's core data port in blocks, so this
+ * reflects the speed of the underlying bus transfers. Single bytes written
+ * with pb_outp() and USB boards are not included.
+ * \return The write rate in bytes per second, or 0 if nothing has been
+ * written yet.
+ */
+SPINCORE_API double pb_get_outp_rate (void);
 /**
  * Read 1 byte from the given PCI I/O address.
  * This is a low level hardware access function.
@@ -502,6 +1025,34 @@ SPINCORE_API double pb_get_rounded_value (void);
  * \return Word that indicates the state of the current board as described above.
  */
 SPINCORE_API int pb_read_status (void);
+/**
+ * Wait until the pulse program started by pb_start() has finished, that is
+ * until pb_read_status() reports the board as stopped (bit 0) and no longer
+ * reset (bit 1), and not running, waiting or scanning. A board which has been
+ * reset but not yet started or triggered is not finished, so this waits for
+ * the start to take effect. This replaces loops of pb_read_status() and
+ * pb_sleep_ms() which wait for the status to be 0x03.
+ *
+ * The time the program takes is worked out as with pb_simulate(), and most
+ * of it is spent asleep. The status is then read at shorter and shorter
+ * intervals as the predicted end comes closer, down to a fraction of a
+ * millisecond. Programs which contain a WAIT or never stop can not be
+ * predicted; for them, the status is read at intervals growing from 0.1 ms
+ * to 10 ms.
+ *
+ * On Windows, sleeps last at least 1 ms, so the status is read at most about
+ * once per millisecond. The system timer normally ticks only every 15.6 ms,
+ * which is then the real interval, unless the application has raised the
+ * timer resolution with timeBeginPeriod(1).
+ *
+ * \param timeout Longest time to wait, in milliseconds, or a negative
+ * number to wait as long as it takes
+ * \param latency If not NULL, this is set to the longest time the board
+ * can have been idle before this function noticed, in milliseconds
+ * \return A negative number is returned on failure or time out, and spinerr
+ * is set to a description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_wait_idle (double timeout, double *latency);
 /**
  * Read status message from the board. Not all boards support this, see your manual.
  * The returned string will either have the board's status or an error message
@@ -587,6 +1138,19 @@ SPINCORE_API int pb_inst_hs8(char* Flags, double length);
  * of the error. The number of clock cycles used is returned on success.
  */
 SPINCORE_API int pb_inst_hs24(char* Flags, double length);
+/**
+ *This function is for PBESR-PRO-II designs. It writes a whole list of
+ *instructions at once, which is much faster than calling pb_inst_hs8() or
+ *pb_inst_hs24() for each of them. All lengths are checked before anything
+ *is written to the board.
+ *\param num_bits 8 or 24, as for pb_inst_hs8() and pb_inst_hs24()
+ *\param flags Output pattern of each instruction. Bit n is Channel n.
+ *\param lengths Length of each instruction, in nanoseconds
+ *\param num_insts Number of instructions
+ *\return A negative number is returned on failure and spinerr is set to a description
+ * of the error. The total number of clock cycles used is returned on success.
+ */
+SPINCORE_API int pb_inst_hs_block(int num_bits, const int *flags, const double *lengths, int num_insts);
 
 //PTS related functions
 /*
@@ -980,6 +1544,18 @@ SPINCORE_API int pb_set_radio_control (unsigned int control);
  * description of the error. 0 is returned on success.
  */
 SPINCORE_API int pb_unset_radio_control (unsigned int control);
+/**
+ * SpinAPI keeps a copy of the control registers it writes, such as the one
+ * changed by pb_set_radio_control(), and uses it instead of reading them back
+ * from the board. This function discards that copy, so the next access reads
+ * the registers from the board again. pb_init() and pb_reset() do this
+ * automatically; call this function if the board was reset or reprogrammed
+ * any other way, for instance by another program.
+ *
+ * \return A negative number is returned on failure, and spinerr is set to a
+ * description of the error. 0 is returned on success.
+ */
+SPINCORE_API int pb_resync_registers (void);
 /*
  * The onboard ADC and DAC units have several control bits which can be used
  * to control their performance characteristics. For now, users should ignore
@@ -1054,6 +1630,16 @@ SPINCORE_API int pb_set_pulse_regs (unsigned int channel, double period, double
 				 int amp1, int dds_en1, int phase_reset1,
 				 int flags, int inst, int inst_data,
 				 double length);
+/**
+ * The same as pb_inst_dds2(), but the length is given as a number of clock
+ * cycles. See pb_inst_pbonly_cycles().
+ */
+  SPINCORE_API int pb_inst_dds2_cycles (int freq0, int phase0, int amp0,
+					int dds_en0, int phase_reset0,
+					int freq1, int phase1, int amp1,
+					int dds_en1, int phase_reset1,
+					int flags, int inst, int inst_data,
+					__int64 cycles);
 /**
  * Write an instruction that makes use of the pulse shape feature of the PBDDS-II-300 AWG boards. This adds two new parameters, use_shape0 and use_shape1, which control the shape features of the two DDS output channels. All other parameters are identical to the pb_inst_dds2() function. If you do not wish to use the shape feature, the pb_inst_dds2() function can be used instead.
  * \param use_shape0 Select whether or not to use shaped pulses for the first DDS-II channel. If this is 0, a regular non-shaped pulse (hard pulse) is output. If it is nonzero, the shaped pulse is used. The pulse shape waveform can be set using the pb_dds_load() function.
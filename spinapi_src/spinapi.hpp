@@ -0,0 +1,413 @@
+/**
+ * \file spinapi.hpp
+ * \brief C++ interface to the SpinAPI library.
+ *
+ * Board owns an initialized board and closes it when it goes out of scope.
+ * Program<Layout> builds a pulse program in its own buffer, from typed
+ * instructions (PulseInst, RadioInst, Dds2Inst) which are packed and encoded
+ * exactly as the pb_inst* functions do, using the layouts of
+ * spinapi_static.hpp. Building a program touches no global state, so
+ * programs for several boards can be built at the same time, in any thread.
+ * Only Board calls into the C library, which must not be used from several
+ * threads at once.
+ *
+ * \code
+ * spinapi::Board board (0, 500.0);
+ * spinapi::Program<spinapi::fixed::Pci80> prog (500.0, false);
+ *
+ * int start = prog.add (spinapi::PulseInst ().flags (0xF).length (100.0 * ns));
+ * prog.add (spinapi::PulseInst ().op (spinapi::Op::Branch, start).length (100.0 * ns));
+ * board.write (prog);
+ * board.start ();
+ * \endcode
+ *
+ * This header needs C++14.
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _SPINAPI_HPP
+#define _SPINAPI_HPP
+
+#include <stdexcept>
+#include <vector>
+
+#include "spinapi.h"
+#include "spinapi_static.hpp"
+
+namespace spinapi
+{
+  /** Thrown when a call into the C library fails, with the text of spinerr */
+  struct error:public std::runtime_error
+  {
+    explicit error (const char *what):std::runtime_error (what)
+    {
+    }
+  };
+
+  /** The opcodes of the PulseBlaster core */
+  enum class Op:int
+  {
+    Continue = CONTINUE,
+    Stop = STOP,
+    Loop = LOOP,
+    EndLoop = END_LOOP,
+    Jsr = JSR,
+    Rts = RTS,
+    Branch = BRANCH,
+    LongDelay = LONG_DELAY,
+    Wait = WAIT
+  };
+
+  /**
+   * \internal
+   * What every kind of instruction has: the opcode, its data and the length
+   */
+  template < class Derived > class InstBase
+  {
+  public:
+    /** Opcode and instruction data, as given to the pb_inst* functions */
+    constexpr Derived & op (Op inst, int inst_data = 0)
+    {
+      inst_ = (int) inst;
+      inst_data_ = inst_data;
+      return self ();
+    }
+    /** Length in nanoseconds; the units of spinapi.h can be used, e.g. 10.0 * us */
+    constexpr Derived & length (double length)
+    {
+      length_ = length;
+      return self ();
+    }
+
+  protected:
+    constexpr Derived & self ()
+    {
+      return static_cast < Derived & >(*this);
+    }
+
+    int inst_ = CONTINUE;
+    int inst_data_ = 0;
+    double length_ = 0.0;
+  };
+
+  /** An instruction of a PulseBlaster, as pb_inst_pbonly64() takes it */
+  class PulseInst:public InstBase < PulseInst >
+  {
+  public:
+    /** All output flags at once */
+    constexpr PulseInst & flags (unsigned long long flags)
+    {
+      flags_ = flags;
+      return *this;
+    }
+    /** Turn one output flag on or off */
+    constexpr PulseInst & flag (int bit, bool on = true)
+    {
+      flags_ = on ? flags_ | (1ull << bit) : flags_ & ~(1ull << bit);
+      return *this;
+    }
+
+    template < class Layout > constexpr fixed::Inst lower () const
+    {
+      return fixed::pbonly (flags_, inst_, inst_data_, length_);
+    }
+
+  private:
+    unsigned long long flags_ = 0;
+  };
+
+  /**
+   * An instruction of a RadioProcessor, as pb_inst_radio() takes it on boards
+   * without DDS shapes. On the DDS-I, it becomes a pb_inst_dds2() instruction
+   * of the first channel, as pb_inst_radio() does there. Boards with DDS
+   * shapes or a custom design use other flag bits, so Board::write() refuses
+   * them.
+   */
+  class RadioInst:public InstBase < RadioInst >
+  {
+  public:
+    constexpr RadioInst & freq (int reg) { freq_ = reg; return *this; }
+    constexpr RadioInst & cos_phase (int reg) { cos_phase_ = reg; return *this; }
+    constexpr RadioInst & sin_phase (int reg) { sin_phase_ = reg; return *this; }
+    constexpr RadioInst & tx_phase (int reg) { tx_phase_ = reg; return *this; }
+    constexpr RadioInst & tx (bool on) { tx_enable_ = on; return *this; }
+    constexpr RadioInst & phase_reset (bool on) { phase_reset_ = on; return *this; }
+    constexpr RadioInst & trigger_scan (bool on) { trigger_scan_ = on; return *this; }
+    constexpr RadioInst & flags (int flags) { flags_ = flags; return *this; }
+
+    template < class Layout > constexpr fixed::Inst lower () const
+    {
+      if (Layout::radio_via_dds2)
+	{
+	  return fixed::dds2 (freq_, tx_phase_, 0, tx_enable_, phase_reset_,
+			      0, 0, 0, 0, 0, flags_, inst_, inst_data_, length_);
+	}
+
+      return fixed::pbonly (((0x03u & sin_phase_) << 22) | ((0x03u & cos_phase_) << 20)
+			    | ((0x7Fu & tx_phase_) << 13) | ((0x01u & tx_enable_) << 12)
+			    | ((0x0Fu & freq_) << 8) | ((0x01u & trigger_scan_) << 7)
+			    | ((0x01u & phase_reset_) << 6) | (0x3Fu & flags_),
+			    inst_, inst_data_, length_);
+    }
+
+  private:
+    int freq_ = 0;
+    int cos_phase_ = 0;
+    int sin_phase_ = 0;
+    int tx_phase_ = 0;
+    bool tx_enable_ = false;
+    bool phase_reset_ = false;
+    bool trigger_scan_ = false;
+    int flags_ = 0;
+  };
+
+  /**
+   * An instruction of a DDS-II or DDS-I board, as pb_inst_dds2() takes it.
+   * The channel is 0 or 1.
+   */
+  class Dds2Inst:public InstBase < Dds2Inst >
+  {
+  public:
+    constexpr Dds2Inst & freq (int channel, int reg) { dds_[5 * channel] = reg; return *this; }
+    constexpr Dds2Inst & phase (int channel, int reg) { dds_[5 * channel + 1] = reg; return *this; }
+    constexpr Dds2Inst & amp (int channel, int reg) { dds_[5 * channel + 2] = reg; return *this; }
+    constexpr Dds2Inst & tx (int channel, bool on) { dds_[5 * channel + 3] = on; return *this; }
+    constexpr Dds2Inst & phase_reset (int channel, bool on) { dds_[5 * channel + 4] = on; return *this; }
+    constexpr Dds2Inst & flags (int flags) { flags_ = flags; return *this; }
+
+    template < class Layout > constexpr fixed::Inst lower () const
+    {
+      return fixed::dds2 (dds_[0], dds_[1], dds_[2], dds_[3], dds_[4],
+			  dds_[5], dds_[6], dds_[7], dds_[8], dds_[9],
+			  flags_, inst_, inst_data_, length_);
+    }
+
+  private:
+    int dds_[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    int flags_ = 0;
+  };
+
+  /**
+   * A pulse program being built for one firmware layout. Instructions are
+   * encoded as they are added, into a buffer owned by the program. add()
+   * only allocates when the buffer is full, so a program given enough room
+   * with the reserve argument of the constructor, and reused with clear(),
+   * is built without allocating. Past that, the buffer grows as a
+   * std::vector does.
+   *
+   * \tparam Layout One of the layouts of spinapi_static.hpp
+   */
+  template < class Layout > class Program
+  {
+  public:
+    /**
+     * \param clock Clock frequency of the PulseBlaster core, in MHz
+     * \param has_FF_fix true if the board does not need the "1FF" fix (see pb_bypass_FF_fix())
+     * \param reserve Number of instructions to make room for, which can
+     * then be added without allocating
+     */
+    explicit Program (double clock, bool has_FF_fix = true, int reserve = 0)
+      : clock_ (clock), has_FF_fix_ (has_FF_fix)
+    {
+      imw_.reserve ((size_t) reserve * Layout::imw_bytes);
+    }
+
+    /**
+     * Add an instruction. Jump targets are addresses returned by add().
+     *
+     * \return The address of the instruction
+     * \throw fixed::encode_error if the instruction does not fit the layout
+     */
+    template < class I > int add (const I & inst)
+    {
+      size_t at = imw_.size ();
+
+      imw_.resize (at + Layout::imw_bytes);
+      try
+      {
+	fixed::encode_inst < Layout > (inst.template lower < Layout > (),
+				       clock_ / 1000.0, has_FF_fix_, &imw_[at]);
+      }
+      catch ( ...)
+      {
+	imw_.resize (at);
+	throw;
+      }
+
+      return (int) (at / Layout::imw_bytes);
+    }
+
+    /** Remove all instructions, keeping the buffer */
+    void clear ()
+    {
+      imw_.clear ();
+    }
+
+    int num_insts () const
+    {
+      return (int) (imw_.size () / Layout::imw_bytes);
+    }
+    const unsigned char *imws () const
+    {
+      return imw_.data ();
+    }
+    double clock () const
+    {
+      return clock_;
+    }
+    bool has_FF_fix () const
+    {
+      return has_FF_fix_;
+    }
+
+  private:
+    std::vector < unsigned char >imw_;
+    double clock_;
+    bool has_FF_fix_;
+  };
+
+  /**
+   * An initialized board, which is closed again when the object is
+   * destroyed. Every call selects the board first, so several boards can be
+   * used side by side. A Board can be moved, but not copied.
+   */
+  class Board
+  {
+  public:
+    /**
+     * Initialize a board and set the clock frequency of its core.
+     *
+     * \param board_num Number of the board, see pb_select_board()
+     * \param clock Clock frequency of the PulseBlaster core, in MHz
+     */
+    Board (int board_num, double clock):board_num_ (board_num), clock_ (clock)
+    {
+      if (pb_select_board (board_num) < 0 || pb_init () != 0)
+	{
+	  throw error (pb_get_error ());
+	}
+      pb_core_clock (clock);
+    }
+
+    ~Board ()
+    {
+      release ();
+    }
+
+    Board (Board && other) noexcept:board_num_ (other.board_num_),
+      clock_ (other.clock_)
+    {
+      other.board_num_ = -1;
+    }
+
+    Board & operator= (Board && other) noexcept
+    {
+      if (this != &other)
+	{
+	  release ();
+	  board_num_ = other.board_num_;
+	  clock_ = other.clock_;
+	  other.board_num_ = -1;
+	}
+      return *this;
+    }
+
+    Board (const Board &) = delete;
+    Board & operator= (const Board &) = delete;
+
+    /** Write a pulse program to the board, see pb_write_imws() */
+    template < class Layout > void write (const Program < Layout > &prog)
+    {
+      select ();
+      check (pb_start_programming (PULSE_PROGRAM));
+      int return_value = pb_write_imws (Layout::name (), prog.clock (),
+					prog.has_FF_fix ()? 1 : 0,
+					prog.imws (), prog.num_insts ());
+      if (return_value != 0)
+	{
+	  error e (pb_get_error ());
+	  pb_stop_programming ();
+	  throw e;
+	}
+      check (pb_stop_programming ());
+    }
+
+    void start ()
+    {
+      select ();
+      check (pb_start ());
+    }
+    void stop ()
+    {
+      select ();
+      check (pb_stop ());
+    }
+    void reset ()
+    {
+      select ();
+      check (pb_reset ());
+    }
+
+    int board_num () const
+    {
+      return board_num_;
+    }
+    double clock () const
+    {
+      return clock_;
+    }
+
+  private:
+    // Close the board, unless it was moved away
+    void release ()
+    {
+      if (board_num_ >= 0 && pb_select_board (board_num_) >= 0)
+	{
+	  pb_close ();
+	}
+      board_num_ = -1;
+    }
+
+    void select () const
+    {
+      if (board_num_ < 0 || pb_select_board (board_num_) < 0)
+	{
+	  throw error ("Board has been moved or can not be selected");
+	}
+    }
+
+    static void check (int return_value)
+    {
+      if (return_value < 0)
+	{
+	  throw error (pb_get_error ());
+	}
+    }
+
+    int board_num_;
+    double clock_;
+  };
+}
+
+#endif /* #ifndef _SPINAPI_HPP */
@@ -0,0 +1,471 @@
+/**
+ * \file spinapi_static.hpp
+ * \brief Compile-time encoding of fixed pulse programs for C++ clients.
+ *
+ * A pulse program which never changes can be declared as a constexpr array of
+ * instructions and encoded into IMWs by the compiler, for the firmware layout,
+ * clock and "1FF" fix setting of the board it is meant for. Labels are
+ * resolved, and instructions which would not fit the layout (inst_data
+ * outside of 20 bits, flags wider than the layout, delays too short or too
+ * long) stop the compilation. At run time the IMWs are written with a single
+ * call to pb_write_imws(), which checks that the board matches.
+ *
+ * \code
+ * using namespace spinapi::fixed;
+ * enum { TOP = 1 };
+ * constexpr Inst seq[] = {
+ *   pbonly (0x1, CONTINUE, 0, 1000.0).label (TOP),
+ *   pbonly (0x2, LOOP, 1000, 500.0).label (2),
+ *   pbonly (0x0, END_LOOP, 0, 500.0).to (2),
+ *   pbonly (0x0, BRANCH, 0, 100.0).to (TOP),
+ * };
+ * static constexpr auto image = encode<Usb128, 100000> (seq);
+ *
+ * pb_start_programming (PULSE_PROGRAM);
+ * image.write ();
+ * pb_stop_programming ();
+ * \endcode
+ *
+ * This header needs C++14. Lengths longer than one instruction can hold must
+ * be made up with an explicit LONG_DELAY.
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _SPINAPI_STATIC_HPP
+#define _SPINAPI_STATIC_HPP
+
+#include <stddef.h>
+#include <stdexcept>
+
+#include "spinapi.h"
+
+namespace spinapi
+{
+  namespace fixed
+  {
+    // Where the "throw" in a constexpr function is reached, the compiler
+    // reports the expression as not constant, with the message below it.
+    struct encode_error:public std::logic_error
+    {
+      explicit encode_error (const char *what):std::logic_error (what)
+      {
+      }
+    };
+
+    /**
+     * One instruction of a fixed pulse program, as it would be given to
+     * pb_inst_pbonly64() or pb_inst_dds2(). Jump targets are label numbers
+     * until the program is encoded.
+     */
+    struct Inst
+    {
+      int kind;			/** 0 for pb_inst_pbonly64(), 1 for pb_inst_dds2() */
+      unsigned long long flags;	/** output flags */
+      int dds[10];		/** freq0, phase0, amp0, dds_en0, phase_reset0, freq1, phase1, amp1, dds_en1, phase_reset1 */
+      int inst;			/** opcode */
+      int inst_data;		/** instruction data, as given to the pb_inst* function */
+      double length;		/** length in ns */
+      int name;			/** label of this instruction, or 0 */
+      int jump;			/** label jumped to by BRANCH, JSR or END_LOOP, or 0 to use inst_data */
+
+      /** Give this instruction a label, so that jumps can refer to it */
+      constexpr Inst label (int label_name) const
+      {
+	Inst copy = *this;
+	copy.name = label_name > 0 ? label_name : throw encode_error ("Labels must be positive");
+	return copy;
+      }
+
+      /** Jump to the instruction with the given label */
+      constexpr Inst to (int label_name) const
+      {
+	Inst copy = *this;
+	copy.jump = label_name > 0 ? label_name : throw encode_error ("Labels must be positive");
+	return copy;
+      }
+    };
+
+    /** An instruction as pb_inst_pbonly64() takes it */
+    constexpr Inst pbonly (unsigned long long flags, int inst, int inst_data,
+			   double length)
+    {
+      return Inst { 0, flags, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, inst, inst_data,
+	  length, 0, 0 };
+    }
+
+    /** An instruction as pb_inst_dds2() takes it */
+    constexpr Inst dds2 (int freq0, int phase0, int amp0, int dds_en0,
+			 int phase_reset0, int freq1, int phase1, int amp1,
+			 int dds_en1, int phase_reset1, int flags, int inst,
+			 int inst_data, double length)
+    {
+      return Inst { 1, (unsigned int) flags, {freq0, phase0, amp0, dds_en0,
+	  phase_reset0, freq1, phase1, amp1, dds_en1, phase_reset1}, inst,
+	  inst_data, length, 0, 0 };
+    }
+
+    /**
+     * The firmware layouts. Each has the name of the encoder spinapi uses for
+     * it (checked by pb_write_imws()), the size of its IMW, and functions which
+     * place the flags and write the IMW exactly as encode.c does.
+     * radio_via_dds2 is set where pb_inst_radio() is turned into pb_inst_dds2().
+     */
+    struct LayoutBase
+    {
+      static constexpr bool radio_via_dds2 = false;
+      static constexpr void pack_dds2 (unsigned int *, const Inst & i)
+      {
+	if (i.kind != 0)
+	  throw encode_error ("This layout has no DDS channels");
+      }
+    };
+
+    /**
+     * \internal
+     * The opcode, data and delay fields of the PCI layouts, most significant
+     * byte first
+     */
+    constexpr void put_opcode_delay (unsigned char *imw, int inst,
+				     int inst_data, unsigned int delay)
+    {
+      unsigned int opcode = inst | (inst_data << 4);
+
+      imw[0] = (opcode >> 16) & 0xFF;
+      imw[1] = (opcode >> 8) & 0xFF;
+      imw[2] = opcode & 0xFF;
+      imw[3] = (delay >> 24) & 0xFF;
+      imw[4] = (delay >> 16) & 0xFF;
+      imw[5] = (delay >> 8) & 0xFF;
+      imw[6] = delay & 0xFF;
+    }
+
+    /**
+     * \internal
+     * The IMW of the boards using usb_method 2: 32 bit words, least
+     * significant word first, each stored least significant byte first as
+     * on the hosts spinapi runs on
+     */
+    constexpr void put_usb (unsigned char *imw, const unsigned int *w,
+			    int inst, int inst_data, unsigned int delay,
+			    int nwords)
+    {
+      unsigned int words[8] = {
+	delay,
+	(0xFu & inst) | ((0xFFFFFu & inst_data) << 4) | ((0xFFu & w[0]) << 24),
+	(0xFFFFFFu & (w[0] >> 8)) | ((w[1] & 0xFFu) << 24),
+	(0xFFFFFFu & (w[1] >> 8)) | ((w[2] & 0xFFu) << 24),
+	0, 0, 0, 0
+      };
+
+      for (int i = 0; i < nwords; i++)
+	{
+	  for (int j = 0; j < 4; j++)
+	    {
+	      imw[4 * i + j] = (words[i] >> (8 * j)) & 0xFF;
+	    }
+	}
+    }
+
+    /** 80 bit IMW of most PCI boards: 24 flag bits */
+    struct Pci80:LayoutBase
+    {
+      static constexpr const char *name () { return "PCI 80 bit"; }
+      static constexpr int imw_bytes = 10;
+      static constexpr unsigned long long flag_mask = 0xFFFFFFull;
+      static constexpr void pack_flags (unsigned int *) { }
+      static constexpr void serialize (unsigned char *imw, const unsigned int *w,
+				       int inst, int inst_data, unsigned int delay)
+      {
+	imw[0] = (w[0] >> 16) & 0xFF;
+	imw[1] = (w[0] >> 8) & 0xFF;
+	imw[2] = w[0] & 0xFF;
+	put_opcode_delay (imw + 3, inst, inst_data, delay);
+      }
+    };
+
+    /** 80 bit IMW of the SP16 designs 15-1 to 15-3, with flags 0 and 1 swapped */
+    struct Sp16:Pci80
+    {
+      static constexpr const char *name () { return "SP16 80 bit"; }
+      static constexpr void pack_flags (unsigned int *w)
+      {
+	w[0] = (w[0] & 0xFFFFFFFCu) + ((w[0] & 0x01) << 1) + ((w[0] & 0x02) >> 1);
+	w[1] = 0;
+      }
+    };
+
+    /** 88 bit IMW of RadioProcessor 10-19 and 12-16: 32 flag bits */
+    struct Pci88:LayoutBase
+    {
+      static constexpr const char *name () { return "PCI 88 bit"; }
+      static constexpr int imw_bytes = 11;
+      static constexpr unsigned long long flag_mask = 0xFFFFFFFFull;
+      static constexpr void pack_flags (unsigned int *) { }
+      static constexpr void serialize (unsigned char *imw, const unsigned int *w,
+				       int inst, int inst_data, unsigned int delay)
+      {
+	imw[0] = (w[0] >> 24) & 0xFF;
+	imw[1] = (w[0] >> 16) & 0xFF;
+	imw[2] = (w[0] >> 8) & 0xFF;
+	imw[3] = w[0] & 0xFF;
+	put_opcode_delay (imw + 4, inst, inst_data, delay);
+      }
+    };
+
+    /** 64 bit IMW of PulseBlasterESR 9-8: 8 flag bits */
+    struct Pci64:LayoutBase
+    {
+      static constexpr const char *name () { return "PCI 64 bit"; }
+      static constexpr int imw_bytes = 8;
+      static constexpr unsigned long long flag_mask = 0xFFull;
+      static constexpr void pack_flags (unsigned int *) { }
+      static constexpr void serialize (unsigned char *imw, const unsigned int *w,
+				       int inst, int inst_data, unsigned int delay)
+      {
+	imw[0] = w[0] & 0xFF;
+	put_opcode_delay (imw + 1, inst, inst_data, delay);
+      }
+    };
+
+    /** 128 bit IMW of the USB PulseBlasters: 64 flag bits */
+    struct Usb128:LayoutBase
+    {
+      static constexpr const char *name () { return "USB 128 bit"; }
+      static constexpr int imw_bytes = 16;
+      static constexpr unsigned long long flag_mask = ~0ull;
+      static constexpr void pack_flags (unsigned int *) { }
+      static constexpr void serialize (unsigned char *imw, const unsigned int *w,
+				       int inst, int inst_data, unsigned int delay)
+      {
+	put_usb (imw, w, inst, inst_data, delay, 4);
+      }
+    };
+
+    /** PulseBlasterDDS-II 14-1 and 14-2 */
+    struct DdsII:Usb128
+    {
+      static constexpr const char *name () { return "DDS-II"; }
+      static constexpr void pack_dds2 (unsigned int *w, const Inst & i)
+      {
+	w[0] = (i.flags & 0xFFF) | ((i.dds[3] & 0x1u) << 12) | ((i.dds[8] & 0x1u) << 13)
+	  | ((i.dds[4] & 0x1u) << 14) | ((i.dds[9] & 0x1u) << 15)
+	  | ((i.dds[0] & 0xFu) << 16) | ((i.dds[5] & 0xFu) << 20)
+	  | ((i.dds[1] & 0x7u) << 24) | ((i.dds[6] & 0x7u) << 27) | ((i.dds[2] & 0x3u) << 30);
+	w[1] = i.dds[7] & 0x3u;
+	w[2] = 0;
+      }
+    };
+
+    /** PulseBlasterDDS-I-300 12-19, which has one DDS channel */
+    struct DdsI:Usb128
+    {
+      static constexpr const char *name () { return "DDS-I"; }
+      static constexpr bool radio_via_dds2 = true;
+      static constexpr void pack_dds2 (unsigned int *w, const Inst & i)
+      {
+	w[0] = (i.flags & 0xF) | ((i.dds[3] & 0x1u) << 4) | ((i.dds[4] & 0x1u) << 5)
+	  | ((i.dds[0] & 0x3FFu) << 6) | ((i.dds[1] & 0x7Fu) << 16) | ((i.dds[2] & 0x1FFu) << 23);
+	w[1] = (i.dds[2] & 0x200u) >> 9;
+	w[2] = 0;
+      }
+    };
+
+    /** PulseBlasterDDS-II 14-3, with a 256 bit IMW */
+    struct DdsII_14_3:Usb128
+    {
+      static constexpr const char *name () { return "DDS-II 14-3"; }
+      static constexpr int imw_bytes = 32;
+      static constexpr void pack_dds2 (unsigned int *w, const Inst & i)
+      {
+	w[0] = (i.flags & 0xF) | ((i.dds[3] & 0x1u) << 4) | ((i.dds[8] & 0x1u) << 5)
+	  | ((i.dds[4] & 0x1u) << 6) | ((i.dds[9] & 0x1u) << 7)
+	  | ((i.dds[0] & 0x3FFu) << 8) | ((i.dds[5] & 0x3FFu) << 18) | ((i.dds[1] & 0xFu) << 28);
+	w[1] = ((i.dds[1] & 0x70u) >> 4) | ((i.dds[6] & 0x7Fu) << 3)
+	  | ((i.dds[2] & 0x3FFu) << 10) | ((i.dds[7] & 0x3FFu) << 20);
+	w[2] = 0;
+      }
+      static constexpr void serialize (unsigned char *imw, const unsigned int *w,
+				       int inst, int inst_data, unsigned int delay)
+      {
+	put_usb (imw, w, inst, inst_data, delay, 8);
+      }
+    };
+
+    /** The IMWs of a fixed pulse program, ready to be written to the board */
+    template < class Layout, unsigned long ClockKHz, bool HasFFFix, size_t N >
+      struct Image
+    {
+      unsigned char imw[N * Layout::imw_bytes];
+
+      static constexpr int num_insts = (int) N;
+
+      /**
+       * Write the IMWs with pb_write_imws(), between
+       * pb_start_programming(PULSE_PROGRAM) and pb_stop_programming().
+       */
+      int write () const
+      {
+	return pb_write_imws (Layout::name (), ClockKHz / 1000.0, HasFFFix ? 1 : 0,
+			      imw, (int) N);
+      }
+    };
+
+    /**
+     * \internal
+     * Round to the nearest integer, halfway cases to even, as rint() does
+     */
+    constexpr long long round_even (double x)
+    {
+      long long i = (long long) x;
+      if ((double) i > x)
+	i--;
+      double frac = x - (double) i;
+
+      if (frac > 0.5 || (frac == 0.5 && (i & 1)))
+	i++;
+      return i;
+    }
+
+    /**
+     * \internal
+     * The delay field of an instruction, as pb_inst_pbonly64() calculates it
+     */
+    constexpr unsigned int delay_field (double length, double pb_clock,
+					bool fix)
+    {
+      long long cycles = round_even (length * pb_clock - 3.0) + 3;
+
+      if (cycles < 5)
+	throw encode_error ("Instruction delay is too small to work with your board");
+      if (cycles > 0xFFFFFFFFLL + 3)
+	throw encode_error ("Instruction delay is too long for a single instruction, use a LONG_DELAY");
+
+      unsigned int delay = (unsigned int) (cycles - 3);
+
+      // The PB Core "1FF" fix, see pb_bypass_FF_fix()
+      if (fix && (delay & 0xFF) == 0xFF && delay > 0xFF)
+	delay--;
+      return delay;
+    }
+
+    /**
+     * Encode one instruction for a firmware layout. Jump targets must already
+     * be addresses. encode() does this for every instruction of a program,
+     * and it works the same way at run time.
+     *
+     * \param pb_clock Clock frequency of the PulseBlaster core, in GHz
+     * \param has_FF_fix true if the board does not need the "1FF" fix (see pb_bypass_FF_fix())
+     * \param imw Where the Layout::imw_bytes bytes of the IMW are written
+     */
+    template < class Layout >
+      constexpr void encode_inst (const Inst & i, double pb_clock,
+				  bool has_FF_fix, unsigned char *imw)
+    {
+      unsigned int w[3] = { 0, 0, 0 };
+      int inst_data = i.inst_data;
+      bool fix = false;
+
+      if (i.inst < 0 || i.inst > 8)
+	throw encode_error ("Invalid opcode");
+
+      if (i.inst == LOOP)
+	{
+	  if (inst_data < 1)
+	    throw encode_error ("Number of loops must be 1 or more");
+	  inst_data -= 1;
+	}
+      if (i.inst == LONG_DELAY)
+	{
+	  if (inst_data < 2)
+	    throw encode_error ("Number of repetitions must be 2 or more");
+	  inst_data -= 2;
+	}
+      if (inst_data != (inst_data & 0xFFFFF))
+	throw encode_error ("Instruction is limited to 20 bits");
+
+      if (i.kind == 0)
+	{
+	  if (i.flags & ~Layout::flag_mask)
+	    throw encode_error ("Flag word is wider than the layout");
+	  w[0] = (unsigned int) (i.flags & 0xFFFFFFFF);
+	  w[1] = (unsigned int) (i.flags >> 32);
+	  Layout::pack_flags (w);
+	  fix = !has_FF_fix;
+	}
+      else
+	{
+	  Layout::pack_dds2 (w, i);
+	}
+
+      Layout::serialize (imw, w, i.inst, inst_data,
+			 delay_field (i.length, pb_clock, fix));
+    }
+
+    /**
+     * Encode a fixed pulse program for a firmware layout.
+     *
+     * \tparam Layout One of Pci80, Sp16, Pci88, Pci64, Usb128, DdsII, DdsI, DdsII_14_3
+     * \tparam ClockKHz Clock frequency of the PulseBlaster core, in kHz
+     * \tparam HasFFFix true if the board does not need the "1FF" fix (see pb_bypass_FF_fix())
+     */
+    template < class Layout, unsigned long ClockKHz, bool HasFFFix = true,
+      size_t N > constexpr Image < Layout, ClockKHz, HasFFFix, N >
+      encode (const Inst (&prog)[N])
+    {
+      Image < Layout, ClockKHz, HasFFFix, N > image {
+      };
+
+      for (size_t k = 0; k < N; k++)
+	{
+	  Inst i = prog[k];
+
+	  if (i.jump)
+	    {
+	      if (i.inst != BRANCH && i.inst != JSR && i.inst != END_LOOP)
+		throw encode_error ("Only BRANCH, JSR and END_LOOP can jump to a label");
+
+	      i.inst_data = -1;
+	      for (size_t t = 0; t < N; t++)
+		{
+		  if (prog[t].name == i.jump)
+		    {
+		      if (i.inst_data >= 0)
+			throw encode_error ("Label is used twice");
+		      i.inst_data = (int) t;
+		    }
+		}
+	      if (i.inst_data < 0)
+		throw encode_error ("Label is not defined");
+	    }
+
+	  encode_inst < Layout > (i, ClockKHz / 1000000.0, HasFFFix,
+				  image.imw + k * Layout::imw_bytes);
+	}
+
+      return image;
+    }
+  }
+}
+
+#endif /* #ifndef _SPINAPI_STATIC_HPP */
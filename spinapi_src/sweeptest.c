@@ -0,0 +1,159 @@
+/* sweeptest.c
+ *
+ * This program runs an arrayed experiment with pb_run_sweep() on a
+ * RadioProcessor, with every point the same, and checks that each point gets
+ * its own data: the scan counter only holds the scans of the last point, and
+ * no point has grown by the data of the ones before it.
+ *
+ * This code is used for our own internal debugging procedures. It is of no use to customers.
+ *
+ * Build it against the library sources, e.g.
+ *   gcc -o sweeptest sweeptest.c <spinapi objects> -lusb -lm
+ *
+ * $Date: 2011/09/13 18:29:51 $
+ *
+ * To get the latest version of this code, or to contact us for support, please
+ * visit http://www.spincore.com
+ */
+
+/* Copyright (c) 2011 SpinCore Technologies, Inc.
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be appreciated
+ * but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "spinapi.h"
+
+#define ADC_FREQUENCY 75.0	// MHz
+#define SPECTRAL_WIDTH 0.1	// MHz
+#define NUM_SCANS 4
+#define NUM_POINTS 8
+#define NUM_FID_POINTS 1024
+
+// A point holding the data of the ones before it as well would be about
+// (point + 1) times as large as the first one
+#define MAX_RATIO 1.5
+
+#define NO_TRIGGER 0
+#define DO_TRIGGER 1
+
+static double
+mean_magnitude (const int *real, const int *imag)
+{
+  double sum = 0.0;
+  int i;
+
+  for (i = 0; i < NUM_FID_POINTS; i++)
+    {
+      sum += sqrt ((double) real[i] * real[i] + (double) imag[i] * imag[i]);
+    }
+
+  return sum / NUM_FID_POINTS;
+}
+
+int
+main ()
+{
+  static int real[NUM_POINTS * NUM_FID_POINTS];
+  static int imag[NUM_POINTS * NUM_FID_POINTS];
+  double values[NUM_POINTS];
+  double first, mag;
+  double acq_time;
+  PB_SWEEP_PARAM param;
+  int dec_amount;
+  int start;
+  int scans;
+  int failed = 0;
+  int i;
+
+  if (pb_init ())
+    {
+      printf ("Error initializing board: %s\n", pb_get_error ());
+      return -1;
+    }
+
+  pb_set_defaults ();
+  pb_set_clock (ADC_FREQUENCY);
+  pb_overflow (1, 0);
+
+  dec_amount = pb_setup_filters (SPECTRAL_WIDTH, NUM_SCANS, 0);
+  if (dec_amount <= 0)
+    {
+      printf ("Error setting up the filters: %s\n", pb_get_error ());
+      pb_close ();
+      return -1;
+    }
+  pb_set_num_points (NUM_FID_POINTS);
+
+  acq_time = 1e9 * NUM_FID_POINTS * dec_amount / (ADC_FREQUENCY * 1e6);	// ns
+
+  // NUM_SCANS acquisitions with nothing transmitted, the sweep changes the
+  // length of the acquisition (to the same value each time)
+  pb_start_programming (PULSE_PROGRAM);
+  start = pb_inst_radio (0, 0, 0, 0, 0, 0, NO_TRIGGER, 0, LOOP, NUM_SCANS, 1.0 * us);
+  param.target = pb_inst_radio (0, 0, 0, 0, 0, 0, DO_TRIGGER, 0, CONTINUE, 0, acq_time);
+  pb_inst_radio (0, 0, 0, 0, 0, 0, NO_TRIGGER, 0, END_LOOP, start, 1.0 * us);
+  pb_inst_radio (0, 0, 0, 0, 0, 0, NO_TRIGGER, 0, STOP, 0, 1.0 * us);
+  if (param.target < 0 || pb_stop_programming () != 0)
+    {
+      printf ("Error writing the pulse program: %s\n", pb_get_error ());
+      pb_close ();
+      return -1;
+    }
+
+  param.device = PULSE_PROGRAM;
+  for (i = 0; i < NUM_POINTS; i++)
+    {
+      values[i] = acq_time;
+    }
+
+  if (pb_run_sweep (1, &param, NUM_POINTS, values, NUM_FID_POINTS, real, imag,
+		    NULL) != 0)
+    {
+      printf ("Error running the sweep: %s\n", pb_get_error ());
+      pb_close ();
+      return -1;
+    }
+
+  scans = pb_scan_count (0);
+  if (scans >= 0 && scans != NUM_SCANS)
+    {
+      printf ("Scan counter is %d after the sweep, expected %d\n", scans,
+	      NUM_SCANS);
+      failed = 1;
+    }
+
+  first = mean_magnitude (real, imag);
+  for (i = 1; i < NUM_POINTS; i++)
+    {
+      mag = mean_magnitude (real + i * NUM_FID_POINTS, imag + i * NUM_FID_POINTS);
+      if (mag > MAX_RATIO * first)
+	{
+	  printf ("Point %d is %.2f times as large as point 0\n", i,
+		  first > 0.0 ? mag / first : 0.0);
+	  failed = 1;
+	}
+    }
+
+  pb_close ();
+
+  printf (failed ? "FAILED\n" : "OK\n");
+  return failed ? -1 : 0;
+}
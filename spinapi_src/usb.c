@@ -98,28 +98,66 @@ usb_write_address (int addr)
     return 0;
 }
 
+/**
+ * \internal
+ * Queue num_bytes of data for EP2OUT straight from the caller's buffer, in
+ * transfers as large as the driver allows. The transfers are split into 512
+ * byte packets on the wire either way, so the board sees the same packets as
+ * it would from 512 byte transfers. On failure, this waits for whatever was
+ * queued before returning.
+ */
+static int
+submit_ep2 (char *data, int num_bytes)
+{
+  int xfer_size = os_usb_max_xfer_size (cur_dev) / 512 * 512;
+  int n;
+
+  if (xfer_size < 512)
+    xfer_size = 512;
+
+  while (num_bytes > 0)
+    {
+      n = num_bytes < xfer_size ? num_bytes : xfer_size;
+
+      if (os_usb_submit (cur_dev, EP2OUT, data, n) < 0)
+	{
+	  os_usb_wait (cur_dev, EP2OUT);
+	  return -1;
+	}
+
+      data += n;
+      num_bytes -= n;
+    }
+
+  return 0;
+}
+
 int
 usb_write_data (int *data, int nData)
 {
   char *data_buf = (char *) data;
-
   int num_bytes;
-  int num_xfers;
-  int excess_xfer;
-  int i = 0;
 
   num_bytes = nData * sizeof (int);
-  num_xfers = (int) (num_bytes / 512);
-  excess_xfer = num_bytes - 512 * num_xfers;
 
-  for (i = 0; i < num_xfers; ++i)
-    if (os_usb_write (cur_dev, EP2OUT, data_buf + 512 * i, 512) < 0)
-      return -1;
+  // The address must have reached the board before the data does. After
+  // that, all of the transfers can be on the wire at once.
+  if (os_usb_wait (cur_dev, 0) < 0)
+    return -1;
 
-  if (os_usb_write (cur_dev, EP2OUT, data_buf + 512 * i, excess_xfer) < 0)
+  if (submit_ep2 (data_buf, num_bytes) < 0)
     return -1;
 
-  return 0;
+  // Data which fills whole packets has always been followed by a zero
+  // length transfer, so keep sending it
+  if (num_bytes % 512 == 0
+      && os_usb_submit (cur_dev, EP2OUT, data_buf + num_bytes, 0) < 0)
+    {
+      os_usb_wait (cur_dev, EP2OUT);
+      return -1;
+    }
+
+  return os_usb_wait (cur_dev, EP2OUT);
 }
 
 int
@@ -183,135 +221,223 @@ usb_read_reg (unsigned int addr, unsigned int *data)
 
 
 /**
- * \internal 
- * This function actually does the ram reads. Before it starts reading, it starts the watchdog timer.
- * Then after every call to os_usb_read(), we check to see if the watchdog timer ran out. If it has,
- * that means that the transfer timed out, and we must restart the entire transfer. The watchdog
- * timer code will reset the endpoints automatically on a timeout. FYI, if the transfer times out
- * and we DONT have a way to automaitally reset it, the only way the use can recover is by cycling
- * the power on their board.
- * 
- * (note: I am not sure why these timeouts occur, and whether it is a problem with our firmware, with
- * spinapi, with the Cypress drivers, or something else)
- * 
+ * \internal
+ * Queue count data RAM blocks: each one is requested with a command on
+ * EP1OUT and read from EP6IN into the matching 512 byte buffer. On failure,
+ * this waits for whatever was queued before returning.
  */
-int
-usb_read_ram (unsigned int bank, unsigned int start_addr, unsigned int len,
-		 char *data)
+static int
+queue_read_blocks (char *cmd, char (*inbuf)[512], int count)
 {
-  char inbuf[512];
   int i;
 
-  char *ptr;
+  for (i = 0; i < count; i++)
+    {
+      // no reset, address register enable is disabled
+      if (os_usb_submit (cur_dev, EP1OUT, cmd, 1) < 0
+	  || os_usb_submit (cur_dev, EP6IN, inbuf[i], 512) < 0)
+	{
+	  os_usb_wait (cur_dev, 0);
+	  return -1;
+	}
+    }
 
-  char buf[3];
+  return 0;
+}
 
-  int num_xfers;
-  int excess_xfer;
-  int xfer_size;
-  int line_size;
+/**
+ * \internal
+ * Copy the part of the data RAM contents held in the given block to data,
+ * or decode it into real_data and imag_data if data is NULL. The first two
+ * blocks read are stale, and the first line of the third is skipped, so the
+ * requested len bytes start 8 bytes into block 2.
+ */
+static void
+take_block (int block, const char *inbuf, int len, char *data,
+	    int *real_data, int *imag_data)
+{
+  int block_start = (block - 2) * 512;
+  int from = block_start > 8 ? block_start : 8;
+  int to = block_start + 512 < len + 8 ? block_start + 512 : len + 8;
+  const char *line;
+  int i;
 
-  int amount_xferred = 0;
+  if (block < 2 || from >= to)
+    return;
 
-  switch (bank)
+  if (data)
     {
-    case BANK_DATARAM:
-      line_size = 8;
-      xfer_size = 512;
-      usb_write_reg (0x0012, start_addr);
-      break;
-    case BANK_DDSRAM:
-      debug ("usb_read_ram: DDRSRAM is write only\n");
-      return -1;
-      break;
-    default:
-      debug ("usb_read_ram: invalid RAM bank\n");
-      return -1;
-      break;
+      memcpy (data + from - 8, inbuf + from - block_start, to - from);
+      return;
     }
 
-  num_xfers = (len + line_size) / xfer_size;
-  excess_xfer = (len + line_size) - num_xfers * xfer_size;
-
-  if (len % line_size != 0)
+  for (i = from; i < to; i += 8)
     {
-      debug ("usb_read_ram: length is not multiple of line size\n");
-      return -1;
+      line = inbuf + i - block_start;
+
+      real_data[i / 8 - 1] = (0x0FF & line[0]);
+      real_data[i / 8 - 1] |= (0x0FF & line[1]) << 8;
+      real_data[i / 8 - 1] |= (0x0FF & line[2]) << 16;
+      real_data[i / 8 - 1] |= (0x0FF & line[3]) << 24;
+
+      imag_data[i / 8 - 1] = (0x0FF & line[4]);
+      imag_data[i / 8 - 1] |= (0x0FF & line[5]) << 8;
+      imag_data[i / 8 - 1] |= (0x0FF & line[6]) << 16;
+      imag_data[i / 8 - 1] |= (0x0FF & line[7]) << 24;
     }
+}
 
-  buf[2] = (xfer_size >> 8) & 0x0FF;
-  buf[1] = xfer_size & 0x0FF;
-  buf[0] = RST_L | DO_LITE;
+/**
+ * \internal
+ * Read len bytes of the data RAM, starting at line start_addr, into data,
+ * or decode them into real_data and imag_data if data is NULL. The blocks
+ * are requested in batches of USB_READ_BLOCKS: while one batch is being
+ * taken apart, the next one is already on the wire.
+ */
+static int
+read_dataram (unsigned int start_addr, unsigned int len, char *data,
+	      int *real_data, int *imag_data)
+{
+  char inbuf[2][USB_READ_BLOCKS][512];
+  char cmd[3];
+  int num_blocks;
+  int first = 0;
+  int count;
+  int half = 0;
+  int i;
+  unsigned int dummy;
+
+  // Two stale blocks, then enough to hold the skipped first line and the data
+  num_blocks = 2 + (len + 8 + 511) / 512;
+
+  cmd[2] = (512 >> 8) & 0x0FF;
+  cmd[1] = 512 & 0x0FF;
+  cmd[0] = RST_L | DO_LITE;
 
-  ptr = data;
+  usb_write_reg (0x0012, start_addr);
 
   // setup transfer to work on dataram
-  setup_xfer (bank, xfer_size);
+  if (setup_xfer (BANK_DATARAM, 512) < 0)
+    return -1;
 
-  for (i = 0; i < num_xfers + 2; i++)
+  count = num_blocks < USB_READ_BLOCKS ? num_blocks : USB_READ_BLOCKS;
+  if (queue_read_blocks (cmd, inbuf[half], count) < 0)
     {
+      debug ("read_dataram: read not successful (block 0)\n");
+      return -1;
+    }
 
-      if (os_usb_write (cur_dev, EP1OUT, buf, 1) < 0)	// no reset, address register enable is disabled
-        return -1;
-
-      if (os_usb_read (cur_dev, EP6IN, inbuf, xfer_size) < 0)
+  while (first < num_blocks)
+    {
+      if (os_usb_wait (cur_dev, 0) < 0)
 	{
-	  debug ("usb_read_ram: read not successful (xfer %d)\n", i);
+	  debug ("read_dataram: read not successful (block %d)\n", first);
 	  return -1;
 	}
 
-      if (i == 0 || i == 1)
+      // Get the next batch going before taking this one apart
+      if (first + count < num_blocks)
 	{
-	  continue;
+	  i = num_blocks - first - count;
+	  if (queue_read_blocks (cmd, inbuf[!half],
+				 i < USB_READ_BLOCKS ? i : USB_READ_BLOCKS) < 0)
+	    {
+	      debug ("read_dataram: read not successful (block %d)\n",
+		     first + count);
+	      return -1;
+	    }
 	}
 
-      // on the first real transfer, skip the first line
-      if (i == 2)
+      for (i = 0; i < count; i++)
 	{
-	  memcpy (ptr, inbuf + line_size, xfer_size - line_size);
-	  ptr += xfer_size - line_size;
-	}
-      else
-	{
-	  memcpy (ptr, inbuf, xfer_size);
-	  ptr += xfer_size;
+	  take_block (first + i, inbuf[half][i], len, data, real_data,
+		      imag_data);
 	}
 
+      first += count;
+      count = num_blocks - first < USB_READ_BLOCKS ?
+	num_blocks - first : USB_READ_BLOCKS;
+      half = !half;
     }
 
-  // if there is excess left to read, read an entire xfer_size block, but only
-  // copy the part we want
-  if (excess_xfer != 0)
+  // read two more times to clear out the buffer
+  if (os_usb_read (cur_dev, EP6IN, inbuf[0][0], 512) < 0)
     {
-      if (os_usb_write (cur_dev, EP1OUT, buf, 1) < 0)	// no reset, address register enable is disabled
-        return -1;
-
-      if (os_usb_read (cur_dev, EP6IN, inbuf, xfer_size) < 0)
-	{
-	  debug ("usb_read_ram: read not successful (excess)\n");
-	  return -1;
-	}
+      debug ("read_dataram: read not successful (clear 1)\n");
+      return -1;
+    }
 
-      memcpy (ptr, inbuf, excess_xfer);
+  if (os_usb_read (cur_dev, EP6IN, inbuf[0][0], 512) < 0)
+    {
+      debug ("read_dataram: read not successful (clear 2)\n");
+      return -1;
     }
 
-  // read two more times to clear out the buffer
-  if (os_usb_read (cur_dev, EP6IN, inbuf, xfer_size) < 0)
+  // These must reach the board, so they bypass the register shadow
+  usb_read_reg (REG_CONTROL, &dummy);
+  usb_read_reg (REG_CONTROL, &dummy);
+
+  return 0;
+}
+
+/**
+ * \internal 
+ * This function actually does the ram reads. Before it starts reading, it starts the watchdog timer.
+ * Then after every call to os_usb_read(), we check to see if the watchdog timer ran out. If it has,
+ * that means that the transfer timed out, and we must restart the entire transfer. The watchdog
+ * timer code will reset the endpoints automatically on a timeout. FYI, if the transfer times out
+ * and we DONT have a way to automaitally reset it, the only way the use can recover is by cycling
+ * the power on their board.
+ * 
+ * (note: I am not sure why these timeouts occur, and whether it is a problem with our firmware, with
+ * spinapi, with the Cypress drivers, or something else)
+ * 
+ */
+int
+usb_read_ram (unsigned int bank, unsigned int start_addr, unsigned int len,
+		 char *data)
+{
+  switch (bank)
     {
-      debug ("usb_read_ram: read not successful (clear 1)\n");
+    case BANK_DATARAM:
+      break;
+    case BANK_DDSRAM:
+      debug ("usb_read_ram: DDRSRAM is write only\n");
       return -1;
+      break;
+    default:
+      debug ("usb_read_ram: invalid RAM bank\n");
+      return -1;
+      break;
     }
 
-  if (os_usb_read (cur_dev, EP6IN, inbuf, xfer_size) < 0)
+  if (len % 8 != 0)
     {
-      debug ("usb_read_ram: read not successful (clear 2)\n");
+      debug ("usb_read_ram: length is not multiple of line size\n");
       return -1;
     }
 
-  reg_read (REG_CONTROL);
-  reg_read (REG_CONTROL);
+  return read_dataram (start_addr, len, data, NULL, NULL);
+}
 
-  return amount_xferred;
+/**
+ * \internal
+ * Read num_points complex points from the data RAM, starting at point
+ * start_addr, and store them straight into real_data and imag_data. This
+ * is usb_read_ram() without the intermediate byte buffer.
+ */
+int
+usb_read_points (unsigned int start_addr, int num_points, int *real_data,
+		 int *imag_data)
+{
+  if (num_points < 0)
+    {
+      debug ("usb_read_points: invalid number of points\n");
+      return -1;
+    }
+
+  return read_dataram (start_addr, num_points * 8, NULL, real_data,
+		       imag_data);
 }
 
 /**
@@ -323,14 +449,8 @@ int
 usb_write_ram (unsigned int bank, unsigned int start_addr, unsigned int len,
 	       char *data)
 {
-  char *outbuf;
-  int i;
-  char *ptr;
-
-  int num_xfers;
   int xfer_size;
   int line_size;
-  int excess_xfer;
 
   switch (bank)
     {
@@ -350,57 +470,23 @@ usb_write_ram (unsigned int bank, unsigned int start_addr, unsigned int len,
       return -1;
     }
 
-
-  num_xfers = len / xfer_size;
-  excess_xfer = len - num_xfers * xfer_size;
-
   if (len % line_size != 0)
     {
       debug ("usb_write_ram: length is not multiple of line size\n");
       return -1;
     }
 
-  outbuf = (char *) malloc (xfer_size);
-
-  if (!outbuf)
-    {
-      debug ("usb_write_ram: couldnt allocate scratchpad memory\n");
-      return -1;
-    }
-
-  ptr = data;
-
   // setup transfer to work on pbram
-  setup_xfer (bank, xfer_size);
-
-  for (i = 0; i < num_xfers; i++)
-    {
-
-      memcpy (outbuf, ptr, xfer_size);
-
-      if (os_usb_write (cur_dev, EP2OUT, outbuf, xfer_size) < 0)
-	{
-	  debug ("write not succesfful (xfer %d)\n", i);
-	  return -1;
-	}
-
-      ptr += xfer_size;
-    }
+  if (setup_xfer (bank, xfer_size) < 0)
+    return -1;
 
-  if (excess_xfer != 0)
+  if (submit_ep2 (data, len) < 0)
     {
-      memcpy (outbuf, ptr, excess_xfer);
-      if (os_usb_write (cur_dev, EP2OUT, outbuf, excess_xfer) < 0)
-	{
-	  debug ("write not succesfful (excess xfer)\n");
-	  return -1;
-	}
+      debug ("usb_write_ram: write not successful\n");
+      return -1;
     }
 
-
-  free (outbuf);
-
-  return 0;
+  return os_usb_wait (cur_dev, EP2OUT);
 }
 
 /**
@@ -497,3 +583,56 @@ usb_do_outp (unsigned int address, char data)
 
   return 0;
 }
+
+/**
+ * \internal
+ * Write a block of bytes to one address of the PulseBlaster core. This has
+ * the same effect as calling usb_do_outp() for each byte, but the transfer to
+ * the REG_PBCORE register is set up only once, and the register words for all
+ * of the bytes are then streamed to it.
+ * 
+ */
+int
+usb_do_outp_block (unsigned int address, const char *data, int len)
+{
+  unsigned int words[2 * PBCORE_STREAM_BYTES];
+  unsigned int load_flag = 0x01 << 11;
+  unsigned int word;
+  int n;
+  int i;
+
+  if (len <= 0)
+    return 0;
+
+  if (setup_xfer (REG_PBCORE, 4) < 0)
+    {
+      spinerr = "Error setting up transfer";
+      debug ("usb_do_outp_block: %s\n", spinerr);
+      return -1;
+    }
+
+  while (len > 0)
+    {
+      n = len < PBCORE_STREAM_BYTES ? len : PBCORE_STREAM_BYTES;
+
+      // Each byte is latched by writing it again with the load flag set
+      for (i = 0; i < n; i++)
+	{
+	  word = (0x0FF & data[i]) | ((0x07 & address) << 8);
+	  words[2 * i] = word;
+	  words[2 * i + 1] = word | load_flag;
+	}
+
+      if (usb_write_data ((int *) words, 2 * n) < 0)
+	{
+	  spinerr = "Error doing write";
+	  debug ("usb_do_outp_block: %s\n", spinerr);
+	  return -1;
+	}
+
+      data += n;
+      len -= n;
+    }
+
+  return 0;
+}
@@ -35,6 +35,8 @@ int usb_write_reg (unsigned int addr, unsigned int data);
 int usb_read_reg (unsigned int addr, unsigned int *data);
 int usb_read_ram (unsigned int bank, unsigned int start_addr,
 		  unsigned int len, char *data);
+int usb_read_points (unsigned int start_addr, int num_points, int *real_data,
+		     int *imag_data);
 int usb_write_ram (unsigned int bank, unsigned int start_addr,
 		   unsigned int len, char *data);
 int usb_write_address (int addr);
@@ -43,6 +45,7 @@ int usb_write_data (int *data, int nData);
 void usb_set_device (int board_num);
 
 int usb_do_outp (unsigned int address, char data);
+int usb_do_outp_block (unsigned int address, const char *data, int len);
 
 int usb_reset_gpif (int dev_num);
 
@@ -59,6 +62,13 @@ int usb_reset_gpif (int dev_num);
 #define DO_LITE 0x02
 #define DO_HEAVY 0x01
 
+// Number of bytes usb_do_outp_block() sends to REG_PBCORE in one go
+#define PBCORE_STREAM_BYTES 512
+
+// Number of 512 byte blocks usb_read_ram() requests from the board at once.
+// One such batch is on the wire while the previous one is being copied out.
+#define USB_READ_BLOCKS 4
+
 #define EP1OUT 0x01
 #define EP2OUT 0x02
 #define EP6IN  0x86
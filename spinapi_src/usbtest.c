@@ -47,6 +47,7 @@ extern char version[];
 
 void regtest ();
 int ramtest ();
+void xfertest ();
 void do_renum ();
 void print_data (int size, char *data_buf);
 
@@ -96,6 +97,7 @@ main (int argc, char **argv)
       printf ("1: Reset firmware\n");
       printf ("2: Run Register test\n");
       printf ("3: Run RAM test\n");
+      printf ("4: Run write throughput test\n");
       printf ("---------------------------\n");
       printf ("Choice:");
       scanf ("%d", &arg);
@@ -116,6 +118,10 @@ main (int argc, char **argv)
 	  ramtest ();
 	  system ("PAUSE");
 	  break;
+	case 4:
+	  xfertest ();
+	  system ("PAUSE");
+	  break;
 	}
     }
   while (arg);
@@ -336,6 +342,69 @@ ramtest ()
   return err;
 }
 
+/**
+ * Time how long usb_write_ram() takes for payloads of the sizes SpinAPI
+ * typically sends: the 1024 words written by pb_dds_load(), and a full
+ * instruction image of 4096 instructions of 16 bytes. The data is written to
+ * the data point ram, so no pulse program or waveform is disturbed.
+ */
+void
+xfertest ()
+{
+  int sizes[] = { 1024 * 4, 4096 * 16 };
+  char *names[] = { "pb_dds_load", "instruction image" };
+  int reps = 100;
+  int max_size = 4096 * 16;
+  int i, j;
+  int err;
+
+  unsigned int start, end;
+
+  char *write_buf = (char *) malloc (max_size);
+  if (!write_buf)
+    {
+      printf ("Error allocating buffers\n");
+      return;
+    }
+
+  for (i = 0; i < max_size; i++)
+    {
+      write_buf[i] = 0x0FF & rand ();
+    }
+
+  printf ("Largest transfer supported by the driver: %d bytes\n",
+	  os_usb_max_xfer_size (cur_dev));
+
+  for (j = 0; j < 2; j++)
+    {
+      err = 0;
+
+      start = timeGetTime ();
+      for (i = 0; i < reps; i++)
+	{
+	  if (usb_write_ram (BANK_DATARAM, 0, sizes[j], write_buf) < 0)
+	    err = 1;
+	}
+      end = timeGetTime ();
+
+      if (err)
+	{
+	  printf ("%s: write NOT succesfull\n", names[j]);
+	  continue;
+	}
+
+      printf
+	("%s: %d writes of %d bytes took %dms. %f ms/write, %f MBit/sec\n",
+	 names[j], reps, sizes[j], end - start,
+	 (float) (end - start) / reps,
+	 (float) (sizes[j] * reps * 8) / ((float) (end - start) * 1e3));
+    }
+
+  printf ("\n\n");
+
+  free (write_buf);
+}
+
 void
 print_data (int size, char *data_buf)
 {
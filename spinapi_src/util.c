@@ -33,6 +33,12 @@
 #include <time.h>
 #include <errno.h>
 
+#ifdef WINDOWS
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
 #include "spinapi.h"
 #include "driver-os.h"
 #include "util.h"
@@ -166,6 +172,79 @@ do_amcc_outp (int card_num, unsigned int address, char data)
   return XFER_ERROR;
 }
 
+/**
+ * \internal
+ * Send one word through the AMCC outgoing mailbox and wait for the board
+ * to toggle its RECV bit.
+ *
+ * \return 0 on success, -2 if the board did not respond
+ */
+static int
+amcc_send_word (int card_num, unsigned int word)
+{
+  unsigned int OGMB = 0x0C;
+  unsigned int CHK_RECV = 0x1F;
+  unsigned int SIG_TRNS = 0x0F;
+  unsigned int MAX_RECV_TIMEOUT = 1000;
+
+  unsigned int recv_start, timeout;
+
+  recv_start = os_inp (card_num, CHK_RECV) & 0x01;
+  os_outw (card_num, OGMB, word);
+
+  for (timeout = 0; timeout < MAX_RECV_TIMEOUT; timeout++)
+    {
+      if ((os_inp (card_num, CHK_RECV) & 0x01) != recv_start)
+	{
+	  os_outp (card_num, SIG_TRNS, 0);
+	  return 0;
+	}
+    }
+
+  os_outp (card_num, SIG_TRNS, 0);
+  return -2;
+}
+
+/**
+ * Write a block of bytes to the same address of a board using the AMCC chip.
+ * This does the same handshake as do_amcc_outp(), but without redoing the
+ * setup for every byte, and gives up on the first byte that times out.
+ *
+ * \return Negative number on failure and set spinerr, else 0 on success.
+ */
+int
+do_amcc_outp_block (int card_num, unsigned int address, const char *data,
+		    int len)
+{
+  unsigned int SIG_TRNS = 0x0F;
+  unsigned int SET_XFER = 0x01000000;
+
+  unsigned int addr_word = (address & 0x0F) | SET_XFER;
+  int i;
+
+  // Clear the XFER bit (Should already be cleared)
+  os_outp (card_num, SIG_TRNS, 0);
+
+  for (i = 0; i < len; i++)
+    {
+      if (amcc_send_word (card_num, addr_word) != 0)
+	{
+	  spinerr = "timeout reached while sending address";
+	  debug ("do_amcc_outp_block: %s (byte %d)\n", spinerr, i);
+	  return -2;
+	}
+
+      if (amcc_send_word (card_num, (0xFF & data[i]) | SET_XFER) != 0)
+	{
+	  spinerr = "timeout reached while sending data";
+	  debug ("do_amcc_outp_block: %s (byte %d)\n", spinerr, i);
+	  return -2;
+	}
+    }
+
+  return 0;
+}
+
 // PB02PC boards (which have device id 0x5920) use this method of transferring
 // data to the amcc chip
 int
@@ -398,6 +477,61 @@ do_amcc_inp (int card_num, unsigned int address)
 }
 
 
+/**
+ * Return the value of a high resolution clock, in seconds. Only differences
+ * between two values returned by this function are meaningful.
+ */
+double
+my_gettime (void)
+{
+#ifdef WINDOWS
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&count);
+
+  return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+
+  return (double) tv.tv_sec + 1e-6 * (double) tv.tv_usec;
+#endif
+}
+
+/**
+ * Sleep for the given time, in seconds. This is as precise as the operating
+ * system allows. On Windows, the time is rounded up to whole milliseconds,
+ * so that short sleeps do not become Sleep(0) and return at once, and the
+ * timer only ticks every 15.6 ms unless the application has called
+ * timeBeginPeriod().
+ */
+void
+my_sleep (double seconds)
+{
+  if (seconds <= 0.0)
+    {
+      return;
+    }
+#ifdef WINDOWS
+  DWORD ms = (DWORD) (1e3 * seconds);
+
+  if ((double) ms < 1e3 * seconds)
+    {
+      ms++;
+    }
+  Sleep (ms);
+#else
+  struct timespec ts;
+
+  ts.tv_sec = (time_t) seconds;
+  ts.tv_nsec = (long) (1e9 * (seconds - (double) ts.tv_sec));
+  while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+    ;
+#endif
+}
+
 /**
  * Return a string which is of the form:<br>
  * a: b
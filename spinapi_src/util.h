@@ -35,9 +35,13 @@ extern char *spinerr;
 char do_amcc_inp (int card_num, unsigned int address);
 int do_amcc_outp (int card_num, unsigned int address, char data);
 int do_amcc_outp_old (int card_num, unsigned int address, int data);
+int do_amcc_outp_block (int card_num, unsigned int address, const char *data,
+			int len);
 
 char *my_strcat (char *a, char *b);
 char *my_sprintf (char *format, ...);
+double my_gettime (void);
+void my_sleep (double seconds);
 
 void _debug (const char* function, char *format, ...);
 extern int do_debug;